@@ -0,0 +1,269 @@
+/* Address family and count statistics.
+
+   How many names have IPv4 addresses only, IPv6 only or both, and how
+   the numbers of addresses and aliases per record are distributed,
+   together with the mean size of the records with that many.  All of
+   it is in the fixed response headers, h_addrtype, h_addr_list_cnt and
+   h_aliases_cnt of host records and naddrs of addrinfo records, plus
+   the family bytes of the latter: no address is read or formatted and
+   no alias walked.
+
+   A host name is looked up separately for each family, so its families
+   come from its GETHOSTBYNAME and GETHOSTBYNAMEv6 records together,
+   the other one found through the hash chains as nscd would.  An
+   addrinfo record holds both.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "nscd_dump.h"
+
+/* Families of a name, as a mask. */
+enum {
+	FAMILY_V4 = 1,
+	FAMILY_V6 = 2,
+	NFAMILIES = 4
+};
+
+static const char *const family_names[NFAMILIES] = {
+	"no address", "IPv4 only", "IPv6 only", "dual-stack"
+};
+
+/* Bins of counts: 0 to 4 alone, then powers of two. */
+#define NBINS		9
+
+static const char *const bin_names[NBINS] = {
+	"0", "1", "2", "3", "4", "5-8", "9-16", "17-32", "33+"
+};
+
+struct histogram {
+	unsigned long records[NBINS];
+	unsigned long long bytes[NBINS];
+};
+
+struct addr_stats {
+	unsigned long hst_names[NFAMILIES], ai_names[NFAMILIES];
+	struct histogram hst_addrs, ai_addrs, aliases;
+	unsigned long long v4_addrs, v6_addrs;
+	unsigned long negative, malformed;
+};
+
+static unsigned
+bin (nscd_ssize_t n) {
+	if (n <= 4)
+		return n;
+	if (n <= 8)
+		return 5;
+	if (n <= 16)
+		return 6;
+	return n <= 32 ? 7 : 8;
+}
+
+static void
+histogram_add (struct histogram *h, nscd_ssize_t n, size_t bytes) {
+	h->records[bin (n)]++;
+	h->bytes[bin (n)] += bytes;
+}
+
+/* The host record header of DH, NULL if the record is negative or
+   smaller than the header.
+ */
+static hst_response_header *
+hst_header (struct datahead *dh) {
+	if (dh->notfound || dh->recsize < sizeof (hst_response_header))
+		return NULL;
+	hst_response_header *resp = &dh->data[0].hstdata;
+	if (resp->h_addr_list_cnt < 0 || resp->h_aliases_cnt < 0)
+		return NULL;
+	return resp;
+}
+
+/* The families with addresses of the host record in DH. */
+static int
+hst_families (struct datahead *dh) {
+	hst_response_header *resp = hst_header (dh);
+
+	if (resp == NULL || resp->h_addr_list_cnt == 0)
+		return 0;
+	if (resp->h_addrtype == AF_INET)
+		return FAMILY_V4;
+	return resp->h_addrtype == AF_INET6 ? FAMILY_V6 : 0;
+}
+
+/* The packet of the record of TYPE for the key of HE, the way nscd
+   looks it up, NULL if there is none.
+ */
+static struct datahead *
+find_packet (struct database_pers_head *head, const char *data,
+			 const struct hashentry *he, request_type type) {
+	const char *key = data + he->key;
+	ref_t run = head->array[nscd_hash (key, he->len) % head->module];
+
+	while (run != ENDREF) {
+		struct hashentry *other = (struct hashentry *) (data + run);
+
+		if (   other->type == type && other->len == he->len
+			&& memcmp (data + other->key, key, he->len) == 0)
+			return (struct datahead *) (data + other->packet);
+		run = other->next;
+	}
+	return NULL;
+}
+
+static void
+count_hst (struct addr_stats *s, struct database_pers_head *head,
+		   const char *data, struct hashentry *he, struct datahead *dh) {
+	hst_response_header *resp = hst_header (dh);
+
+	if (resp != NULL) {
+		histogram_add (&s->hst_addrs, resp->h_addr_list_cnt, dh->allocsize);
+		histogram_add (&s->aliases, resp->h_aliases_cnt, dh->allocsize);
+		if (resp->h_addrtype == AF_INET)
+			s->v4_addrs += resp->h_addr_list_cnt;
+		else if (resp->h_addrtype == AF_INET6)
+			s->v6_addrs += resp->h_addr_list_cnt;
+	}
+
+	/* A name with records of both families is counted with the
+	   IPv4 one.
+	 */
+	if (he->type == GETHOSTBYNAME) {
+		struct datahead *v6 = find_packet (head, data, he, GETHOSTBYNAMEv6);
+
+		s->hst_names[hst_families (dh) | (v6 ? hst_families (v6) : 0)]++;
+	} else if (   he->type == GETHOSTBYNAMEv6
+			   && find_packet (head, data, he, GETHOSTBYNAME) == NULL)
+		s->hst_names[hst_families (dh)]++;
+}
+
+static void
+count_ai (struct addr_stats *s, struct datahead *dh) {
+	ai_response_header *resp = &dh->data[0].aidata;
+
+	if (dh->notfound) {
+		s->ai_names[0]++;
+		return;
+	}
+	if (   dh->recsize < sizeof (*resp) || resp->naddrs < 0
+		|| resp->addrslen < 0
+		||   sizeof (*resp) + (size_t) resp->addrslen + resp->naddrs
+		   > dh->recsize) {
+		s->malformed++;
+		return;
+	}
+
+	const uint8_t *families = (const uint8_t *) (resp + 1) + resp->addrslen;
+	int mask = 0;
+	for (nscd_ssize_t i = 0; i < resp->naddrs; i++)
+		if (families[i] == AF_INET6) {
+			mask |= FAMILY_V6;
+			s->v6_addrs++;
+		} else {
+			mask |= FAMILY_V4;
+			s->v4_addrs++;
+		}
+	s->ai_names[mask]++;
+	histogram_add (&s->ai_addrs, resp->naddrs, dh->allocsize);
+}
+
+static double
+percent (unsigned long long part, unsigned long long all) {
+	return all ? 100.0 * part / all : 0;
+}
+
+static void
+print_histogram (const char *title, const struct histogram *h) {
+	unsigned long total = 0;
+
+	for (int i = 0; i < NBINS; i++)
+		total += h->records[i];
+	if (total == 0)
+		return;
+
+	printf ("\n%-15s %9s %7s %11s\n", title, "Records", "", "Mean bytes");
+	for (int i = 0; i < NBINS; i++)
+		if (h->records[i] != 0)
+			printf ("%-15s %9lu %6.1f%% %11.0f\n", bin_names[i],
+					h->records[i], percent (h->records[i], total),
+					(double) h->bytes[i] / h->records[i]);
+}
+
+static void
+print_families (const char *title, const unsigned long names[NFAMILIES]) {
+	unsigned long total = 0;
+
+	for (int f = 0; f < NFAMILIES; f++)
+		total += names[f];
+	if (total == 0)
+		return;
+
+	printf ("%-25s : %lu\n", title, total);
+	for (int f = 1; f < NFAMILIES; f++)
+		printf ("  %-23s : %lu (%.1f%%)\n", family_names[f], names[f],
+				percent (names[f], total));
+	printf ("  %-23s : %lu (%.1f%%)\n", family_names[0], names[0],
+			percent (names[0], total));
+}
+
+/* Report the address families and counts of the records of DB. */
+int
+addr_stats_db (struct db_file *db) {
+	struct database_pers_head *head = db->mem;
+	struct addr_stats s;
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	memset (&s, 0, sizeof (s));
+	char *data = db_data (head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+			struct datahead *dh = (struct datahead *) (data + he->packet);
+
+			run = he->next;
+			if (!he->first)
+				continue;
+			if (he->type == GETAI)
+				count_ai (&s, dh);
+			else if (   he->type == GETHOSTBYNAME
+					 || he->type == GETHOSTBYNAMEv6
+					 || he->type == GETHOSTBYADDR
+					 || he->type == GETHOSTBYADDRv6)
+				count_hst (&s, head, data, he, dh);
+			else
+				continue;
+			s.negative += dh->notfound != 0;
+		}
+
+	print_families ("Host names", s.hst_names);
+	print_families ("Addrinfo names", s.ai_names);
+	printf ("Addresses                 : %llu IPv4, %llu IPv6 (%.1f%%)\n",
+			s.v4_addrs, s.v6_addrs,
+			percent (s.v6_addrs, s.v4_addrs + s.v6_addrs));
+	printf ("Negative host/AI records  : %lu\n", s.negative);
+	if (s.malformed != 0)
+		printf ("Malformed records         : %lu\n", s.malformed);
+
+	print_histogram ("Host addresses", &s.hst_addrs);
+	print_histogram ("AI addresses", &s.ai_addrs);
+	print_histogram ("Host aliases", &s.aliases);
+	return 0;
+}
@@ -0,0 +1,331 @@
+/* Structure-preserving anonymizer.
+
+   Produces a copy of a database that can be shared for benchmarking:
+   keys, names, aliases and addresses are replaced with keyed pseudonyms
+   of the same length.  Offsets, chains, sizes and timeouts stay as they
+   were, so the copy has the exact memory layout of the original.
+
+   Pseudonyms depend only on the secret and the original value, so a
+   name maps to the same pseudonym in every record (and in every copy
+   made with the same secret).  Host names are mapped label by label,
+   which keeps shared domain suffixes shared; addresses are mapped
+   prefix-preservingly, bit by bit from the most significant one, which
+   keeps common prefixes common.  Note that the keys no longer hash to
+   the buckets holding them, so nscd itself would not find them.
+
+   Everything no live hash entry, record or key covers is zeroed: the
+   free space past first_free, holes left by the garbage collector,
+   dead records and the slack at the end of allocations may all still
+   hold names and addresses of earlier answers.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include "nscd_dump.h"
+
+struct anon_state {
+	struct sipkey key;
+	char *data;
+	uint8_t *done_packets;		/* Bit per BLOCK_ALIGN unit. */
+	uint8_t *done_keys;			/* Bit per byte. */
+	uint8_t *live;				/* Bit per byte, kept. */
+	unsigned long records, keys;
+};
+
+/* Replace the LEN bytes of host name S, label by label.  Each label is
+   hashed case-insensitively and its letters and digits are replaced by
+   pseudo-random ones of the same class and case; dots, dashes and
+   anything else stay in place.
+ */
+static void
+anon_name (const struct sipkey *key, char *s, size_t len) {
+	char label[256];
+
+	for (size_t begin = 0; begin < len; ) {
+		size_t end = begin;
+		while (end < len && s[end] != '.')
+			end++;
+
+		size_t llen = MIN (end - begin, sizeof (label));
+		for (size_t i = 0; i < llen; i++)
+			label[i] = tolower ((unsigned char) s[begin + i]);
+		uint64_t h = siphash24 (key, label, llen);
+
+		/* Six bits per character, so a fresh hash every ten. */
+		for (size_t i = begin, n = 0; i < end; i++, n++) {
+			unsigned char c = s[i];
+
+			if (n != 0 && n % 10 == 0)
+				h = siphash24 (key, &h, sizeof (h));
+			unsigned r = (h >> (6 * (n % 10))) & 0x3f;
+
+			if (islower (c))
+				s[i] = 'a' + r % 26;
+			else if (isupper (c))
+				s[i] = 'A' + r % 26;
+			else if (isdigit (c))
+				s[i] = '0' + r % 10;
+		}
+
+		begin = end + 1;
+	}
+}
+
+/* Replace the LEN byte address ADDR prefix-preservingly: bit I is
+   flipped or not depending on a keyed function of bits 0 .. I-1 only.
+ */
+static void
+anon_addr (const struct sipkey *key, uint8_t *addr, size_t len) {
+	uint8_t prefix[sizeof (struct in6_addr) + 1];
+	uint8_t out[sizeof (struct in6_addr)];
+
+	if (len > sizeof (out))
+		return;
+
+	memset (out, 0, sizeof (out));
+	for (size_t bit = 0; bit < len * 8; bit++) {
+		memset (prefix, 0, sizeof (prefix));
+		memcpy (prefix, addr, bit / 8);
+		if (bit % 8)
+			prefix[bit / 8] = addr[bit / 8] & (0xff << (8 - bit % 8));
+		prefix[len] = bit;
+
+		unsigned flip = siphash24 (key, prefix, len + 1) & 1;
+		unsigned in = (addr[bit / 8] >> (7 - bit % 8)) & 1;
+		out[bit / 8] |= (in ^ flip) << (7 - bit % 8);
+	}
+	memcpy (addr, out, len);
+}
+
+/* Strings are stored with their terminating NUL, which stays. */
+static void
+anon_string (const struct sipkey *key, char *s, size_t len) {
+	if (len > 0)
+		anon_name (key, s, len - 1);
+}
+
+static int
+anon_record (struct anon_state *st, struct hashentry *he,
+			 struct datahead *dh) {
+	if (he->type == GETAI) {
+		struct ai_view ai;
+
+		if (decode_ai (dh, &ai) != 0)
+			return -1;
+
+		uint8_t *addr = ai.addrs;
+		for (nscd_ssize_t i = 0; i < ai.resp->naddrs; i++) {
+			anon_addr (&st->key, addr, ai_addr_len (ai.families[i]));
+			addr += ai_addr_len (ai.families[i]);
+		}
+		anon_string (&st->key, ai.canon, ai.resp->canonlen);
+		return 0;
+	}
+
+	struct hst_view hst;
+	if (decode_hst (dh, &hst) != 0)
+		return -1;
+
+	anon_string (&st->key, hst.name, hst.resp->h_name_len);
+	for (nscd_ssize_t i = 0; i < hst.resp->h_addr_list_cnt; i++)
+		anon_addr (&st->key, hst.addrs + i * hst.resp->h_length,
+				   hst.resp->h_length);
+
+	char *alias = hst.aliases;
+	for (nscd_ssize_t i = 0; i < hst.resp->h_aliases_cnt; i++) {
+		anon_string (&st->key, alias, hst_alias_len (&hst, i));
+		alias += hst_alias_len (&hst, i);
+	}
+	return 0;
+}
+
+/* Keys stored behind the record are copies and need their own
+   rewrite; keys inside it are names or addresses rewritten above.
+ */
+static void
+anon_key (struct anon_state *st, struct hashentry *he, struct datahead *dh) {
+	if (he->key < he->packet + sizeof (struct datahead) + dh->recsize)
+		return;
+	if (test_and_set (st->done_keys, he->key))
+		return;
+
+	char *key = st->data + he->key;
+	if (   (he->type == GETHOSTBYADDR || he->type == GETHOSTBYADDRv6)
+		&& he->len <= (nscd_ssize_t) sizeof (struct in6_addr))
+		anon_addr (&st->key, (uint8_t *) key, he->len);
+	else
+		anon_string (&st->key, key, he->len);
+	st->keys++;
+}
+
+/* Note the LEN bytes at data offset START as kept. */
+static void
+mark_live (struct anon_state *st, size_t start, size_t len) {
+	for (size_t i = start; i < start + len; i++)
+		st->live[i / 8] |= 1 << (i % 8);
+}
+
+/* Zero the bytes of the data area of HEAD, DATA_SIZE bytes long, not
+   marked live.
+ */
+static void
+scrub (struct anon_state *st, struct database_pers_head *head,
+	   size_t data_size) {
+	size_t first_free = head->first_free;
+
+	for (size_t i = 0; i < first_free; i++) {
+		if (st->live[i / 8] == 0xff) {
+			i |= 7;
+			continue;
+		}
+		if (!(st->live[i / 8] & (1 << (i % 8))))
+			st->data[i] = 0;
+	}
+	memset (st->data + first_free, 0, data_size - first_free);
+}
+
+static int
+copy_file (struct db_file *in, int fd) {
+	const char *p = in->mem;
+	size_t left = in->st.st_size;
+
+	while (left > 0) {
+		ssize_t n = write (fd, p, left);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		left -= n;
+	}
+	return 0;
+}
+
+/* Write an anonymized copy of IN to OUT_NAME, with pseudonyms keyed by
+   SECRET or by a random key if that is NULL.
+ */
+int
+anonymize_db (struct db_file *in, const char *out_name, const char *secret) {
+	const char *msg = verify_persistent_db (in->mem, &in->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 in->name, msg);
+		return -1;
+	}
+
+	struct anon_state st;
+	memset (&st, 0, sizeof (st));
+	if (secret != NULL)
+		sipkey_from_string (&st.key, secret);
+	else if (getrandom (&st.key, sizeof (st.key), 0) != sizeof (st.key)) {
+		fprintf (stderr, "Cannot get a random key: %s\n", strerror (errno));
+		return -1;
+	}
+
+	int fd = open (out_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n",
+				 out_name, strerror (errno));
+		return -1;
+	}
+
+	void *mem = MAP_FAILED;
+	if (copy_file (in, fd) == 0)
+		mem = mmap (NULL, in->st.st_size, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		fprintf (stderr, "Cannot write \"%s\": %s\n",
+				 out_name, strerror (errno));
+		close (fd);
+		unlink (out_name);
+		return -1;
+	}
+
+	struct database_pers_head *head = mem;
+	size_t first_free = head->first_free;
+	st.data = db_data (head);
+	st.done_packets = calloc (first_free / BLOCK_ALIGN / 8 + 1, 1);
+	st.done_keys = calloc (first_free / 8 + 1, 1);
+	st.live = calloc (first_free / 8 + 1, 1);
+
+	int rc = st.done_packets && st.done_keys && st.live ? 0 : -1;
+	for (nscd_ssize_t cnt = 0; rc == 0 && cnt < head->module; ++cnt) {
+		for (ref_t work = head->array[cnt]; work != ENDREF; ) {
+			struct hashentry *here = (struct hashentry *) (st.data + work);
+			struct datahead *dh = (struct datahead *) (st.data + here->packet);
+
+			if (!test_and_set (st.done_packets, here->packet / BLOCK_ALIGN)) {
+				if (anon_record (&st, here, dh) != 0) {
+					fprintf (stderr, "Record at offset %u cannot be decoded,"
+							 " not writing a partially anonymized copy\n",
+							 here->packet);
+					rc = -1;
+					break;
+				}
+				st.records++;
+				mark_live (&st, here->packet,
+						   sizeof (struct datahead) + dh->recsize);
+			}
+			anon_key (&st, here, dh);
+			mark_live (&st, work, sizeof (struct hashentry));
+			mark_live (&st, here->key, here->len);
+
+			work = here->next;
+		}
+	}
+
+	/* What lies behind the data area is not part of the database. */
+	size_t data_end = st.data - (char *) mem + head->data_size;
+	if (rc == 0) {
+		scrub (&st, head, head->data_size);
+		if ((size_t) in->st.st_size > data_end)
+			memset ((char *) mem + data_end, 0, in->st.st_size - data_end);
+	}
+
+	free (st.done_packets);
+	free (st.done_keys);
+	free (st.live);
+	munmap (mem, in->st.st_size);
+	if (rc == 0 && fsync (fd) != 0)
+		rc = -1;
+	close (fd);
+
+	if (rc != 0) {
+		unlink (out_name);
+		return -1;
+	}
+
+	/* The copy must pass the same verification as the original. */
+	struct db_file out;
+	if (db_open (&out, out_name) != 0)
+		return -1;
+	msg = verify_persistent_db (out.mem, &out.head);
+	db_close (&out);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating anonymized file \"%s\": %s\n",
+				 out_name, msg);
+		return -1;
+	}
+
+	printf ("Anonymized %lu records and %lu separate keys into \"%s\"\n",
+			st.records, st.keys, out_name);
+	return 0;
+}
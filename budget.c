@@ -0,0 +1,240 @@
+/* Time-budgeted ("anytime") statistics walk.
+
+   Instead of verifying and dumping everything, visit the buckets in a
+   random order until the budget runs out, then report what was seen
+   along with totals extrapolated from the fraction of buckets covered.
+   The order is a shuffle drawn as the walk goes, so the buckets seen
+   are a simple random sample at any point of it and the estimates are
+   unbiased however early the walk is stopped.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+/* Buckets, and entries of one chain, walked between two looks at the
+   clock.
+ */
+#define BUDGET_CHECK_INTERVAL	64
+#define BUDGET_CHECK_ENTRIES	1024
+
+struct budget_stats {
+	nscd_ssize_t buckets;
+	unsigned long long entries;
+	unsigned long long sum_sq;		/* Of entries per bucket. */
+	unsigned long long by_type[LASTREQ];
+	unsigned long long positive, negative;
+	unsigned long long packets, packet_bytes;
+	unsigned long long invalid;
+	nscd_ssize_t longest_chain;
+	nscd_ssize_t cut_short;			/* Entries of the bucket left. */
+};
+
+static double
+now_ms (void) {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* The checks verify_persistent_db () makes on a single hashentry and its
+   packet, minus those needing the map of the whole data area.
+ */
+static int
+entry_sane (struct database_pers_head *head, const char *data, ref_t work) {
+	if (   work > (ref_t) head->first_free
+		|| work + sizeof (struct hashentry) > (ref_t) head->first_free
+		|| (work & BLOCK_ALIGN_M1))
+		return 0;
+
+	struct hashentry *here = (struct hashentry *) (data + work);
+	if (    here->type >= LASTREQ
+		|| !(   here->type == GETHOSTBYNAME
+			 || here->type == GETHOSTBYNAMEv6
+			 || here->type == GETHOSTBYADDR
+			 || here->type == GETHOSTBYADDRv6
+			 || here->type == GETAI)
+		|| here->len < 0
+		|| here->packet + sizeof (struct datahead) > (ref_t) head->first_free)
+		return 0;
+
+	struct datahead *dh = (struct datahead *) (data + here->packet);
+	if (   dh->allocsize < (nscd_ssize_t) sizeof (struct datahead)
+		|| dh->allocsize > (nscd_ssize_t) (head->first_free - here->packet)
+		|| dh->recsize > dh->allocsize)
+		return 0;
+
+	return 1;
+}
+
+/* Walk bucket CNT into ST.  Returns -1, leaving ST as it was, if
+   DEADLINE passed before the end of its chain.
+ */
+static int
+walk_bucket (struct database_pers_head *head, const char *data,
+			 nscd_ssize_t cnt, struct budget_stats *st, double deadline) {
+	struct budget_stats before = *st;
+	ref_t work = head->array[cnt];
+	ref_t trail = work;
+	nscd_ssize_t len = 0;
+	int tick = 0;
+
+	while (work != ENDREF) {
+		/* A part of a bucket is no sample, so its counts are dropped. */
+		if (   len % BUDGET_CHECK_ENTRIES == BUDGET_CHECK_ENTRIES - 1
+			&& now_ms () >= deadline) {
+			*st = before;
+			st->cut_short = len;
+			return -1;
+		}
+		if (!entry_sane (head, data, work)) {
+			st->invalid++;
+			break;
+		}
+
+		struct hashentry *here = (struct hashentry *) (data + work);
+		struct datahead *dh = (struct datahead *) (data + here->packet);
+
+		len++;
+		st->by_type[here->type]++;
+		if (here->first) {
+			st->packets++;
+			st->packet_bytes += dh->allocsize;
+			if (dh->notfound)
+				st->negative++;
+			else
+				st->positive++;
+		}
+
+		work = here->next;
+		if (work == trail) {
+			st->invalid++;
+			break;
+		}
+		if (tick)
+			trail = ((struct hashentry *) (data + trail))->next;
+		tick = 1 - tick;
+	}
+
+	st->entries += len;
+	st->sum_sq += (unsigned long long) len * len;
+	st->buckets++;
+	if (len > st->longest_chain)
+		st->longest_chain = len;
+	return 0;
+}
+
+static void
+print_estimate (const char *what, unsigned long long seen, double scale) {
+	printf ("  %-22s: %10llu seen, ~%.0f total\n", what, seen, seen * scale);
+}
+
+/* Walk DB for at most BUDGET_MS milliseconds and print the partial
+   statistics.  Returns non-zero if the header is not sane enough to
+   start.
+ */
+int
+budget_walk (struct db_file *db, unsigned budget_ms) {
+	struct database_pers_head *head = db->mem;
+	const char *msg = verify_db_header (head, &db->head);
+
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	const char *data = db_data (head);
+	nscd_ssize_t module = head->module;
+	double start = now_ms (), deadline = start + budget_ms;
+
+	/* Fisher-Yates, one step per bucket visited: the next bucket is
+	   drawn from those not visited yet.
+	 */
+	nscd_ssize_t *order = malloc (module * sizeof (*order));
+	if (order == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+	for (nscd_ssize_t i = 0; i < module; i++)
+		order[i] = i;
+
+	unsigned seed = time (NULL) ^ getpid ();
+	srandom (seed);
+
+	struct budget_stats st;
+	memset (&st, 0, sizeof (st));
+
+	while (st.buckets < module) {
+		nscd_ssize_t i = st.buckets;
+		nscd_ssize_t j = i + random () % (module - i);
+		nscd_ssize_t pos = order[j];
+
+		order[j] = order[i];
+		order[i] = pos;
+		if (walk_bucket (head, data, pos, &st, deadline) != 0)
+			break;
+
+		if (st.buckets % BUDGET_CHECK_INTERVAL == 0 && now_ms () >= deadline)
+			break;
+	}
+
+	free (order);
+
+	double elapsed = now_ms () - start;
+	double fraction = (double) st.buckets / module;
+	double scale = 1 / fraction;
+
+	printf ("Time budget %u ms, used %.1f ms, random seed %u\n",
+			budget_ms, elapsed, seed);
+	printf ("Buckets covered           : %d of %d (%.2f%%)\n",
+			st.buckets, module, fraction * 100);
+	printf ("Longest chain seen        : %d\n", st.longest_chain);
+	if (st.cut_short != 0)
+		printf ("Stopped within a bucket   : after %d entries of its chain,"
+				" not counted\n", st.cut_short);
+	if (st.buckets == 0) {
+		printf ("No bucket walked to its end within the budget\n");
+		return 0;
+	}
+
+	/* Standard error of the bucket-sampled total, with the finite
+	   population correction.
+	 */
+	double mean = (double) st.entries / st.buckets;
+	double var = st.buckets > 1
+		? ((double) st.sum_sq - st.buckets * mean * mean) / (st.buckets - 1)
+		: 0;
+	double se = module * sqrt (var / st.buckets * (1 - fraction));
+	printf ("Number of entries         : %llu seen, ~%.0f +- %.0f total"
+			" (header says %d)\n",
+			st.entries, st.entries * scale, se, head->nentries);
+
+	for (int type = 0; type < LASTREQ; type++)
+		if (st.by_type[type] != 0)
+			print_estimate (serv2str[type], st.by_type[type], scale);
+	print_estimate ("Records", st.packets, scale);
+	print_estimate ("Positive records", st.positive, scale);
+	print_estimate ("Negative records", st.negative, scale);
+	print_estimate ("Record bytes", st.packet_bytes, scale);
+	if (st.invalid != 0)
+		printf ("Chains cut short by invalid entries: %llu\n", st.invalid);
+
+	return 0;
+}
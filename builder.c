@@ -0,0 +1,318 @@
+/* Construction of database files from scratch.
+
+   Lays records out the way nscd does: packets and hash entries are
+   carved from the data area in allocation order at BLOCK_ALIGN
+   boundaries, and each hash entry is pushed to the front of the chain of
+   its bucket.  The result passes verify_persistent_db ().
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+int
+builder_init (struct db_builder *b, nscd_ssize_t module) {
+	memset (b, 0, sizeof (*b));
+
+	if (module <= 0 || (size_t) module > INT32_MAX / sizeof (ref_t))
+		return -1;
+
+	b->module = module;
+	b->array = malloc (module * sizeof (ref_t));
+	if (b->array == NULL)
+		return -1;
+	for (nscd_ssize_t i = 0; i < module; i++)
+		b->array[i] = ENDREF;
+	b->chain_len = calloc (module, sizeof (*b->chain_len));
+	if (b->chain_len == NULL) {
+		free (b->array);
+		return -1;
+	}
+	b->bucket = -1;
+	b->now = time (NULL);
+	return 0;
+}
+
+void
+builder_free (struct db_builder *b) {
+	free (b->array);
+	free (b->chain_len);
+	free (b->data);
+}
+
+/* Allocate SIZE bytes of the data area, followed by the configured gap.
+   Returns the offset, ENDREF when the data area would exceed what a
+   header can describe.
+ */
+ref_t
+builder_alloc (struct db_builder *b, size_t size) {
+	size_t start = b->first_free;
+	size_t end = roundup (start + size + b->gap, BLOCK_ALIGN);
+
+	if (end > INT32_MAX - b->module * sizeof (ref_t) - ALIGN)
+		return ENDREF;
+
+	if (end > b->capacity) {
+		size_t capacity = MAX (end, b->capacity * 2);
+		char *data = realloc (b->data, capacity);
+		if (data == NULL)
+			return ENDREF;
+		memset (data + b->capacity, 0, capacity - b->capacity);
+		b->data = data;
+		b->capacity = capacity;
+	}
+
+	b->first_free = end;
+	return start;
+}
+
+/* Add a hash entry for the LEN byte key at KEY, which must lie within
+   PACKET, and link it into the bucket its key hashes to (or into
+   b->bucket if that is set).
+ */
+int
+builder_add_entry (struct db_builder *b, request_type type, bool first,
+				   ref_t key, nscd_ssize_t len, ref_t packet) {
+	ref_t off = builder_alloc (b, sizeof (struct hashentry));
+	if (off == ENDREF)
+		return -1;
+
+	nscd_ssize_t bucket = b->bucket >= 0
+		? b->bucket % b->module
+		: nscd_hash (b->data + key, len) % b->module;
+
+	struct hashentry *he = (struct hashentry *) (b->data + off);
+	he->type = type;
+	he->first = first;
+	he->len = len;
+	he->key = key;
+	he->owner = 0;
+	he->packet = packet;
+	he->next = b->array[bucket];
+	b->array[bucket] = off;
+
+	b->nentries++;
+	if (++b->chain_len[bucket] > b->maxnsearched)
+		b->maxnsearched = b->chain_len[bucket];
+	return 0;
+}
+
+/* Allocate a packet for a record of RECSIZE bytes plus a key of KEYLEN
+   bytes behind it, and fill in its data head.
+ */
+static ref_t
+alloc_packet (struct db_builder *b, size_t recsize, size_t keylen,
+			  bool notfound, unsigned ttl) {
+	size_t allocsize = sizeof (struct datahead) + recsize + keylen;
+	ref_t packet = builder_alloc (b, allocsize);
+	if (packet == ENDREF)
+		return ENDREF;
+
+	struct datahead *dh = (struct datahead *) (b->data + packet);
+	dh->allocsize = allocsize;
+	dh->recsize = recsize;
+	dh->timeout = b->now + ttl;
+	dh->notfound = notfound;
+	dh->nreloads = 0;
+	dh->usable = true;
+	return packet;
+}
+
+/* Add a copy of the ALLOCSIZE byte packet at PACKET as it is, storing
+   its offset in *OFF.  Its hash entries are added by the caller.
+ */
+int
+builder_add_packet (struct db_builder *b, const void *packet,
+					size_t allocsize, ref_t *off) {
+	*off = builder_alloc (b, allocsize);
+	if (*off == ENDREF)
+		return -1;
+	memcpy (b->data + *off, packet, allocsize);
+	return 0;
+}
+
+/* Add a host record for REC under KEY.  With rec->alias_entries, every
+   alias and every address gets a hash entry of its own pointing into
+   the packet, as nscd makes for name lookups.
+ */
+int
+builder_add_hst (struct db_builder *b, const struct builder_hst *rec) {
+	size_t name_len = strlen (rec->name) + 1;
+	size_t aliases_len = 0;
+	for (int i = 0; i < rec->naliases; i++)
+		aliases_len += strlen (rec->aliases[i]) + 1;
+
+	size_t recsize = sizeof (hst_response_header) + name_len
+		+ rec->naliases * sizeof (uint32_t)
+		+ (size_t) rec->naddrs * rec->addrlen + aliases_len;
+	ref_t packet = alloc_packet (b, recsize, rec->keylen, rec->notfound,
+								 rec->ttl);
+	if (packet == ENDREF)
+		return -1;
+
+	struct datahead *dh = (struct datahead *) (b->data + packet);
+	hst_response_header *resp = &dh->data[0].hstdata;
+	resp->version = NSCD_VERSION;
+	resp->found = !rec->notfound;
+	resp->h_name_len = name_len;
+	resp->h_aliases_cnt = rec->naliases;
+	resp->h_addrtype = rec->addrlen == sizeof (struct in6_addr)
+		? AF_INET6 : AF_INET;
+	resp->h_length = rec->addrlen;
+	resp->h_addr_list_cnt = rec->naddrs;
+	resp->error = 0;
+
+	char *p = (char *) (resp + 1);
+	memcpy (p, rec->name, name_len);
+	p += name_len;
+	for (int i = 0; i < rec->naliases; i++) {
+		uint32_t len = strlen (rec->aliases[i]) + 1;
+		memcpy (p, &len, sizeof (len));
+		p += sizeof (len);
+	}
+	ref_t addrs = p - b->data;
+	memcpy (p, rec->addrs, (size_t) rec->naddrs * rec->addrlen);
+	p += (size_t) rec->naddrs * rec->addrlen;
+	ref_t aliases = p - b->data;
+	for (int i = 0; i < rec->naliases; i++) {
+		size_t len = strlen (rec->aliases[i]) + 1;
+		memcpy (p, rec->aliases[i], len);
+		p += len;
+	}
+	ref_t key = p - b->data;
+	memcpy (p, rec->key, rec->keylen);
+
+	if (builder_add_entry (b, rec->type, true, key, rec->keylen, packet) != 0)
+		return -1;
+	if (!rec->alias_entries)
+		return 0;
+
+	for (int i = 0; i < rec->naliases; i++) {
+		size_t len = strlen (rec->aliases[i]) + 1;
+		if (builder_add_entry (b, rec->type, false, aliases, len,
+							   packet) != 0)
+			return -1;
+		aliases += len;
+	}
+	request_type addr_type = rec->addrlen == sizeof (struct in6_addr)
+		? GETHOSTBYADDRv6 : GETHOSTBYADDR;
+	for (int i = 0; i < rec->naddrs; i++)
+		if (builder_add_entry (b, addr_type, false,
+							   addrs + i * rec->addrlen, rec->addrlen,
+							   packet) != 0)
+			return -1;
+
+	return 0;
+}
+
+/* Add an addrinfo record for REC under its NUL terminated KEY. */
+int
+builder_add_ai (struct db_builder *b, const struct builder_ai *rec) {
+	size_t keylen = strlen (rec->key) + 1;
+	size_t canon_len = strlen (rec->canon) + 1;
+	size_t addrslen = 0;
+	for (int i = 0; i < rec->naddrs; i++)
+		addrslen += ai_addr_len (rec->families[i]);
+
+	size_t recsize = sizeof (ai_response_header) + addrslen + rec->naddrs
+		+ canon_len;
+	ref_t packet = alloc_packet (b, recsize, keylen, false, rec->ttl);
+	if (packet == ENDREF)
+		return -1;
+
+	struct datahead *dh = (struct datahead *) (b->data + packet);
+	ai_response_header *resp = &dh->data[0].aidata;
+	resp->version = NSCD_VERSION;
+	resp->found = 1;
+	resp->naddrs = rec->naddrs;
+	resp->addrslen = addrslen;
+	resp->canonlen = canon_len;
+	resp->error = 0;
+
+	char *p = (char *) (resp + 1);
+	memcpy (p, rec->addrs, addrslen);
+	p += addrslen;
+	memcpy (p, rec->families, rec->naddrs);
+	p += rec->naddrs;
+	memcpy (p, rec->canon, canon_len);
+	p += canon_len;
+	memcpy (p, rec->key, keylen);
+
+	return builder_add_entry (b, GETAI, true, p - b->data, keylen, packet);
+}
+
+/* Write the database to FILENAME, with SLACK more bytes of data area
+   than used.
+ */
+int
+builder_write (struct db_builder *b, const char *filename, size_t slack) {
+	struct database_pers_head head;
+	size_t array_size = roundup (b->module * sizeof (ref_t), ALIGN);
+	size_t data_size = roundup (b->first_free + slack, BLOCK_ALIGN);
+
+	memset (&head, 0, sizeof (head));
+	head.version = DB_VERSION;
+	head.header_size = sizeof (head);
+	head.timestamp = b->now;
+	head.module = b->module;
+	head.data_size = data_size;
+	head.first_free = b->first_free;
+	head.nentries = b->nentries;
+	head.maxnentries = b->nentries;
+	head.maxnsearched = b->maxnsearched;
+	if (b->like != NULL) {
+		head.gc_cycle = b->like->gc_cycle;
+		head.timestamp = b->like->timestamp;
+		head.maxnentries = MAX (b->nentries, b->like->maxnentries);
+		head.poshit = b->like->poshit;
+		head.neghit = b->like->neghit;
+		head.posmiss = b->like->posmiss;
+		head.negmiss = b->like->negmiss;
+		head.rdlockdelayed = b->like->rdlockdelayed;
+		head.wrlockdelayed = b->like->wrlockdelayed;
+		head.addfailed = b->like->addfailed;
+	}
+
+	int fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n",
+				 filename, strerror (errno));
+		return -1;
+	}
+
+	/* The bucket array is padded to ALIGN, and the data area past
+	   first_free is zero like in a fresh nscd file.
+	 */
+	int rc = 0;
+	if (   write (fd, &head, sizeof (head)) != sizeof (head)
+		|| write (fd, b->array, b->module * sizeof (ref_t))
+			!= (ssize_t) (b->module * sizeof (ref_t))
+		|| ftruncate (fd, sizeof (head) + array_size) != 0
+		|| lseek (fd, 0, SEEK_END) < 0
+		|| write (fd, b->data, b->first_free) != (ssize_t) b->first_free
+		|| ftruncate (fd, sizeof (head) + array_size + data_size) != 0)
+		rc = -1;
+
+	if (close (fd) != 0)
+		rc = -1;
+	if (rc != 0)
+		fprintf (stderr, "Cannot write \"%s\": %s\n",
+				 filename, strerror (errno));
+	return rc;
+}
@@ -0,0 +1,91 @@
+/* Bounds-checked views of the response records in packets.
+
+   print_hst_resp_data () and print_ai_resp_data () walk the records
+   trusting their counts.  The analyses and rewriters locate the same
+   fields through these views instead, which check that everything the
+   header promises fits into the record size.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "nscd_dump.h"
+
+/* Decode the host record in DH into VIEW.  Returns 0 if all of it lies
+   within the record size, -1 otherwise.
+ */
+int
+decode_hst (struct datahead *dh, struct hst_view *view) {
+	hst_response_header *resp = &dh->data[0].hstdata;
+	size_t size = dh->recsize;
+	size_t used = sizeof (*resp);
+
+	if (size < used)
+		return -1;
+
+	view->resp = resp;
+	if (   resp->h_name_len < 0 || resp->h_aliases_cnt < 0
+		|| resp->h_addr_list_cnt < 0 || resp->h_length < 0
+		|| resp->h_aliases_cnt > (nscd_ssize_t) (size / sizeof (uint32_t))
+		|| resp->h_addr_list_cnt > (nscd_ssize_t) size
+		|| resp->h_length > (int32_t) sizeof (struct in6_addr))
+		return -1;
+
+	view->name = (char *) (resp + 1);
+	used += resp->h_name_len;
+	view->aliases_len = (uint8_t *) resp + used;
+	used += resp->h_aliases_cnt * sizeof (uint32_t);
+	view->addrs = (uint8_t *) resp + used;
+	used += (size_t) resp->h_addr_list_cnt * resp->h_length;
+	view->aliases = (char *) resp + used;
+	if (used > size)
+		return -1;
+
+	for (nscd_ssize_t i = 0; i < resp->h_aliases_cnt; i++) {
+		used += hst_alias_len (view, i);
+		if (used > size)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Same for the addrinfo record in DH.  The address area must also
+   match what the family bytes say it holds.
+ */
+int
+decode_ai (struct datahead *dh, struct ai_view *view) {
+	ai_response_header *resp = &dh->data[0].aidata;
+	size_t size = dh->recsize;
+
+	if (size < sizeof (*resp))
+		return -1;
+
+	view->resp = resp;
+	if (   resp->naddrs < 0 || resp->addrslen < 0 || resp->canonlen < 0
+		||   sizeof (*resp) + (size_t) resp->addrslen + resp->naddrs
+		   + resp->canonlen > size)
+		return -1;
+
+	view->addrs = (uint8_t *) (resp + 1);
+	view->families = view->addrs + resp->addrslen;
+	view->canon = (char *) view->families + resp->naddrs;
+
+	size_t addrslen = 0;
+	for (nscd_ssize_t i = 0; i < resp->naddrs; i++)
+		addrslen += ai_addr_len (view->families[i]);
+	if (addrslen != (size_t) resp->addrslen)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,616 @@
+/* Record-level deltas between database snapshots.
+
+   A record is a packet together with the hash entries pointing into
+   it, and is identified by its main key: the type and key of its entry
+   with first set.  The delta from a base to a new snapshot holds the
+   header of the new one, the keys of the records gone from it, and
+   the packets and entry lists of the records added or changed.  Each
+   snapshot is its own index: a record is looked up in the other one
+   through the bucket of its key.  The entries of each input are still
+   grouped by packet in memory, 8 bytes per entry, to find the records.
+
+   Applying a delta rebuilds the new snapshot with the builder from the
+   unchanged records of the base and the records of the delta.  The
+   layout differs from the original, the answers do not: the semantic
+   fingerprint of the result is checked against the one recorded.  The
+   delta is mapped and read in passes, not copied to memory, but nothing
+   is streamed: the result is built whole before it is written, since
+   its bucket array links anywhere into its data, so memory grows with
+   the result, by about the size of the database itself plus the 8
+   bytes per entry of the base.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nscd_dump.h"
+
+#define DELTA_MAGIC		"NSCDDLT1"
+
+/* Operations of the delta, each a byte followed by its data. */
+#define DELTA_REMOVE	'-'		/* Main key. */
+#define DELTA_ADD		'+'		/* Packet and entry list. */
+#define DELTA_END		'.'
+
+#define DELTA_KEY_SEED	0x64656c74615f6b79ULL
+
+struct delta_head {
+	char magic[8];
+	uint64_t base_layout;		/* Layout fingerprint of the base. */
+	uint64_t semantic;			/* Semantic fingerprint of the result. */
+	struct database_pers_head head;
+};
+
+/* A hash entry of a record, its key relative to the packet. */
+struct delta_entry {
+	uint32_t type;
+	uint32_t first;
+	uint32_t key;
+	uint32_t len;
+};
+
+/* Hash entries of a database sorted by the packet they point to. */
+struct record_index {
+	struct db_file *db;
+	char *data;
+	struct entry_ref {
+		ref_t packet;
+		ref_t he;
+	} *refs;
+	size_t n;
+};
+
+static int
+compare_refs (const void *a, const void *b) {
+	const struct entry_ref *x = a, *y = b;
+
+	if (x->packet != y->packet)
+		return x->packet < y->packet ? -1 : 1;
+	return x->he < y->he ? -1 : x->he > y->he;
+}
+
+static int
+index_records (struct record_index *idx, struct db_file *db) {
+	struct database_pers_head *head = db->mem;
+
+	idx->db = db;
+	idx->data = db_data (head);
+	idx->n = 0;
+	idx->refs = malloc ((head->nentries + 1) * sizeof (*idx->refs));
+	if (idx->refs == NULL)
+		return -1;
+
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (idx->data + run);
+
+			/* The verifier checked nentries. */
+			idx->refs[idx->n].packet = he->packet;
+			idx->refs[idx->n++].he = run;
+			run = he->next;
+		}
+	qsort (idx->refs, idx->n, sizeof (*idx->refs), compare_refs);
+	return 0;
+}
+
+/* The entries of the record at index I of IDX are [I, *END).  Returns
+   the entry identifying it.
+ */
+static struct hashentry *
+record_at (const struct record_index *idx, size_t i, size_t *end) {
+	struct hashentry *main = NULL;
+	size_t j;
+
+	for (j = i; j < idx->n && idx->refs[j].packet == idx->refs[i].packet; j++) {
+		struct hashentry *he = (struct hashentry *) (idx->data
+													 + idx->refs[j].he);
+		if (main == NULL || (he->first && !main->first))
+			main = he;
+	}
+	*end = j;
+	return main;
+}
+
+/* Look the main key of MAIN (in DATA) up in IDX the way nscd does.
+   Returns the index of the first entry of the record found, or -1.
+ */
+static ssize_t
+find_record (const struct record_index *idx, const char *data,
+			 const struct hashentry *main) {
+	struct database_pers_head *head = idx->db->mem;
+	const char *key = data + main->key;
+	ref_t run = head->array[nscd_hash (key, main->len) % head->module];
+
+	while (run != ENDREF) {
+		struct hashentry *he = (struct hashentry *) (idx->data + run);
+
+		if (   he->type == main->type && he->first == main->first
+			&& he->len == main->len
+			&& memcmp (idx->data + he->key, key, main->len) == 0) {
+			struct entry_ref ref = { he->packet, 0 };
+			size_t lo = 0, hi = idx->n;
+
+			/* The first entry of the packet. */
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+
+				if (compare_refs (&idx->refs[mid], &ref) < 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			return lo;
+		}
+		run = he->next;
+	}
+	return -1;
+}
+
+static int
+compare_entries (const void *a, const void *b) {
+	return memcmp (a, b, sizeof (struct delta_entry));
+}
+
+/* Entry list of the record [I, END) of IDX into OUT, sorted.  Returns
+   the index in it of MAIN.
+ */
+static uint32_t
+record_entries (const struct record_index *idx, size_t i, size_t end,
+				const struct hashentry *main, struct delta_entry *out) {
+	struct delta_entry key = {
+		main->type, main->first, main->key - main->packet, main->len
+	};
+
+	for (size_t j = i; j < end; j++) {
+		struct hashentry *he = (struct hashentry *) (idx->data
+													 + idx->refs[j].he);
+
+		out[j - i].type = he->type;
+		out[j - i].first = he->first;
+		out[j - i].key = he->key - he->packet;
+		out[j - i].len = he->len;
+	}
+	qsort (out, end - i, sizeof (*out), compare_entries);
+	return (struct delta_entry *) bsearch (&key, out, end - i, sizeof (*out),
+										   compare_entries) - out;
+}
+
+/* Digest of the main key of a record, by which apply matches them. */
+static uint64_t
+key_digest (uint32_t type, uint32_t first, const char *key, uint32_t len) {
+	struct xxh64_state st;
+	const uint32_t fixed[] = { type, first, len };
+
+	xxh64_init (&st, DELTA_KEY_SEED);
+	xxh64_update (&st, fixed, sizeof (fixed));
+	xxh64_update (&st, key, len);
+	return xxh64_digest (&st);
+}
+
+static int
+write_key (FILE *out, const char *data, const struct hashentry *main) {
+	const uint32_t fixed[] = { main->type, main->first, main->len };
+
+	return fputc (DELTA_REMOVE, out) == EOF
+		|| fwrite (fixed, sizeof (fixed), 1, out) != 1
+		|| fwrite (data + main->key, main->len, 1, out) != 1 ? -1 : 0;
+}
+
+static int
+write_record (FILE *out, const struct record_index *idx, size_t i,
+			  size_t end, const struct hashentry *main,
+			  struct delta_entry *entries) {
+	struct datahead *dh = (struct datahead *) (idx->data
+											   + idx->refs[i].packet);
+	uint32_t fixed[] = { dh->allocsize, end - i, 0 };
+
+	fixed[2] = record_entries (idx, i, end, main, entries);
+	return fputc (DELTA_ADD, out) == EOF
+		|| fwrite (fixed, sizeof (fixed), 1, out) != 1
+		|| fwrite (dh, dh->allocsize, 1, out) != 1
+		|| fwrite (entries, sizeof (*entries), end - i, out) != end - i
+		? -1 : 0;
+}
+
+static int
+verify_db (struct db_file *db) {
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+
+	if (msg != NULL)
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+	return msg != NULL ? -1 : 0;
+}
+
+struct delta_stats {
+	unsigned long added, changed, removed, same;
+};
+
+/* Write the operations turning the records of BASE into those of NEW
+   to OUT.  A and B hold an entry list each.
+ */
+static int
+write_ops (FILE *out, const struct record_index *base,
+		   const struct record_index *new, struct delta_entry *a,
+		   struct delta_entry *b, struct delta_stats *stats) {
+	/* Records of the base gone from the new snapshot. */
+	for (size_t i = 0, end; i < base->n; i = end) {
+		struct hashentry *main = record_at (base, i, &end);
+
+		if (find_record (new, base->data, main) < 0) {
+			if (write_key (out, base->data, main) != 0)
+				return -1;
+			stats->removed++;
+		}
+	}
+
+	/* Records added or changed. */
+	for (size_t i = 0, end; i < new->n; i = end) {
+		struct hashentry *main = record_at (new, i, &end);
+		ssize_t j = find_record (base, new->data, main);
+
+		if (j >= 0) {
+			size_t bend;
+			struct datahead *ndh = (struct datahead *) (new->data
+														+ new->refs[i].packet);
+			struct datahead *bdh = (struct datahead *) (base->data
+														+ base->refs[j].packet);
+			struct hashentry *bmain = record_at (base, j, &bend);
+
+			record_entries (new, i, end, main, a);
+			record_entries (base, j, bend, bmain, b);
+			if (   ndh->allocsize == bdh->allocsize && end - i == bend - j
+				&& memcmp (ndh, bdh, ndh->allocsize) == 0
+				&& memcmp (a, b, (end - i) * sizeof (*a)) == 0) {
+				stats->same++;
+				continue;
+			}
+			stats->changed++;
+		} else
+			stats->added++;
+
+		if (write_record (out, new, i, end, main, a) != 0)
+			return -1;
+	}
+
+	return fputc (DELTA_END, out) == EOF ? -1 : 0;
+}
+
+/* Write the delta from BASE to NEW into OUT_NAME. */
+int
+delta_db (struct db_file *base, struct db_file *new, const char *out_name) {
+	struct record_index bidx = { NULL, NULL, NULL, 0 };
+	struct record_index nidx = { NULL, NULL, NULL, 0 };
+	struct delta_stats stats = { 0, 0, 0, 0 };
+	struct delta_head dhead;
+
+	if (verify_db (base) != 0 || verify_db (new) != 0)
+		return -1;
+
+	size_t most = MAX (((struct database_pers_head *) base->mem)->nentries,
+					   ((struct database_pers_head *) new->mem)->nentries) + 1;
+	struct delta_entry *a = malloc (most * sizeof (*a));
+	struct delta_entry *b = malloc (most * sizeof (*b));
+	int rc = -1;
+	if (   a == NULL || b == NULL
+		|| index_records (&bidx, base) != 0 || index_records (&nidx, new) != 0)
+		fprintf (stderr, "Memory allocation failure\n");
+	else {
+		FILE *out = fopen (out_name, "w");
+		if (out == NULL)
+			fprintf (stderr, "Cannot create \"%s\": %s\n",
+					 out_name, strerror (errno));
+		else {
+			memset (&dhead, 0, sizeof (dhead));
+			memcpy (dhead.magic, DELTA_MAGIC, sizeof (dhead.magic));
+			dhead.base_layout = layout_fingerprint (base->mem);
+			dhead.semantic = semantic_fingerprint (new->mem);
+			dhead.head = *(struct database_pers_head *) new->mem;
+
+			rc = fwrite (&dhead, sizeof (dhead), 1, out) != 1
+				|| write_ops (out, &bidx, &nidx, a, b, &stats) != 0 ? -1 : 0;
+			long size = ftell (out);
+			if (fclose (out) != 0)
+				rc = -1;
+			if (rc != 0) {
+				fprintf (stderr, "Cannot write \"%s\": %s\n",
+						 out_name, strerror (errno));
+				unlink (out_name);
+			} else
+				printf ("Delta \"%s\": %lu records added, %lu changed,"
+						" %lu removed, %lu unchanged, %ld bytes\n", out_name,
+						stats.added, stats.changed, stats.removed, stats.same,
+						size);
+		}
+	}
+
+	free (bidx.refs);
+	free (nidx.refs);
+	free (a);
+	free (b);
+	return rc;
+}
+
+/* A cursor over the operations of a mapped delta. */
+struct delta_reader {
+	const char *p, *end;
+};
+
+static int
+take (struct delta_reader *r, void *out, size_t len) {
+	if ((size_t) (r->end - r->p) < len)
+		return -1;
+	memcpy (out, r->p, len);
+	r->p += len;
+	return 0;
+}
+
+/* The next operation of R: its main key digest in *DIGEST, and for
+   records the packet and the entry list, checked to lie in bounds.
+   Returns the operation, -1 if the delta is malformed.
+ */
+static int
+next_op (struct delta_reader *r, uint64_t *digest, const char **packet,
+		 uint32_t *allocsize, const struct delta_entry **entries,
+		 uint32_t *nentries) {
+	char op;
+	uint32_t fixed[3];
+
+	if (take (r, &op, 1) != 0)
+		return -1;
+	switch (op) {
+	case DELTA_REMOVE:
+		if (   take (r, fixed, sizeof (fixed)) != 0
+			|| (size_t) (r->end - r->p) < fixed[2])
+			return -1;
+		*digest = key_digest (fixed[0], fixed[1], r->p, fixed[2]);
+		r->p += fixed[2];
+		return op;
+	case DELTA_ADD:
+		if (   take (r, fixed, sizeof (fixed)) != 0
+			|| fixed[0] < sizeof (struct datahead) || fixed[2] >= fixed[1]
+			|| (size_t) (r->end - r->p) < fixed[0]
+			|| (size_t) (r->end - r->p - fixed[0]) / sizeof (**entries)
+			   < fixed[1])
+			return -1;
+		*packet = r->p;
+		*allocsize = fixed[0];
+		*entries = (const struct delta_entry *) (r->p + fixed[0]);
+		*nentries = fixed[1];
+		r->p += fixed[0] + fixed[1] * sizeof (**entries);
+
+		for (uint32_t i = 0; i < fixed[1]; i++) {
+			struct delta_entry e;
+
+			memcpy (&e, *entries + i, sizeof (e));
+			if (   e.type >= LASTREQ || e.key > fixed[0]
+				|| e.len > fixed[0] - e.key)
+				return -1;
+			if (i == fixed[2])
+				*digest = key_digest (e.type, e.first, *packet + e.key, e.len);
+		}
+		return op;
+	case DELTA_END:
+		return r->p == r->end ? op : -1;
+	default:
+		return -1;
+	}
+}
+
+static int
+compare_u64 (const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Add a record to B: the packet and the entries pointing into it. */
+static int
+add_record (struct db_builder *b, const char *packet, size_t allocsize,
+			const struct delta_entry *entries, uint32_t nentries) {
+	ref_t off;
+
+	if (builder_add_packet (b, packet, allocsize, &off) != 0)
+		return -1;
+	for (uint32_t i = 0; i < nentries; i++) {
+		struct delta_entry e;
+
+		memcpy (&e, entries + i, sizeof (e));
+		if (builder_add_entry (b, e.type, e.first, off + e.key, e.len,
+							   off) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Copy the records of BASE not among the sorted digests DROP to B. */
+static int
+copy_base (struct db_builder *b, const struct record_index *base,
+		   const uint64_t *drop, size_t ndrop, struct delta_entry *entries,
+		   unsigned long *kept) {
+	for (size_t i = 0, end; i < base->n; i = end) {
+		struct hashentry *main = record_at (base, i, &end);
+		uint64_t digest = key_digest (main->type, main->first,
+									  base->data + main->key, main->len);
+
+		if (bsearch (&digest, drop, ndrop, sizeof (*drop), compare_u64))
+			continue;
+
+		struct datahead *dh = (struct datahead *) (base->data
+												   + base->refs[i].packet);
+		record_entries (base, i, end, main, entries);
+		if (add_record (b, (const char *) dh, dh->allocsize, entries,
+						end - i) != 0)
+			return -1;
+		++*kept;
+	}
+	return 0;
+}
+
+/* Map the file NAME read only into *BUF.  The operations are read in
+   order, each pass once, so the pages can be read ahead and dropped.
+ */
+static int
+map_file (const char *name, char **buf, size_t *len) {
+	int fd = open (name, O_RDONLY);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot open \"%s\": %s\n", name, strerror (errno));
+		return -1;
+	}
+
+	struct stat st;
+	int rc = -1;
+	if (fstat (fd, &st) == 0 && st.st_size > 0) {
+		*len = st.st_size;
+		*buf = mmap (NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (*buf != MAP_FAILED) {
+			madvise (*buf, *len, MADV_SEQUENTIAL);
+			rc = 0;
+		}
+	}
+	if (rc != 0)
+		fprintf (stderr, "Cannot read \"%s\"\n", name);
+	close (fd);
+	return rc;
+}
+
+/* Check the rebuilt database OUT against the delta header DHEAD. */
+static int
+check_result (const char *out, const struct delta_head *dhead) {
+	struct db_file db;
+
+	if (db_open (&db, out) != 0)
+		return -1;
+	int rc = verify_db (&db);
+	if (rc == 0 && semantic_fingerprint (db.mem) != dhead->semantic) {
+		fprintf (stderr, "Rebuilt \"%s\" does not answer like the snapshot"
+				 " of the delta\n", out);
+		rc = -1;
+	}
+	db_close (&db);
+	return rc;
+}
+
+/* Rebuild the snapshot of the delta at R (past its header DHEAD) from
+   BASE into OUT.  Returns 1 if the operations are malformed.
+ */
+static int
+rebuild (struct db_file *base, struct delta_reader r,
+		 const struct delta_head *dhead, const char *out) {
+	struct record_index bidx = { NULL, NULL, NULL, 0 };
+	struct delta_reader ops = r;
+	uint64_t digest = 0;
+	const char *packet;
+	const struct delta_entry *entries;
+	uint32_t allocsize, nentries, most = 0;
+	unsigned long removed = 0, added = 0, kept = 0;
+	int op;
+
+	/* The main keys of the records removed or replaced, and the size of
+	   the largest entry list.
+	 */
+	while ((op = next_op (&r, &digest, &packet, &allocsize, &entries,
+						  &nentries)) > 0 && op != DELTA_END)
+		if (op == DELTA_ADD) {
+			most = MAX (most, nentries);
+			added++;
+		} else
+			removed++;
+	if (op != DELTA_END)
+		return 1;
+
+	size_t ndrop = 0;
+	uint64_t *drop = malloc ((removed + added + 1) * sizeof (*drop));
+	uint32_t base_entries = ((struct database_pers_head *) base->mem)->nentries;
+	struct delta_entry *tmp = malloc ((MAX (base_entries, most) + 1)
+									  * sizeof (*tmp));
+	struct db_builder b;
+	if (   drop == NULL || tmp == NULL || index_records (&bidx, base) != 0
+		|| builder_init (&b, dhead->head.module) != 0) {
+		fprintf (stderr, "Memory allocation failure\n");
+		free (bidx.refs);
+		free (drop);
+		free (tmp);
+		return -1;
+	}
+
+	for (r = ops; next_op (&r, &digest, &packet, &allocsize, &entries,
+						   &nentries) != DELTA_END; )
+		drop[ndrop++] = digest;
+	qsort (drop, ndrop, sizeof (*drop), compare_u64);
+
+	int rc = copy_base (&b, &bidx, drop, ndrop, tmp, &kept);
+	for (r = ops; rc == 0 && (op = next_op (&r, &digest, &packet, &allocsize,
+											&entries, &nentries)) != DELTA_END; )
+		if (op == DELTA_ADD)
+			rc = add_record (&b, packet, allocsize, entries, nentries);
+	if (rc != 0)
+		fprintf (stderr, "Cannot rebuild \"%s\"\n", out);
+	else {
+		/* The header, statistics and free space of the snapshot. */
+		b.like = &dhead->head;
+		rc = builder_write (&b, out,
+							dhead->head.data_size - dhead->head.first_free);
+		if (rc == 0)
+			rc = check_result (out, dhead);
+		if (rc != 0)
+			unlink (out);
+		else
+			printf ("Rebuilt \"%s\": %lu records kept, %lu added or changed,"
+					" %lu removed\n", out, kept, added, removed);
+	}
+
+	builder_free (&b);
+	free (bidx.refs);
+	free (drop);
+	free (tmp);
+	return rc;
+}
+
+/* Apply the delta DELTA_NAME to BASE, writing the result to OUT. */
+int
+apply_db (struct db_file *base, const char *delta_name, const char *out) {
+	struct delta_head dhead;
+	struct delta_reader r;
+	char *buf;
+	size_t len;
+	int rc = -1;
+
+	if (verify_db (base) != 0 || map_file (delta_name, &buf, &len) != 0)
+		return -1;
+
+	r.p = buf;
+	r.end = buf + len;
+	if (   take (&r, &dhead, sizeof (dhead)) != 0
+		|| memcmp (dhead.magic, DELTA_MAGIC, sizeof (dhead.magic)) != 0
+		|| dhead.head.module <= 0 || dhead.head.first_free < 0
+		|| dhead.head.first_free > dhead.head.data_size)
+		fprintf (stderr, "Invalid delta \"%s\"\n", delta_name);
+	else if (dhead.base_layout != layout_fingerprint (base->mem))
+		fprintf (stderr, "Delta \"%s\" is not against \"%s\"\n",
+				 delta_name, base->name);
+	else {
+		rc = rebuild (base, r, &dhead, out);
+		if (rc == 1)
+			fprintf (stderr, "Invalid delta \"%s\"\n", delta_name);
+	}
+
+	munmap (buf, len);
+	return rc == 0 ? 0 : -1;
+}
@@ -0,0 +1,693 @@
+/* Differential test harness.
+
+   Runs the reference path, the original serial verifier kept below
+   (not verify_persistent_db (), which goes through the default plan)
+   followed by the header and entry dump, and each optimized execution
+   plan over generated, random and fuzzed databases, and compares the
+   verdicts and the output byte for byte.  Every run happens in a child process, so
+   inputs crashing the dumper are compared like any other outcome.
+   Databases that produce a mismatch are kept for reproduction.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "nscd_dump.h"
+
+#define DIFFTEST_DEFAULT_CASES	200
+
+static const struct variant {
+	const char *name;
+	struct exec_plan plan;
+	/* Sampling may miss damage, so it only has to accept what the
+	   reference accepts, identically.
+	 */
+	int one_sided;
+} variants[] = {
+	{
+		.name = "parallel sweep",
+		.plan = {
+			.usemap = USEMAP_MEMORY,
+			.spill_dir = NULL,
+			.threads = 4,
+			.sample_stride = 1,
+			.prefault = 0
+		},
+		.one_sided = 0
+	},
+	{
+		.name = "prefaulted",
+		.plan = {
+			.usemap = USEMAP_MEMORY,
+			.spill_dir = NULL,
+			.threads = 1,
+			.sample_stride = 1,
+			.prefault = 1
+		},
+		.one_sided = 0
+	},
+	{
+		.name = "spilled map",
+		.plan = {
+			.usemap = USEMAP_SPILL,
+			.spill_dir = NULL,
+			.threads = 1,
+			.sample_stride = 1,
+			.prefault = 0
+		},
+		.one_sided = 0
+	},
+	{
+		.name = "spilled map, parallel sweep",
+		.plan = {
+			.usemap = USEMAP_SPILL,
+			.spill_dir = NULL,
+			.threads = 3,
+			.sample_stride = 1,
+			.prefault = 0
+		},
+		.one_sided = 0
+	},
+	{
+		.name = "sampled buckets",
+		.plan = {
+			.usemap = USEMAP_NONE,
+			.spill_dir = NULL,
+			.threads = 1,
+			.sample_stride = 8,
+			.prefault = 0
+		},
+		.one_sided = 1
+	}
+};
+
+/* The serial verifier as it was before execution plans, kept verbatim
+   as the reference: verify_persistent_db () now shares its walk and
+   sweep with the optimized plans, so drift there would go unnoticed
+   comparing against it.
+ */
+static const char *
+reference_verify (void *mem, struct database_pers_head *readhead)
+{
+	const char *msg;
+	time_t now = time (NULL);
+
+	struct database_pers_head *head = mem;
+	struct database_pers_head head_copy = *head;
+
+	/* Check that the header that was read matches the head in the database. */
+	if (memcmp (head, readhead, sizeof (*head)) != 0)
+		return "Header read differs from databas header";
+
+	/* First some easy tests: make sure the database header is sane.  */
+	if (head->version != DB_VERSION)
+		return "Invalid database version";
+
+	if (head->header_size != sizeof (*head))
+		return "Header size in database differs from expected";
+
+    /* Allow a timestamp to be one hour ahead of the current time.
+	   This should cover daylight saving time changes.
+	 */
+	if (head->timestamp > now + 60 * 60 + 60)
+		return "Future timestamp in header";
+
+	if (head->gc_cycle & 1)
+		return "Invalid GC cycle value";
+
+	if (head->module == 0)
+		return "No data modules in database";
+
+	if ((size_t) head->module > INT32_MAX / sizeof (ref_t))
+		return "Excessive number of data modules";
+
+    if ((size_t) head->data_size > INT32_MAX - head->module * sizeof (ref_t))
+		return "Data size is larger than in data modules";
+
+	if (head->first_free < 0)
+		return "Negative offset of first free byte";
+      
+	if (head->first_free > head->data_size)
+		return "Offset to first free byte is larger than data size";
+
+	if ((head->first_free & BLOCK_ALIGN_M1) != 0)
+		return "Offset of first free byte isn't properly aligned";
+
+	if (head->maxnentries < 0)
+		return "Negative number of maximum entries";
+
+	if (head->maxnsearched < 0)
+		return "Negative number of maximum search entries";
+    
+	uint8_t *usemap = calloc (head->first_free, 1);
+	if (usemap == NULL)
+		return "Memory allocation failure";
+
+	const char *data = (char *) &head->array[roundup (head->module,
+					   ALIGN / sizeof (ref_t))];
+
+	nscd_ssize_t he_cnt = 0;
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt) {
+		ref_t trail = head->array[cnt];
+		ref_t work = trail;
+		int tick = 0;
+
+		while (work != ENDREF) {
+			msg = check_use (data, head->first_free, usemap, use_he, work,
+							sizeof (struct hashentry));
+			if (msg != NULL) {
+				free (usemap);
+				return msg;
+			}
+
+			/* Now we know we can dereference the record.  */
+			struct hashentry *here = (struct hashentry *) (data + work);
+
+			++he_cnt;
+
+			/* Make sure the record is for this type of service. */
+			if (here->type >= LASTREQ) {
+				free (usemap);
+				return "Record type is out of bounds";
+			}
+
+			if (! (here->type == GETHOSTBYNAME
+				|| here->type == GETHOSTBYNAMEv6
+				|| here->type == GETHOSTBYADDR
+				|| here->type == GETHOSTBYADDRv6
+				|| here->type == GETAI)) {
+				free (usemap);
+				return "Invalid record type";
+			}
+
+			/* Validate boolean field value.  */
+			if (here->first != false && here->first != true) {
+				free (usemap);
+				return "Invalid boolean field";
+			}
+
+			if (here->len < 0) {
+				free (usemap);
+				return "Negative record length";
+			}
+
+			/* Now the data. */
+			if (here->packet < 0) {
+				free (usemap);
+				return "Negative packet offset";
+			}
+
+			if (here->packet > head->first_free) {
+				free (usemap);
+				return "Packet offset beyond first free byte";
+			}
+
+			if (here->packet + sizeof (struct datahead) > head->first_free) {
+				free (usemap);
+				return "Packet data offset beyond first free byte";
+			}
+
+			if (here->first != false && here->first != true) {
+				free (usemap);
+				return "Invalid \"first\" field contents";
+			}
+
+			struct datahead *dh = (struct datahead *) (data + here->packet);
+
+			msg = check_use (data, head->first_free, usemap,
+			   				use_data | (here->first ? use_first : 0),
+			   				here->packet, dh->allocsize);
+			if (msg != NULL) {
+				free (usemap);
+				return msg;
+			}
+
+			if (dh->allocsize < sizeof (struct datahead)) {
+				free (usemap);
+				return "Short data header size";
+			}
+			if (dh->recsize > dh->allocsize) {
+				free (usemap);
+				return "Data size is above allocated one";
+			}
+			if (dh->notfound != false && dh->notfound != true) {
+				free (usemap);
+				return "Invalid \"notfound\" field contents";
+			}
+			if (dh->usable != false && dh->usable != true) {
+				free (usemap);
+				return "Invalid \"usable\" field contents";
+			}
+
+			if (   here->key < here->packet + sizeof (struct datahead)
+				|| here->key > here->packet + dh->allocsize
+				|| here->key + here->len > here->packet + dh->allocsize) {
+#if SEPARATE_KEY
+			/* If keys can appear outside of data, this should be done
+			   instead.  But gc doesn't mark the data in that case.
+			 */
+				msg = check_use (data, head->first_free, usemap,
+				   				 use_key | (here->first ? use_first : 0),
+				   				 here->key, here->len);
+				if (msg != NULL) {
+					free (usemap);
+					return msg;
+				}
+#endif
+				free (usemap);
+				return "Invalid hash entry";
+			}
+
+			work = here->next;
+
+			/* A circular list, this must not happen.  */
+			if (work == trail) {
+				free (usemap);
+				return "Circullar list detected";
+			}
+			
+			if (tick)
+				trail = ((struct hashentry *) (data + trail))->next;
+			
+			tick = 1 - tick;
+		}
+	}
+
+	if (he_cnt != head->nentries) {
+		free (usemap);
+		return "Actual number of records doesn't match with one in header";
+	}
+
+	/* See if all data and keys had at least one reference from
+	   he->first == true hashentry.
+	 */
+	for (ref_t idx = 0; idx < head->first_free; ++idx) {
+#if SEPARATE_KEY
+		if (usemap[idx] == use_key_begin) {
+			free (usemap);
+			return "Unreferenced data and/or keys found";
+		}
+#endif
+		if (usemap[idx] == use_data_begin) {
+			free (usemap);
+			return "Unreferenced data and/or keys found";
+		}
+	}
+
+	/* Finally, make sure the database hasn't changed since the first test. */
+	if (memcmp (mem, &head_copy, sizeof (*head)) != 0) {
+		free (usemap);
+		return "Database header changed in transit";
+	}
+
+	free (usemap);
+	return NULL;
+}
+
+/* What one run produced. */
+struct outcome {
+	int status;					/* As from waitpid (). */
+	char *out, *err;
+	size_t out_len, err_len;
+	int valid;
+};
+
+static char *
+slurp (const char *path, size_t *len) {
+	char *buf = NULL;
+	FILE *f = fopen (path, "r");
+
+	*len = 0;
+	if (f == NULL)
+		return NULL;
+
+	struct stat st;
+	if (fstat (fileno (f), &st) == 0 && (buf = malloc (st.st_size + 1)))
+		*len = fread (buf, 1, st.st_size, f);
+	fclose (f);
+	return buf;
+}
+
+/* Verify DB_PATH with PLAN (the reference path if NULL) and dump every
+   STRIDE. bucket, capturing stdout and stderr into files under DIR.
+ */
+static int
+run (const char *dir, const char *db_path, const struct exec_plan *plan,
+	 nscd_ssize_t stride, struct outcome *res) {
+	char out_path[PATH_MAX], err_path[PATH_MAX];
+
+	snprintf (out_path, sizeof (out_path), "%s/stdout", dir);
+	snprintf (err_path, sizeof (err_path), "%s/stderr", dir);
+
+	fflush (stdout);
+	fflush (stderr);
+	pid_t pid = fork ();
+	if (pid == -1)
+		return -1;
+
+	if (pid == 0) {
+		int out = open (out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		int err = open (err_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (out == -1 || err == -1)
+			_exit (127);
+		dup2 (out, STDOUT_FILENO);
+		dup2 (err, STDERR_FILENO);
+
+		struct db_file db;
+		if (db_open (&db, db_path) != 0) {
+			printf ("Not opened\n");
+			fflush (stdout);
+			_exit (0);
+		}
+
+		const char *msg = plan == NULL
+			? reference_verify (db.mem, &db.head)
+			: verify_persistent_db_plan (db.mem, &db.head, plan);
+		printf ("Verdict: %s\n", msg ? msg : "valid");
+		if (msg == NULL) {
+			print_db_header_stats (&db.head);
+			print_entries (db.mem, 1, stride);
+		}
+		fflush (stdout);
+		_exit (msg == NULL ? 0 : 1);
+	}
+
+	if (waitpid (pid, &res->status, 0) != pid)
+		return -1;
+	res->valid = WIFEXITED (res->status) && WEXITSTATUS (res->status) == 0;
+	res->out = slurp (out_path, &res->out_len);
+	res->err = slurp (err_path, &res->err_len);
+	return 0;
+}
+
+static void
+outcome_free (struct outcome *res) {
+	free (res->out);
+	free (res->err);
+}
+
+static int
+same_outcome (const struct outcome *a, const struct outcome *b) {
+	return a->status == b->status
+		&& a->out_len == b->out_len && a->err_len == b->err_len
+		&& (a->out_len == 0 || memcmp (a->out, b->out, a->out_len) == 0)
+		&& (a->err_len == 0 || memcmp (a->err, b->err, a->err_len) == 0);
+}
+
+static const char *
+describe (const struct outcome *res, char *buf, size_t size) {
+	if (WIFSIGNALED (res->status))
+		snprintf (buf, size, "killed by %s", strsignal (WTERMSIG (res->status)));
+	else
+		snprintf (buf, size, "%.*s", (int) strcspn (res->out ? res->out : "",
+													 "\n"),
+				  res->out ? res->out : "no output");
+	return buf;
+}
+
+/* Random but valid content: a mix of every record type, positive and
+   negative, with and without aliases.
+ */
+static int
+build_random (struct db_builder *b, unsigned seed) {
+	char name[64], key[80];
+	char *aliases[8];
+	uint8_t addrs[8 * 16], families[8];
+	int rc = 0;
+
+	srandom (seed);
+	unsigned n = 1 + random () % 300;
+	for (unsigned i = 0; rc == 0 && i < n; i++) {
+		unsigned naliases = random () % 4, naddrs = random () % 8;
+		int v6 = random () % 2;
+		int len = 1 + random () % 20;
+
+		for (int j = 0; j < len; j++)
+			name[j] = 'a' + random () % 26;
+		snprintf (name + len, sizeof (name) - len, "%u.example.org", i);
+		for (unsigned j = 0; j < sizeof (addrs); j++)
+			addrs[j] = random ();
+		for (unsigned j = 0; j < naliases; j++)
+			if (asprintf (&aliases[j], "a%u-%s", j, name) < 0)
+				return -1;
+
+		switch (random () % 4) {
+		case 0:
+		case 1: {
+			struct builder_hst rec = {
+				.type = v6 ? GETHOSTBYNAMEv6 : GETHOSTBYNAME,
+				.key = name,
+				.keylen = strlen (name) + 1,
+				.name = name,
+				.aliases = (const char *const *) aliases,
+				.naliases = naliases,
+				.addrs = addrs,
+				.naddrs = naddrs,
+				.addrlen = v6 ? 16 : 4,
+				.notfound = random () % 5 == 0,
+				.alias_entries = random () % 2,
+				.ttl = random () % 7200
+			};
+			rc = builder_add_hst (b, &rec);
+			break;
+		}
+		case 2: {
+			struct builder_hst rec = {
+				.type = v6 ? GETHOSTBYADDRv6 : GETHOSTBYADDR,
+				.key = (char *) addrs,
+				.keylen = v6 ? 16 : 4,
+				.name = name,
+				.addrs = addrs,
+				.naddrs = 1,
+				.addrlen = v6 ? 16 : 4,
+				.ttl = random () % 7200
+			};
+			rc = builder_add_hst (b, &rec);
+			break;
+		}
+		default: {
+			for (unsigned j = 0; j < naddrs; j++)
+				families[j] = random () % 2 ? AF_INET6 : AF_INET;
+			snprintf (key, sizeof (key), "ai-%s", name);
+			struct builder_ai rec = {
+				.key = key,
+				.canon = name,
+				.addrs = addrs,
+				.families = families,
+				.naddrs = naddrs,
+				.ttl = random () % 7200
+			};
+			rc = builder_add_ai (b, &rec);
+			break;
+		}
+		}
+
+		for (unsigned j = 0; j < naliases; j++)
+			free (aliases[j]);
+	}
+	return rc;
+}
+
+/* Damage the database at PATH: flip bytes, redirect a pointer of a hash
+   entry or skew a header field.
+ */
+static int
+fuzz_file (const char *path, unsigned seed) {
+	size_t len;
+	char *buf = slurp (path, &len);
+	if (buf == NULL || len < sizeof (struct database_pers_head)) {
+		free (buf);
+		return -1;
+	}
+
+	struct database_pers_head *head = (struct database_pers_head *) buf;
+	size_t data_off = db_data (head) - buf;
+	size_t live = MIN (len, data_off + head->first_free);
+
+	srandom (seed);
+	switch (random () % 3) {
+	case 0:
+		for (int n = 1 + random () % 4; n > 0; n--)
+			buf[random () % live] = random ();
+		break;
+	case 1: {
+		/* A random aligned offset in some field of a hash entry. */
+		nscd_ssize_t bucket = random () % head->module;
+		ref_t he = head->array[bucket];
+		if (he == ENDREF || data_off + he + sizeof (struct hashentry) > len)
+			break;
+		ref_t *field = (ref_t *) (buf + data_off + he
+								  + offsetof (struct hashentry, next));
+		field += random () % 2;		/* next or packet */
+		*field = (random () % (head->first_free + 64)) & ~BLOCK_ALIGN_M1;
+		break;
+	}
+	default: {
+		nscd_ssize_t *fields[] = { &head->nentries, &head->first_free,
+								   &head->module, &head->data_size };
+		*fields[random () % 4] += (random () % 3 - 1) * BLOCK_ALIGN;
+		break;
+	}
+	}
+
+	FILE *f = fopen (path, "w");
+	int rc = f && fwrite (buf, 1, len, f) == len ? 0 : -1;
+	if (f != NULL && fclose (f) != 0)
+		rc = -1;
+	free (buf);
+	return rc;
+}
+
+/* Produce database number N of the run into PATH.  Returns its origin. */
+static const char *
+make_case (unsigned n, const char *path) {
+	static const char *const kinds[] = {
+		"onebucket", "maxkey", "bigai", "aliases", "fragmented"
+	};
+	static const unsigned counts[] = { 300, 20, 2, 2, 300 };
+	const size_t nkinds = sizeof (kinds) / sizeof (*kinds);
+
+	/* Silence the generator's report. */
+	int stdout_fd = dup (STDOUT_FILENO);
+	int null_fd = open ("/dev/null", O_WRONLY);
+	fflush (stdout);
+	dup2 (null_fd, STDOUT_FILENO);
+
+	const char *origin;
+	int rc;
+	if (n < nkinds) {
+		rc = generate_db (kinds[n], counts[n], path);
+		origin = kinds[n];
+	} else {
+		struct db_builder b;
+
+		rc = builder_init (&b, 1 + n % 509);
+		if (rc == 0)
+			rc = build_random (&b, n);
+		if (rc == 0)
+			rc = builder_write (&b, path, n % 3 ? 0 : 4096);
+		builder_free (&b);
+		origin = "random";
+
+		/* Two thirds of the random cases get damaged. */
+		if (rc == 0 && n % 3 != 0) {
+			rc = fuzz_file (path, n);
+			origin = "fuzzed";
+		}
+	}
+
+	fflush (stdout);
+	dup2 (stdout_fd, STDOUT_FILENO);
+	close (stdout_fd);
+	close (null_fd);
+	return rc == 0 ? origin : NULL;
+}
+
+/* Run CASES comparisons (0 for the default number) and report.
+   Returns the number of mismatches, -1 if the harness itself failed.
+ */
+int
+difftest (unsigned cases) {
+	char dir[] = "/tmp/nscd_difftest.XXXXXX";
+	char db_path[PATH_MAX];
+	unsigned runs = 0, mismatches = 0, valid = 0, crashed = 0;
+
+	if (cases == 0)
+		cases = DIFFTEST_DEFAULT_CASES;
+	if (mkdtemp (dir) == NULL) {
+		fprintf (stderr, "Cannot create a directory: %s\n", strerror (errno));
+		return -1;
+	}
+
+	for (unsigned n = 0; n < cases; n++) {
+		struct outcome ref;
+		int kept = 0;
+
+		snprintf (db_path, sizeof (db_path), "%s/case-%u.db", dir, n);
+		const char *origin = make_case (n, db_path);
+		if (origin == NULL || run (dir, db_path, NULL, 1, &ref) != 0) {
+			fprintf (stderr, "Cannot prepare case %u\n", n);
+			return -1;
+		}
+		valid += ref.valid;
+		crashed += WIFSIGNALED (ref.status);
+
+		for (size_t v = 0; v < sizeof (variants) / sizeof (*variants); v++) {
+			const struct exec_plan *plan = &variants[v].plan;
+			struct outcome res, sampled;
+			const struct outcome *expected = &ref;
+			char a[128], b[128];
+
+			if (run (dir, db_path, plan, plan->sample_stride, &res) != 0) {
+				fprintf (stderr, "Cannot run case %u\n", n);
+				return -1;
+			}
+			runs++;
+
+			/* A sampling plan only dumps the buckets it verified, so
+			   its output is that of the reference dumping those.
+			 */
+			memset (&sampled, 0, sizeof (sampled));
+			if (plan->sample_stride > 1 && ref.valid) {
+				if (run (dir, db_path, NULL, plan->sample_stride,
+						 &sampled) != 0) {
+					fprintf (stderr, "Cannot run case %u\n", n);
+					return -1;
+				}
+				expected = &sampled;
+			}
+
+			/* Even then it has to give a verdict, not crash, unless
+			   it fails just like the reference.
+			 */
+			int ok = same_outcome (expected, &res)
+				|| (   variants[v].one_sided && !ref.valid
+					&& WIFEXITED (res.status) && WEXITSTATUS (res.status) <= 1);
+			if (!ok) {
+				mismatches++;
+				kept = 1;
+				printf ("Case %u (%s), %s: reference \"%s\", got \"%s\"\n",
+						n, origin, variants[v].name,
+						describe (expected, a, sizeof (a)),
+						describe (&res, b, sizeof (b)));
+			}
+			outcome_free (&sampled);
+			outcome_free (&res);
+		}
+		outcome_free (&ref);
+
+		if (!kept)
+			unlink (db_path);
+	}
+
+	char path[PATH_MAX];
+	snprintf (path, sizeof (path), "%s/stdout", dir);
+	unlink (path);
+	snprintf (path, sizeof (path), "%s/stderr", dir);
+	unlink (path);
+	if (mismatches == 0)
+		rmdir (dir);
+
+	printf ("%u databases (%u valid, %u crashing the dumper), %u runs,"
+			" %u mismatches\n", cases, valid, crashed, runs, mismatches);
+	if (mismatches != 0)
+		printf ("Mismatching databases kept in %s\n", dir);
+	return mismatches;
+}
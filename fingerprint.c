@@ -0,0 +1,142 @@
+/* Fingerprints of database snapshots.
+
+   The layout fingerprint is XXH64 over the header fields that describe
+   the contents (not the timestamp, the GC cycle or the statistics),
+   the bucket array and the live data [0, first_free).  It changes with
+   any change to the file nscd would see, and costs one sequential read
+   of the live part of the file, so unchanged snapshots can be skipped
+   without verifying or dumping them.
+
+   The semantic fingerprint only depends on what the cache answers: it
+   is the sum of the digests of the entries, each over the type, the
+   key, whether the answer is negative and the set of addresses.  Two
+   caches holding the same answers in different buckets, order or
+   places of the data area have the same semantic fingerprint.  It needs
+   the database verified first.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+
+#include "nscd_dump.h"
+
+/* Seeds, so that the digests of different things do not collide. */
+#define LAYOUT_SEED		0x6e7363645f6c6179ULL
+#define ENTRY_SEED		0x6e7363645f656e74ULL
+#define ADDR_SEED		0x6e7363645f616464ULL
+
+uint64_t
+layout_fingerprint (void *mem) {
+	struct database_pers_head *head = mem;
+	struct xxh64_state st;
+	const int32_t fields[] = {
+		head->version, head->header_size, head->module, head->data_size,
+		head->first_free, head->nentries
+	};
+	char *data = db_data (head);
+
+	xxh64_init (&st, LAYOUT_SEED);
+	xxh64_update (&st, fields, sizeof (fields));
+	xxh64_update (&st, head->array, data - (char *) head->array);
+	xxh64_update (&st, data, head->first_free);
+	return xxh64_digest (&st);
+}
+
+/* Sum of the digests of the addresses of the record of DH, which stands
+   for the sorted set: it does not depend on their order.
+ */
+static uint64_t
+addr_set_digest (request_type type, struct datahead *dh) {
+	uint64_t sum = 0;
+
+	if (type == GETAI) {
+		struct ai_view view;
+
+		if (decode_ai (dh, &view) != 0)
+			return 0;
+
+		uint8_t *addr = view.addrs;
+		for (nscd_ssize_t i = 0; i < view.resp->naddrs; i++) {
+			size_t len = ai_addr_len (view.families[i]);
+
+			sum += xxh64 (addr, len, ADDR_SEED + view.families[i]);
+			addr += len;
+		}
+	} else {
+		struct hst_view view;
+
+		if (decode_hst (dh, &view) != 0)
+			return 0;
+
+		for (nscd_ssize_t i = 0; i < view.resp->h_addr_list_cnt; i++)
+			sum += xxh64 (view.addrs + i * view.resp->h_length,
+						  view.resp->h_length, ADDR_SEED);
+	}
+	return sum;
+}
+
+/* Digest of the answer of hash entry HE in the data area DATA. */
+uint64_t
+entry_digest (const char *data, struct hashentry *he) {
+	struct datahead *dh = (struct datahead *) (data + he->packet);
+	struct xxh64_state st;
+	const uint32_t fixed[] = { he->type, dh->notfound, he->len };
+	uint64_t addrs = dh->notfound ? 0 : addr_set_digest (he->type, dh);
+
+	xxh64_init (&st, ENTRY_SEED);
+	xxh64_update (&st, fixed, sizeof (fixed));
+	xxh64_update (&st, data + he->key, he->len);
+	xxh64_update (&st, &addrs, sizeof (addrs));
+	return xxh64_digest (&st);
+}
+
+/* Sum of the entry digests of the verified database at MEM. */
+uint64_t
+semantic_fingerprint (void *mem) {
+	struct database_pers_head *head = mem;
+	const char *data = db_data (head);
+	uint64_t semantic = 0;
+
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+
+			semantic += entry_digest (data, he);
+			run = he->next;
+		}
+	return semantic;
+}
+
+/* Print the fingerprints of DB, only the layout one if LAYOUT_ONLY. */
+int
+fingerprint_db (struct db_file *db, int layout_only) {
+	struct database_pers_head *head = db->mem;
+
+	/* The header has to be sane for the live data to lie in the file. */
+	const char *msg = verify_db_header (head, &db->head);
+	if (msg == NULL) {
+		printf ("Layout fingerprint        : %016llx\n",
+				(unsigned long long) layout_fingerprint (db->mem));
+		if (layout_only)
+			return 0;
+		msg = verify_persistent_db (db->mem, &db->head);
+	}
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	printf ("Semantic fingerprint      : %016llx\n",
+			(unsigned long long) semantic_fingerprint (db->mem));
+	return 0;
+}
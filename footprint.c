@@ -0,0 +1,165 @@
+/* Memory footprint of lookups.
+
+   nscd looks a key up by reading its slot of the bucket array, then
+   every hash entry along the chain up to the matching one, the key
+   bytes it compares, and finally the data head and record of the
+   packet.  footprint_walk () counts, for every hash entry of the
+   database taken as the key looked up, the distinct units of memory
+   (pages or cache lines) that lookup touches.  Comparisons of the keys
+   of earlier entries whose length happens to match are not counted.
+
+   The walk is incremental along each chain: the units of the prefix of
+   the chain are marked once in a stamp array, so a chain of N entries
+   costs O(N) plus the units of the keys and records, not O(N^2).
+
+   The database must have been verified.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+struct footprint {
+	char *mem;
+	size_t data_off;
+	size_t unit_size, page_size;
+	const unsigned char *resident;
+	/* Chain that last marked each unit, plus one. */
+	uint32_t *stamp;
+	uint32_t chain;
+	/* Counted units of the current chain prefix. */
+	unsigned prefix;
+	/* Units of the key and record of the current lookup. */
+	size_t *extra;
+	size_t nextra, extra_size;
+};
+
+/* Whether UNIT counts: all do, or only those of pages not resident. */
+static inline int
+counts (const struct footprint *fp, size_t unit) {
+	return fp->resident == NULL
+		|| !(fp->resident[unit * fp->unit_size / fp->page_size] & 1);
+}
+
+/* Add the units of LEN bytes at file offset OFF to the chain prefix. */
+static void
+mark_prefix (struct footprint *fp, size_t off, size_t len) {
+	if (len == 0)
+		return;
+	for (size_t u = off / fp->unit_size; u <= (off + len - 1) / fp->unit_size;
+		 u++)
+		if (fp->stamp[u] != fp->chain) {
+			fp->stamp[u] = fp->chain;
+			fp->prefix += counts (fp, u);
+		}
+}
+
+/* Add the units of LEN bytes at file offset OFF to the extras of the
+   lookup, unless the prefix has them.
+ */
+static int
+add_extra (struct footprint *fp, size_t off, size_t len) {
+	if (len == 0)
+		return 0;
+	for (size_t u = off / fp->unit_size; u <= (off + len - 1) / fp->unit_size;
+		 u++) {
+		if (fp->stamp[u] == fp->chain || !counts (fp, u))
+			continue;
+		if (fp->nextra == fp->extra_size) {
+			size_t size = MAX (64, 2 * fp->extra_size);
+			size_t *extra = realloc (fp->extra, size * sizeof (*extra));
+			if (extra == NULL)
+				return -1;
+			fp->extra = extra;
+			fp->extra_size = size;
+		}
+		fp->extra[fp->nextra++] = u;
+	}
+	return 0;
+}
+
+static int
+compare_size (const void *a, const void *b) {
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Distinct extras of the lookup. */
+static unsigned
+count_extra (struct footprint *fp) {
+	unsigned n = 0;
+
+	qsort (fp->extra, fp->nextra, sizeof (*fp->extra), compare_size);
+	for (size_t i = 0; i < fp->nextra; i++)
+		n += i == 0 || fp->extra[i] != fp->extra[i - 1];
+	return n;
+}
+
+/* Call FN for every hash entry of the database at MEM with the number
+   of distinct units of UNIT_SIZE bytes its lookup touches.  With
+   RESIDENT, a mincore () vector of the file, only units in pages not
+   resident are counted.  Returns -1 if out of memory.
+ */
+int
+footprint_walk (void *mem, size_t unit_size, const unsigned char *resident,
+				footprint_fn fn, void *arg) {
+	struct database_pers_head *head = mem;
+	struct footprint fp;
+	int rc = 0;
+
+	memset (&fp, 0, sizeof (fp));
+	fp.mem = mem;
+	fp.data_off = db_data (head) - fp.mem;
+	fp.unit_size = unit_size;
+	fp.page_size = sysconf (_SC_PAGESIZE);
+	fp.resident = resident;
+	fp.stamp = calloc ((fp.data_off + head->first_free) / unit_size + 1,
+					   sizeof (*fp.stamp));
+	if (fp.stamp == NULL)
+		return -1;
+
+	for (nscd_ssize_t cnt = 0; rc == 0 && cnt < head->module; ++cnt) {
+		ref_t run = head->array[cnt];
+
+		if (run == ENDREF)
+			continue;
+
+		fp.chain++;
+		fp.prefix = 0;
+		mark_prefix (&fp, (char *) &head->array[cnt] - fp.mem,
+					 sizeof (ref_t));
+
+		while (rc == 0 && run != ENDREF) {
+			struct hashentry *he = (struct hashentry *) (fp.mem + fp.data_off
+														 + run);
+			struct datahead *dh = (struct datahead *) (fp.mem + fp.data_off
+													   + he->packet);
+
+			mark_prefix (&fp, fp.data_off + run, sizeof (*he));
+			fp.nextra = 0;
+			if (   add_extra (&fp, fp.data_off + he->key, he->len) != 0
+				|| add_extra (&fp, fp.data_off + he->packet,
+							  sizeof (*dh) + dh->recsize) != 0)
+				rc = -1;
+			else
+				fn (cnt, he, fp.prefix + count_extra (&fp), arg);
+			run = he->next;
+		}
+	}
+
+	free (fp.stamp);
+	free (fp.extra);
+	return rc;
+}
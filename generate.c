@@ -0,0 +1,259 @@
+/* Generator of pathological but valid databases.
+
+   Each kind stresses one dimension of the verifier and the dumper at
+   its worst: chain length, key length, addresses per record, aliases
+   per record, and fragmentation of the data area.  "make bench" times
+   the tool over all of them.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nscd_dump.h"
+
+/* Time to live of generated records. */
+#define GENERATE_TTL	3600
+
+typedef int (*generate_fn) (struct db_builder *b, unsigned count);
+
+static void
+make_addr4 (uint8_t *addr, unsigned n) {
+	addr[0] = 10;
+	addr[1] = n >> 16;
+	addr[2] = n >> 8;
+	addr[3] = n;
+}
+
+static void
+make_addr6 (uint8_t *addr, unsigned n) {
+	memset (addr, 0, sizeof (struct in6_addr));
+	addr[0] = 0x20;
+	addr[1] = 0x01;
+	addr[2] = 0x0d;
+	addr[3] = 0xb8;
+	addr[12] = n >> 24;
+	addr[13] = n >> 16;
+	addr[14] = n >> 8;
+	addr[15] = n;
+}
+
+/* An ordinary GETHOSTBYNAME record for "hostN.example.com". */
+static int
+add_host (struct db_builder *b, unsigned n) {
+	char name[64];
+	uint8_t addr[4];
+
+	snprintf (name, sizeof (name), "host%u.example.com", n);
+	make_addr4 (addr, n);
+
+	struct builder_hst rec = {
+		.type = GETHOSTBYNAME,
+		.key = name,
+		.keylen = strlen (name) + 1,
+		.name = name,
+		.addrs = addr,
+		.naddrs = 1,
+		.addrlen = sizeof (addr),
+		.ttl = GENERATE_TTL
+	};
+	return builder_add_hst (b, &rec);
+}
+
+/* Every entry in a single bucket: one chain of COUNT entries. */
+static int
+gen_onebucket (struct db_builder *b, unsigned count) {
+	b->bucket = 0;
+	for (unsigned i = 0; i < count; i++)
+		if (add_host (b, i) != 0)
+			return -1;
+	return 0;
+}
+
+/* Keys of MAXKEYLEN bytes, as labels of the maximum length. */
+static int
+gen_maxkey (struct db_builder *b, unsigned count) {
+	char key[MAXKEYLEN];
+	uint8_t addr[4];
+
+	for (unsigned i = 0; i < count; i++) {
+		int len = snprintf (key, sizeof (key), "%u", i);
+
+		for (int pos = len; pos < MAXKEYLEN - 1; pos++)
+			key[pos] = pos % 64 == 63 ? '.' : 'a' + (i + pos) % 26;
+		key[MAXKEYLEN - 1] = '\0';
+		make_addr4 (addr, i);
+
+		struct builder_hst rec = {
+			.type = GETHOSTBYNAME,
+			.key = key,
+			.keylen = MAXKEYLEN,
+			.name = key,
+			.addrs = addr,
+			.naddrs = 1,
+			.addrlen = sizeof (addr),
+			.ttl = GENERATE_TTL
+		};
+		if (builder_add_hst (b, &rec) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+#define BIGAI_NADDRS	4096
+
+/* GETAI records with thousands of addresses of both families. */
+static int
+gen_bigai (struct db_builder *b, unsigned count) {
+	uint8_t *addrs = malloc (BIGAI_NADDRS * sizeof (struct in6_addr));
+	uint8_t *families = malloc (BIGAI_NADDRS);
+	char key[64], canon[64];
+	int rc = addrs && families ? 0 : -1;
+
+	for (unsigned i = 0; rc == 0 && i < count; i++) {
+		uint8_t *p = addrs;
+
+		for (unsigned j = 0; j < BIGAI_NADDRS; j++) {
+			families[j] = j % 2 ? AF_INET6 : AF_INET;
+			if (families[j] == AF_INET6)
+				make_addr6 (p, i * BIGAI_NADDRS + j);
+			else
+				make_addr4 (p, i * BIGAI_NADDRS + j);
+			p += ai_addr_len (families[j]);
+		}
+		snprintf (key, sizeof (key), "pool%u.example.com", i);
+		snprintf (canon, sizeof (canon), "lb%u.example.com", i);
+
+		struct builder_ai rec = {
+			.key = key,
+			.canon = canon,
+			.addrs = addrs,
+			.families = families,
+			.naddrs = BIGAI_NADDRS,
+			.ttl = GENERATE_TTL
+		};
+		rc = builder_add_ai (b, &rec);
+	}
+
+	free (addrs);
+	free (families);
+	return rc;
+}
+
+#define ALIASES_PER_RECORD	256
+#define ADDRS_PER_RECORD	16
+
+/* Huge alias lists, with a hash entry for every alias and every address
+   sharing the packet of the record.
+ */
+static int
+gen_aliases (struct db_builder *b, unsigned count) {
+	char **aliases = calloc (ALIASES_PER_RECORD, sizeof (char *));
+	uint8_t addrs[ADDRS_PER_RECORD * 4];
+	char name[64];
+	int rc = aliases ? 0 : -1;
+
+	for (unsigned i = 0; rc == 0 && i < count; i++) {
+		for (unsigned j = 0; j < ALIASES_PER_RECORD; j++) {
+			free (aliases[j]);
+			if (asprintf (&aliases[j], "alias%u-%u.example.com", j, i) < 0) {
+				aliases[j] = NULL;
+				rc = -1;
+			}
+		}
+		for (unsigned j = 0; j < ADDRS_PER_RECORD; j++)
+			make_addr4 (addrs + 4 * j, i * ADDRS_PER_RECORD + j);
+		snprintf (name, sizeof (name), "shared%u.example.com", i);
+
+		struct builder_hst rec = {
+			.type = GETHOSTBYNAME,
+			.key = name,
+			.keylen = strlen (name) + 1,
+			.name = name,
+			.aliases = (const char *const *) aliases,
+			.naliases = ALIASES_PER_RECORD,
+			.addrs = addrs,
+			.naddrs = ADDRS_PER_RECORD,
+			.addrlen = 4,
+			.alias_entries = true,
+			.ttl = GENERATE_TTL
+		};
+		if (rc == 0)
+			rc = builder_add_hst (b, &rec);
+	}
+
+	for (unsigned j = 0; aliases && j < ALIASES_PER_RECORD; j++)
+		free (aliases[j]);
+	free (aliases);
+	return rc;
+}
+
+/* Small records with a free hole behind every allocation. */
+static int
+gen_fragmented (struct db_builder *b, unsigned count) {
+	b->gap = BLOCK_ALIGN;
+	for (unsigned i = 0; i < count; i++)
+		if (add_host (b, i) != 0)
+			return -1;
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	generate_fn fn;
+	unsigned count;
+	nscd_ssize_t module;
+} kinds[] = {
+	{ "onebucket", gen_onebucket, 20000, DEFAULT_SUGGESTED_MODULE },
+	{ "maxkey", gen_maxkey, 10000, 4099 },
+	{ "bigai", gen_bigai, 200, DEFAULT_SUGGESTED_MODULE },
+	{ "aliases", gen_aliases, 100, 65521 },
+	{ "fragmented", gen_fragmented, 50000, 16411 }
+};
+
+/* Generate a database of KIND with COUNT records (0 for the default of
+   the kind) into FILENAME.
+ */
+int
+generate_db (const char *kind, unsigned count, const char *filename) {
+	for (size_t i = 0; i < sizeof (kinds) / sizeof (*kinds); i++) {
+		if (strcmp (kind, kinds[i].name) != 0)
+			continue;
+
+		struct db_builder b;
+		if (builder_init (&b, kinds[i].module) != 0) {
+			fprintf (stderr, "Memory allocation failure\n");
+			return -1;
+		}
+
+		int rc = kinds[i].fn (&b, count ? count : kinds[i].count);
+		if (rc != 0)
+			fprintf (stderr, "Cannot generate \"%s\": data area full or"
+					 " out of memory\n", kind);
+		else
+			rc = builder_write (&b, filename, 0);
+		if (rc == 0)
+			printf ("Generated \"%s\": %d entries, %zu bytes of data,"
+					" longest chain %d\n",
+					filename, b.nentries, b.first_free, b.maxnsearched);
+
+		builder_free (&b);
+		return rc;
+	}
+
+	fprintf (stderr, "Unknown kind \"%s\", one of:", kind);
+	for (size_t i = 0; i < sizeof (kinds) / sizeof (*kinds); i++)
+		fprintf (stderr, " %s", kinds[i].name);
+	fprintf (stderr, "\n");
+	return -1;
+}
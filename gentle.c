@@ -0,0 +1,231 @@
+/* Throttled ("gentle") execution mode.
+
+   nscd_dump is usually run on the very hosts nscd serves.  In gentle
+   mode the process moves itself to the idle I/O class and to
+   SCHED_IDLE, and the chain walk and the output are paced by two token
+   buckets: one on bytes of the database touched, the other on records
+   decoded.  Time spent sleeping is reported at the end so the impact
+   on the run time is visible.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include "nscd_dump.h"
+
+/* From linux/ioprio.h, which is not always installed. */
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_WHO_PROCESS	1
+
+struct gentle_state gentle;
+
+static double
+now_monotonic (void) {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Lower both the CPU and the I/O priority of the process.  Failures are
+   not fatal: pacing alone still bounds the impact.
+ */
+static void
+lower_priorities (void) {
+#ifdef SYS_ioprio_set
+	if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+				 IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0)
+		fprintf (stderr, "Cannot switch to idle I/O class: %s\n",
+				 strerror (errno));
+#endif
+
+	struct sched_param param = { .sched_priority = 0 };
+	if (sched_setscheduler (0, SCHED_IDLE, &param) != 0)
+		fprintf (stderr, "Cannot switch to SCHED_IDLE: %s\n",
+				 strerror (errno));
+}
+
+int
+gentle_init (double byte_rate, double record_rate) {
+	if (byte_rate <= 0 || record_rate <= 0)
+		return -1;
+
+	memset (&gentle, 0, sizeof (gentle));
+
+	/* Allow bursts of 100ms worth of work, and visit the buckets four
+	   times per burst so the sleeps stay short and regular.
+	 */
+	gentle.byte_rate = byte_rate;
+	gentle.byte_burst = byte_rate / 10;
+	gentle.byte_tokens = gentle.byte_burst;
+	gentle.record_rate = record_rate;
+	gentle.record_burst = record_rate / 10;
+	gentle.record_tokens = gentle.record_burst;
+	gentle.quantum_bytes = MAX (gentle.byte_burst / 4, 1);
+	gentle.quantum_records = MAX (gentle.record_burst / 4, 1);
+	gentle.last = now_monotonic ();
+	gentle.enabled = 1;
+
+	lower_priorities ();
+	return 0;
+}
+
+/* Slow path of gentle_charge (): move the pending charges into the token
+   buckets and sleep off whichever of them went into debt.
+ */
+void
+gentle_throttle (void) {
+	double now = now_monotonic ();
+	double elapsed = now - gentle.last;
+
+	gentle.last = now;
+
+	gentle.byte_tokens = MIN (gentle.byte_burst,
+							  gentle.byte_tokens + elapsed * gentle.byte_rate);
+	gentle.record_tokens = MIN (gentle.record_burst,
+								gentle.record_tokens
+									+ elapsed * gentle.record_rate);
+
+	gentle.byte_tokens -= gentle.pending_bytes;
+	gentle.record_tokens -= gentle.pending_records;
+	gentle.bytes += gentle.pending_bytes;
+	gentle.records += gentle.pending_records;
+	gentle.pending_bytes = 0;
+	gentle.pending_records = 0;
+
+	double debt = 0;
+	if (gentle.byte_tokens < 0)
+		debt = -gentle.byte_tokens / gentle.byte_rate;
+	if (gentle.record_tokens < 0)
+		debt = MAX (debt, -gentle.record_tokens / gentle.record_rate);
+	if (debt <= 0)
+		return;
+
+	struct timespec ts = {
+		.tv_sec = (time_t) debt,
+		.tv_nsec = (long) ((debt - (time_t) debt) * 1e9)
+	};
+	while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+		;
+
+	/* The sleep itself is accounted as the refill on the next visit. */
+	gentle.slept += debt;
+	gentle.pauses++;
+}
+
+void
+gentle_report (FILE *out) {
+	if (!gentle.enabled)
+		return;
+
+	/* Flush what has not reached the buckets yet. */
+	gentle.bytes += gentle.pending_bytes;
+	gentle.records += gentle.pending_records;
+	gentle.pending_bytes = 0;
+	gentle.pending_records = 0;
+
+	fprintf (out, "Gentle mode: slept %.3f s in %lu pauses, "
+			 "touched %llu bytes, decoded %llu records, "
+			 "CPU quota allows %u thread(s)\n",
+			 gentle.slept, gentle.pauses, gentle.bytes, gentle.records,
+			 available_cpus ());
+}
+
+/* Number of CPUs cgroup v2 "cpu.max" grants to the cgroup at PATH, or 0
+   when there is no limit or it cannot be read.
+ */
+static unsigned
+cgroup2_cpus (const char *path) {
+	char buf[64];
+	long quota, period;
+	unsigned cpus = 0;
+
+	FILE *f = fopen (path, "r");
+	if (f == NULL)
+		return 0;
+	if (   fgets (buf, sizeof (buf), f) != NULL
+		&& sscanf (buf, "%ld %ld", &quota, &period) == 2
+		&& quota > 0 && period > 0)
+		cpus = (quota + period - 1) / period;
+	fclose (f);
+
+	return cpus;
+}
+
+/* Same for cgroup v1 "cpu.cfs_quota_us" and "cpu.cfs_period_us". */
+static unsigned
+cgroup1_cpus (void) {
+	long quota = -1, period = 0;
+	FILE *f;
+
+	if ((f = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != NULL) {
+		if (fscanf (f, "%ld", &quota) != 1)
+			quota = -1;
+		fclose (f);
+	}
+	if ((f = fopen ("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != NULL) {
+		if (fscanf (f, "%ld", &period) != 1)
+			period = 0;
+		fclose (f);
+	}
+
+	if (quota <= 0 || period <= 0)
+		return 0;
+	return (quota + period - 1) / period;
+}
+
+/* Number of CPUs the process may actually keep busy: the affinity mask
+   clamped by the cgroup CPU quota.  Worker pools are sized from this
+   rather than from the number of online CPUs.
+ */
+unsigned
+available_cpus (void) {
+	cpu_set_t set;
+	unsigned cpus = 1;
+
+	if (sched_getaffinity (0, sizeof (set), &set) == 0)
+		cpus = MAX (CPU_COUNT (&set), 1);
+
+	/* cgroup v2: the own cgroup is named in the "0::" line. */
+	unsigned quota = 0;
+	char line[512], path[600];
+	FILE *f = fopen ("/proc/self/cgroup", "r");
+	if (f != NULL) {
+		while (fgets (line, sizeof (line), f) != NULL) {
+			if (strncmp (line, "0::", 3) != 0)
+				continue;
+			line[strcspn (line, "\n")] = '\0';
+			snprintf (path, sizeof (path), "/sys/fs/cgroup%s/cpu.max",
+					  line + 3);
+			quota = cgroup2_cpus (path);
+			break;
+		}
+		fclose (f);
+	}
+	if (quota == 0)
+		quota = cgroup2_cpus ("/sys/fs/cgroup/cpu.max");
+	if (quota == 0)
+		quota = cgroup1_cpus ();
+
+	if (quota != 0)
+		cpus = MIN (cpus, quota);
+	return cpus;
+}
@@ -0,0 +1,237 @@
+/* Hash functions.
+
+   nscd_hash () is the bucket hash of nscd (__nis_hash () in glibc).
+   SipHash-2-4 by Jean-Philippe Aumasson and Daniel J. Bernstein, used
+   wherever a keyed pseudo-random function is needed.  XXH64 by Yann
+   Collet, streaming, for fingerprints of large amounts of data; its
+   four independent lanes keep the multipliers of the CPU busy.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <string.h>
+
+#include "nscd_dump.h"
+
+#define ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND									\
+	do {											\
+		v0 += v1; v1 = ROTL64 (v1, 13); v1 ^= v0;	\
+		v0 = ROTL64 (v0, 32);						\
+		v2 += v3; v3 = ROTL64 (v3, 16); v3 ^= v2;	\
+		v0 += v3; v3 = ROTL64 (v3, 21); v3 ^= v0;	\
+		v2 += v1; v1 = ROTL64 (v1, 17); v1 ^= v2;	\
+		v2 = ROTL64 (v2, 32);						\
+	} while (0)
+
+static inline uint64_t
+load64_le (const uint8_t *p) {
+	uint64_t v;
+
+	memcpy (&v, p, sizeof (v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64 (v);
+#endif
+	return v;
+}
+
+static inline uint32_t
+load32_le (const uint8_t *p) {
+	uint32_t v;
+
+	memcpy (&v, p, sizeof (v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32 (v);
+#endif
+	return v;
+}
+
+uint64_t
+siphash24 (const struct sipkey *key, const void *src, size_t len) {
+	const uint8_t *in = src;
+	uint64_t v0 = 0x736f6d6570736575ULL ^ key->k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ key->k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ key->k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ key->k1;
+	uint64_t b = (uint64_t) len << 56;
+	const uint8_t *end = in + len - (len % 8);
+
+	for (; in != end; in += 8) {
+		uint64_t m = load64_le (in);
+
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	switch (len & 7) {
+	case 7: b |= (uint64_t) in[6] << 48;	/* Fall through. */
+	case 6: b |= (uint64_t) in[5] << 40;	/* Fall through. */
+	case 5: b |= (uint64_t) in[4] << 32;	/* Fall through. */
+	case 4: b |= (uint64_t) in[3] << 24;	/* Fall through. */
+	case 3: b |= (uint64_t) in[2] << 16;	/* Fall through. */
+	case 2: b |= (uint64_t) in[1] << 8;		/* Fall through. */
+	case 1: b |= (uint64_t) in[0];
+	}
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Derive a key from an arbitrary secret string. */
+void
+sipkey_from_string (struct sipkey *key, const char *secret) {
+	static const struct sipkey zero = { 0, 0 };
+	struct sipkey k1 = { 1, 0 };
+
+	key->k0 = siphash24 (&zero, secret, strlen (secret));
+	key->k1 = siphash24 (&k1, secret, strlen (secret));
+}
+
+uint32_t
+nscd_hash (const void *key, size_t len) {
+	const uint8_t *p = key;
+	uint32_t h = 0;
+
+	while (len-- > 0)
+		h = *p++ + 65599 * h;
+	return h;
+}
+
+#define XXH_PRIME64_1	0x9e3779b185ebca87ULL
+#define XXH_PRIME64_2	0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME64_3	0x165667b19e3779f9ULL
+#define XXH_PRIME64_4	0x85ebca77c2b2ae63ULL
+#define XXH_PRIME64_5	0x27d4eb2f165667c5ULL
+
+static inline uint64_t
+xxh64_round (uint64_t acc, uint64_t input) {
+	acc += input * XXH_PRIME64_2;
+	acc = ROTL64 (acc, 31);
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge (uint64_t acc, uint64_t val) {
+	acc ^= xxh64_round (0, val);
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void
+xxh64_init (struct xxh64_state *st, uint64_t seed) {
+	memset (st, 0, sizeof (*st));
+	st->seed = seed;
+	st->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	st->v[1] = seed + XXH_PRIME64_2;
+	st->v[2] = seed;
+	st->v[3] = seed - XXH_PRIME64_1;
+}
+
+/* Consume whole stripes of 32 bytes from P, returning what is left. */
+static const uint8_t *
+xxh64_stripes (struct xxh64_state *st, const uint8_t *p, const uint8_t *end) {
+	uint64_t v0 = st->v[0], v1 = st->v[1], v2 = st->v[2], v3 = st->v[3];
+
+	for (; end - p >= 32; p += 32) {
+		v0 = xxh64_round (v0, load64_le (p));
+		v1 = xxh64_round (v1, load64_le (p + 8));
+		v2 = xxh64_round (v2, load64_le (p + 16));
+		v3 = xxh64_round (v3, load64_le (p + 24));
+	}
+
+	st->v[0] = v0;
+	st->v[1] = v1;
+	st->v[2] = v2;
+	st->v[3] = v3;
+	return p;
+}
+
+void
+xxh64_update (struct xxh64_state *st, const void *src, size_t len) {
+	const uint8_t *p = src, *end = p + len;
+
+	st->total_len += len;
+
+	if (st->buffered + len < sizeof (st->buf)) {
+		memcpy (st->buf + st->buffered, p, len);
+		st->buffered += len;
+		return;
+	}
+
+	if (st->buffered != 0) {
+		size_t fill = sizeof (st->buf) - st->buffered;
+
+		memcpy (st->buf + st->buffered, p, fill);
+		xxh64_stripes (st, st->buf, st->buf + sizeof (st->buf));
+		p += fill;
+		st->buffered = 0;
+	}
+
+	p = xxh64_stripes (st, p, end);
+	memcpy (st->buf, p, end - p);
+	st->buffered = end - p;
+}
+
+uint64_t
+xxh64_digest (const struct xxh64_state *st) {
+	const uint8_t *p = st->buf, *end = p + st->buffered;
+	uint64_t h;
+
+	if (st->total_len >= sizeof (st->buf)) {
+		h = ROTL64 (st->v[0], 1) + ROTL64 (st->v[1], 7)
+			+ ROTL64 (st->v[2], 12) + ROTL64 (st->v[3], 18);
+		for (int i = 0; i < 4; i++)
+			h = xxh64_merge (h, st->v[i]);
+	} else
+		h = st->seed + XXH_PRIME64_5;
+	h += st->total_len;
+
+	for (; end - p >= 8; p += 8) {
+		h ^= xxh64_round (0, load64_le (p));
+		h = ROTL64 (h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t) load32_le (p) * XXH_PRIME64_1;
+		h = ROTL64 (h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = ROTL64 (h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t
+xxh64 (const void *src, size_t len, uint64_t seed) {
+	struct xxh64_state st;
+
+	xxh64_init (&st, seed);
+	xxh64_update (&st, src, len);
+	return xxh64_digest (&st);
+}
@@ -0,0 +1,249 @@
+/* Occupancy and locality heatmap of the data area.
+
+   The data area is divided into pages of the file, and each page is
+   accounted as bytes of hash entries, of packets, of alignment padding
+   behind them, and free bytes (holes left by the garbage collector and
+   the unused tail).  For each page the distinct buckets whose chains
+   touch it are counted too, the first few of them listed, which
+   together with the pages per chain shows whether chains scatter over
+   the file.
+
+   The report is text, one line per page, or a PPM image with one pixel
+   per page: red for hash entries, green for packets, blue for padding,
+   black for free space.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+/* Pixels per row of the PPM image. */
+#define HEATMAP_PPM_WIDTH	64
+/* Buckets listed per page in the text report. */
+#define HEATMAP_BUCKETS		8
+
+struct page_stats {
+	uint32_t he, packet, padding;
+	uint32_t buckets;
+	nscd_ssize_t last_bucket;	/* Bucket that last touched the page. */
+	uint32_t listed[HEATMAP_BUCKETS];	/* The first BUCKETS of them. */
+};
+
+struct heatmap {
+	char *data;
+	size_t data_off;			/* Of the data area in the file. */
+	size_t page_size;
+	size_t first_page, npages;
+	struct page_stats *pages;
+	uint8_t *seen_packets;		/* Bit per BLOCK_ALIGN unit. */
+	/* Distinct pages touched by the current chain. */
+	unsigned long chain_pages;
+};
+
+/* Note that the chain of BUCKET touches the page holding data offset
+   REF.
+ */
+static void
+touch_page (struct heatmap *hm, ref_t ref, nscd_ssize_t bucket) {
+	size_t page = (hm->data_off + ref) / hm->page_size - hm->first_page;
+	struct page_stats *ps = &hm->pages[page];
+
+	if (ps->last_bucket != bucket) {
+		ps->last_bucket = bucket;
+		if (ps->buckets < HEATMAP_BUCKETS)
+			ps->listed[ps->buckets] = bucket;
+		ps->buckets++;
+		hm->chain_pages++;
+	}
+}
+
+/* Account LEN bytes at data offset START to FIELD of the pages they
+   cover, for BUCKET unless that is negative.
+ */
+static void
+account (struct heatmap *hm, size_t field, ref_t start, size_t len,
+		 nscd_ssize_t bucket) {
+	size_t pos = hm->data_off + start;
+	size_t end = pos + len;
+
+	while (pos < end) {
+		size_t page = pos / hm->page_size;
+		size_t chunk = MIN (end, (page + 1) * hm->page_size) - pos;
+		struct page_stats *ps = &hm->pages[page - hm->first_page];
+
+		*(uint32_t *) ((char *) ps + field) += chunk;
+		if (bucket >= 0)
+			touch_page (hm, pos - hm->data_off, bucket);
+		pos += chunk;
+	}
+}
+
+/* Account an allocation of LEN bytes at START and the padding up to the
+   next BLOCK_ALIGN boundary behind it.
+ */
+static void
+account_alloc (struct heatmap *hm, size_t field, ref_t start, size_t len,
+			   nscd_ssize_t bucket) {
+	account (hm, field, start, len, bucket);
+	account (hm, offsetof (struct page_stats, padding), start + len,
+			 roundup (start + len, BLOCK_ALIGN) - (start + len), -1);
+}
+
+static void
+walk (struct heatmap *hm, struct database_pers_head *head,
+	  unsigned long *chains, unsigned long *chain_pages) {
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt) {
+		ref_t run = head->array[cnt];
+
+		/* The slot in the bucket array is outside the data area and
+		   not accounted.
+		 */
+		hm->chain_pages = 0;
+		if (run != ENDREF)
+			++*chains;
+
+		while (run != ENDREF) {
+			struct hashentry *he = (struct hashentry *) (hm->data + run);
+			struct datahead *dh = (struct datahead *) (hm->data
+													   + he->packet);
+
+			account_alloc (hm, offsetof (struct page_stats, he), run,
+						   sizeof (*he), cnt);
+			if (!test_and_set (hm->seen_packets, he->packet / BLOCK_ALIGN))
+				account_alloc (hm, offsetof (struct page_stats, packet),
+							   he->packet, dh->allocsize, cnt);
+			else
+				touch_page (hm, he->packet, cnt);
+			/* Keys of alias entries lie further into the packet. */
+			if (!he->first)
+				touch_page (hm, he->key, cnt);
+			run = he->next;
+		}
+		*chain_pages += hm->chain_pages;
+	}
+}
+
+static void
+report_text (const struct heatmap *hm, const struct database_pers_head *head,
+			 unsigned long chains, unsigned long chain_pages) {
+	unsigned long long he = 0, packet = 0, padding = 0, free_bytes = 0;
+	size_t data_end = hm->data_off + head->data_size;
+
+	printf ("%-12s %8s %8s %8s %8s %8s  %s\n", "File offset", "hashent",
+			"packets", "padding", "free", "buckets", "bucket numbers");
+	for (size_t i = 0; i < hm->npages; i++) {
+		const struct page_stats *ps = &hm->pages[i];
+		size_t start = MAX ((hm->first_page + i) * hm->page_size,
+							hm->data_off);
+		size_t end = MIN ((hm->first_page + i + 1) * hm->page_size, data_end);
+		size_t unused = end - start - ps->he - ps->packet - ps->padding;
+
+		printf ("%#-12zx %8u %8u %8u %8zu %8u",
+				(hm->first_page + i) * hm->page_size,
+				ps->he, ps->packet, ps->padding, unused, ps->buckets);
+		for (uint32_t b = 0; b < MIN (ps->buckets, HEATMAP_BUCKETS); b++)
+			printf ("%s%u", b ? "," : "  ", ps->listed[b]);
+		printf ("%s\n", ps->buckets > HEATMAP_BUCKETS ? ",..." : "");
+		he += ps->he;
+		packet += ps->packet;
+		padding += ps->padding;
+		free_bytes += unused;
+	}
+
+	printf ("\n%zu pages of %zu bytes: %llu bytes of hash entries, %llu of"
+			" packets,\n%llu of padding, %llu free (%llu below first_free)\n",
+			hm->npages, hm->page_size, he, packet, padding, free_bytes,
+			free_bytes - (head->data_size - head->first_free));
+	if (chains != 0)
+		printf ("%lu chains touch %.2f data pages on average\n", chains,
+				(double) chain_pages / chains);
+}
+
+static void
+report_ppm (const struct heatmap *hm, const struct database_pers_head *head) {
+	size_t height = (hm->npages + HEATMAP_PPM_WIDTH - 1) / HEATMAP_PPM_WIDTH;
+	size_t data_end = hm->data_off + head->data_size;
+
+	printf ("P6\n%d %zu\n255\n", HEATMAP_PPM_WIDTH, height);
+	for (size_t i = 0; i < height * HEATMAP_PPM_WIDTH; i++) {
+		uint8_t rgb[3] = { 0x40, 0x40, 0x40 };		/* Past the end. */
+
+		if (i < hm->npages) {
+			const struct page_stats *ps = &hm->pages[i];
+			size_t start = MAX ((hm->first_page + i) * hm->page_size,
+								hm->data_off);
+			size_t end = MIN ((hm->first_page + i + 1) * hm->page_size,
+							  data_end);
+			double size = end - start;
+
+			rgb[0] = 255 * ps->he / size;
+			rgb[1] = 255 * ps->packet / size;
+			rgb[2] = 255 * ps->padding / size;
+		}
+		fwrite (rgb, 1, sizeof (rgb), stdout);
+	}
+}
+
+/* Print the heatmap of DB in FORMAT, "text" or "ppm". */
+int
+heatmap_db (struct db_file *db, const char *format) {
+	struct database_pers_head *head = &db->head;
+	int ppm = strcmp (format, "ppm") == 0;
+
+	if (!ppm && strcmp (format, "text") != 0) {
+		fprintf (stderr, "Unknown heatmap format \"%s\", text or ppm\n",
+				 format);
+		return -1;
+	}
+
+	const char *msg = verify_persistent_db (db->mem, head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	struct heatmap hm;
+	memset (&hm, 0, sizeof (hm));
+	hm.data = db_data (db->mem);
+	hm.data_off = hm.data - (char *) db->mem;
+	hm.page_size = sysconf (_SC_PAGESIZE);
+	hm.first_page = hm.data_off / hm.page_size;
+	hm.npages = (hm.data_off + head->data_size + hm.page_size - 1)
+		/ hm.page_size - hm.first_page;
+	hm.pages = calloc (hm.npages, sizeof (*hm.pages));
+	hm.seen_packets = calloc (head->first_free / BLOCK_ALIGN / 8 + 1, 1);
+	if (hm.pages == NULL || hm.seen_packets == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		free (hm.pages);
+		free (hm.seen_packets);
+		return -1;
+	}
+	for (size_t i = 0; i < hm.npages; i++)
+		hm.pages[i].last_bucket = -1;
+
+	unsigned long chains = 0, chain_pages = 0;
+	walk (&hm, db->mem, &chains, &chain_pages);
+
+	if (ppm)
+		report_ppm (&hm, head);
+	else
+		report_text (&hm, head, chains, chain_pages);
+
+	free (hm.pages);
+	free (hm.seen_packets);
+	return 0;
+}
@@ -0,0 +1,395 @@
+/* History of keys across a directory of snapshots.
+
+   Answering for one key what every snapshot in a directory held takes
+   the snapshot's hash entries sorted by a hash of their key, kept next
+   to it in a sidecar file SNAPSHOT.keys.  The sidecar is built the
+   first time the snapshot is queried, after verifying it, and rebuilt
+   only when the size or modification time of the snapshot changes; a
+   query then reads the header, binary searches the sidecar and touches
+   the packets of the matching entries only.
+
+   The key hash does not depend on the type, so that a name and an
+   address given as text are looked up under every type they can be a
+   key of.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nscd_dump.h"
+
+#define KEY_INDEX_MAGIC		"NSCDKIX1"
+#define KEY_INDEX_SUFFIX	".keys"
+#define KEY_INDEX_SEED		0x6e7363645f6b6978ULL
+
+struct key_index_head {
+	char magic[8];
+	/* Of the snapshot when it was indexed. */
+	uint64_t size;
+	int64_t mtime_sec, mtime_nsec;
+	uint64_t count;
+};
+
+struct key_index_entry {
+	uint64_t hash;
+	ref_t he;
+	uint32_t pad;
+};
+
+/* A snapshot of the directory and its key index. */
+struct snapshot {
+	char *name;
+	int64_t timestamp;
+	const struct key_index_entry *entries;
+	size_t count;
+	void *map;					/* Of the sidecar, or the built index. */
+	size_t map_len;
+	int built;
+};
+
+static inline uint64_t
+key_hash (const void *key, size_t len) {
+	return xxh64 (key, len, KEY_INDEX_SEED);
+}
+
+static int
+compare_index_entries (const void *a, const void *b) {
+	const struct key_index_entry *x = a, *y = b;
+
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return x->he < y->he ? -1 : x->he > y->he;
+}
+
+static int
+compare_snapshots (const void *a, const void *b) {
+	const struct snapshot *x = a, *y = b;
+
+	if (x->timestamp != y->timestamp)
+		return x->timestamp < y->timestamp ? -1 : 1;
+	return strcmp (x->name, y->name);
+}
+
+/* Map the sidecar INDEX of the snapshot with status ST into SNAP.
+   Returns -1 if there is none or it is stale.
+ */
+static int
+load_index (struct snapshot *snap, const char *index, const struct stat64 *st) {
+	struct key_index_head head;
+
+	int fd = open (index, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	struct stat64 ist;
+	int rc = -1;
+	if (   fstat64 (fd, &ist) == 0
+		&& read (fd, &head, sizeof (head)) == sizeof (head)
+		&& memcmp (head.magic, KEY_INDEX_MAGIC, sizeof (head.magic)) == 0
+		&& head.size == (uint64_t) st->st_size
+		&& head.mtime_sec == st->st_mtim.tv_sec
+		&& head.mtime_nsec == st->st_mtim.tv_nsec
+		&& head.count <= (ist.st_size - sizeof (head))
+						 / sizeof (struct key_index_entry)
+		&& sizeof (head) + head.count * sizeof (struct key_index_entry)
+		   == (uint64_t) ist.st_size) {
+		snap->map_len = ist.st_size;
+		snap->map = mmap (NULL, snap->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (snap->map != MAP_FAILED) {
+			snap->entries = (const struct key_index_entry *)
+				((char *) snap->map + sizeof (head));
+			snap->count = head.count;
+			rc = 0;
+		}
+	}
+	close (fd);
+	return rc;
+}
+
+/* Index the keys of the snapshot DB into SNAP, and save the index to
+   the sidecar INDEX if it can be written.
+ */
+static int
+build_index (struct snapshot *snap, struct db_file *db, const char *index) {
+	struct database_pers_head *head = db->mem;
+	const char *data = db_data (head);
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	struct key_index_head ihead;
+	size_t len = sizeof (ihead) + head->nentries * sizeof (*snap->entries);
+	char *map = malloc (len);
+	if (map == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	struct key_index_entry *entries = (struct key_index_entry *)
+		(map + sizeof (ihead));
+	size_t n = 0;
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+
+			entries[n].hash = key_hash (data + he->key, he->len);
+			entries[n].he = run;
+			entries[n++].pad = 0;
+			run = he->next;
+		}
+	qsort (entries, n, sizeof (*entries), compare_index_entries);
+
+	memset (&ihead, 0, sizeof (ihead));
+	memcpy (ihead.magic, KEY_INDEX_MAGIC, sizeof (ihead.magic));
+	ihead.size = db->st.st_size;
+	ihead.mtime_sec = db->st.st_mtim.tv_sec;
+	ihead.mtime_nsec = db->st.st_mtim.tv_nsec;
+	ihead.count = n;
+	memcpy (map, &ihead, sizeof (ihead));
+
+	/* A read-only archive is still queried, just not faster next time. */
+	write_atomic (index, map, sizeof (ihead) + n * sizeof (*entries));
+
+	snap->map = map;
+	snap->map_len = 0;
+	snap->entries = entries;
+	snap->count = n;
+	snap->built = 1;
+	return 0;
+}
+
+static void
+free_index (struct snapshot *snap) {
+	if (snap->built)
+		free (snap->map);
+	else if (snap->map != NULL)
+		munmap (snap->map, snap->map_len);
+	snap->map = NULL;
+}
+
+static void
+format_time (char *buf, size_t size, time_t t) {
+	struct tm tm;
+
+	if (gmtime_r (&t, &tm) == NULL)
+		snprintf (buf, size, "invalid");
+	else
+		strftime (buf, size, "%Y-%m-%d %H:%M:%S UTC", &tm);
+}
+
+static void
+print_addr (int af, const void *addr) {
+	char buf[INET6_ADDRSTRLEN];
+
+	printf (" %s", inet_ntop (af, addr, buf, sizeof (buf)) ? buf : "?");
+}
+
+/* Print the state of the entry HE of the snapshot with data area DATA. */
+static void
+print_state (const char *data, struct hashentry *he) {
+	struct datahead *dh = (struct datahead *) (data + he->packet);
+	char expires[64];
+
+	format_time (expires, sizeof (expires), dh->timeout);
+	printf ("  %-17s %s%s, expires %s", serv2str[he->type],
+			dh->notfound ? "negative" : "positive",
+			he->first ? "" : " (alias)", expires);
+
+	if (dh->notfound)
+		printf ("\n");
+	else if (he->type == GETAI) {
+		struct ai_view view;
+
+		if (decode_ai (dh, &view) != 0)
+			printf (": malformed record\n");
+		else {
+			uint8_t *addr = view.addrs;
+
+			printf (":");
+			for (nscd_ssize_t i = 0; i < view.resp->naddrs; i++) {
+				print_addr (view.families[i], addr);
+				addr += ai_addr_len (view.families[i]);
+			}
+			printf ("\n");
+		}
+	} else {
+		struct hst_view view;
+
+		if (decode_hst (dh, &view) != 0)
+			printf (": malformed record\n");
+		else {
+			printf (":");
+			for (nscd_ssize_t i = 0; i < view.resp->h_addr_list_cnt; i++)
+				print_addr (view.resp->h_length == sizeof (struct in6_addr)
+							? AF_INET6 : AF_INET,
+							view.addrs + i * view.resp->h_length);
+			printf ("\n");
+		}
+	}
+}
+
+/* Print the entries of SNAP for the LEN byte key KEY.  Returns their
+   number.
+ */
+static unsigned
+print_key (const struct snapshot *snap, struct db_file *db, const void *key,
+		   size_t len) {
+	struct database_pers_head *head = db->mem;
+	const char *data = db_data (head);
+	struct key_index_entry probe = { key_hash (key, len), 0, 0 };
+	size_t lo = 0, hi = snap->count;
+	unsigned found = 0;
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (compare_index_entries (&snap->entries[mid], &probe) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < snap->count && snap->entries[lo].hash == probe.hash; lo++) {
+		ref_t run = snap->entries[lo].he;
+		struct hashentry *he = (struct hashentry *) (data + run);
+
+		/* The snapshot was verified when indexed and has not changed
+		   since, but stay within its live data all the same.
+		 */
+		if (   (size_t) run + sizeof (*he) > (size_t) head->first_free
+			|| he->packet + sizeof (struct datahead)
+			   > (size_t) head->first_free
+			|| he->type >= LASTREQ || he->len != len
+			|| (size_t) he->key + len > (size_t) head->first_free
+			|| memcmp (data + he->key, key, len) != 0)
+			continue;
+		print_state (data, he);
+		found++;
+	}
+	return found;
+}
+
+static int
+is_snapshot (const struct dirent *d) {
+	size_t len = strlen (d->d_name);
+	size_t slen = strlen (KEY_INDEX_SUFFIX);
+
+	return d->d_name[0] != '.' && (d->d_type == DT_REG
+								   || d->d_type == DT_UNKNOWN)
+		&& !(len > slen && strcmp (d->d_name + len - slen,
+								   KEY_INDEX_SUFFIX) == 0)
+		&& strstr (d->d_name, ".keys.") == NULL;
+}
+
+/* Print every state of KEY in the snapshots in DIR, oldest first. */
+int
+history_db (const char *dir, const char *key) {
+	struct dirent **names;
+	char path[PATH_MAX], index[PATH_MAX + sizeof (KEY_INDEX_SUFFIX)];
+	unsigned char addr[sizeof (struct in6_addr)];
+
+	int n = scandir (dir, &names, is_snapshot, alphasort);
+	if (n < 0) {
+		fprintf (stderr, "Cannot read \"%s\": %s\n", dir, strerror (errno));
+		return -1;
+	}
+
+	/* Order the snapshots by the time in their header. */
+	struct snapshot *snaps = calloc (n + 1, sizeof (*snaps));
+	int nsnaps = 0;
+	for (int i = 0; i < n; i++) {
+		struct db_file db;
+
+		snprintf (path, sizeof (path), "%s/%s", dir, names[i]->d_name);
+		if (snaps != NULL && db_open (&db, path) == 0) {
+			snaps[nsnaps].name = names[i]->d_name;
+			snaps[nsnaps++].timestamp = db.head.timestamp;
+			db_close (&db);
+		}
+	}
+	if (snaps == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		for (int i = 0; i < n; i++)
+			free (names[i]);
+		free (names);
+		return -1;
+	}
+	qsort (snaps, nsnaps, sizeof (*snaps), compare_snapshots);
+
+	/* The key as a name, and as an address if it is one. */
+	size_t addr_len = 0;
+	if (inet_pton (AF_INET, key, addr) == 1)
+		addr_len = sizeof (struct in_addr);
+	else if (inet_pton (AF_INET6, key, addr) == 1)
+		addr_len = sizeof (struct in6_addr);
+
+	printf ("History of \"%s\" in %d snapshots of \"%s\":\n", key, nsnaps, dir);
+
+	unsigned built = 0, present = 0;
+	int rc = 0;
+	for (int i = 0; i < nsnaps; i++) {
+		struct snapshot *snap = &snaps[i];
+		struct db_file db;
+		char when[64];
+
+		snprintf (path, sizeof (path), "%s/%s", dir, snap->name);
+		snprintf (index, sizeof (index), "%s%s", path, KEY_INDEX_SUFFIX);
+		if (db_open (&db, path) != 0) {
+			rc = -1;
+			continue;
+		}
+		if (   load_index (snap, index, &db.st) != 0
+			&& build_index (snap, &db, index) != 0) {
+			db_close (&db);
+			rc = -1;
+			continue;
+		}
+		built += snap->built;
+
+		format_time (when, sizeof (when), snap->timestamp);
+		printf ("\n%s  %s\n", when, snap->name);
+		unsigned found = print_key (snap, &db, key, strlen (key) + 1);
+		if (addr_len != 0)
+			found += print_key (snap, &db, addr, addr_len);
+		if (found == 0)
+			printf ("  not cached\n");
+		else
+			present++;
+
+		free_index (snap);
+		db_close (&db);
+	}
+
+	printf ("\nCached in %u of %d snapshots, %u key indexes built\n",
+			present, nsnaps, built);
+
+	for (int i = 0; i < n; i++)
+		free (names[i]);
+	free (names);
+	free (snaps);
+	return rc;
+}
@@ -0,0 +1,141 @@
+/* Lookup locality: pages and cache lines touched per lookup.
+
+   Every hash entry is taken as a key looked up, and the distinct pages
+   and cache lines of its lookup (see footprint.c) are counted.  The
+   distributions are reported with their mean and percentiles, so
+   layouts of the same records (as written by nscd, compacted, rehashed
+   to another module) can be compared by the memory cost of a lookup.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+/* Assumed when the C library does not know. */
+#define DEFAULT_CACHE_LINE	64
+
+/* Counts shown one by one in the histogram; larger ones are summed. */
+#define LOCALITY_HIST_ROWS	8
+
+/* Lookups by the number of units they touch. */
+struct distribution {
+	unsigned long long *lookups;
+	size_t size;
+	unsigned long long total, units;
+	unsigned max;
+	int failed;
+};
+
+static void
+count_lookup (nscd_ssize_t bucket, struct hashentry *he, unsigned units,
+			  void *arg) {
+	struct distribution *d = arg;
+
+	if (units >= d->size) {
+		size_t size = MAX (2 * d->size, (size_t) units + 1);
+		unsigned long long *lookups = realloc (d->lookups,
+											   size * sizeof (*lookups));
+		if (lookups == NULL) {
+			d->failed = 1;
+			return;
+		}
+		memset (lookups + d->size, 0, (size - d->size) * sizeof (*lookups));
+		d->lookups = lookups;
+		d->size = size;
+	}
+	d->lookups[units]++;
+	d->total++;
+	d->units += units;
+	if (units > d->max)
+		d->max = units;
+}
+
+/* Smallest count at or below which a FRACTION of the lookups are. */
+static size_t
+percentile (const struct distribution *d, double fraction) {
+	unsigned long long seen = 0;
+
+	for (size_t i = 0; i < d->size; i++) {
+		seen += d->lookups[i];
+		if (seen >= fraction * d->total)
+			return i;
+	}
+	return d->max;
+}
+
+static void
+report (const char *what, size_t unit_size, const struct distribution *d) {
+	unsigned long long more = 0;
+
+	printf ("%s of %zu bytes per lookup: mean %.2f, median %zu, 90th %zu,"
+			" 99th %zu, max %u\n", what, unit_size,
+			(double) d->units / d->total, percentile (d, 0.5),
+			percentile (d, 0.9), percentile (d, 0.99), d->max);
+	for (size_t i = 1; i <= d->max; i++) {
+		if (i <= LOCALITY_HIST_ROWS) {
+			printf ("  %6zu   : %10llu (%5.1f%%)\n", i, d->lookups[i],
+					100.0 * d->lookups[i] / d->total);
+			continue;
+		}
+		more += d->lookups[i];
+	}
+	if (more != 0)
+		printf ("  %6d+  : %10llu (%5.1f%%)\n", LOCALITY_HIST_ROWS + 1, more,
+				100.0 * more / d->total);
+}
+
+int
+locality_db (struct db_file *db) {
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	long line = sysconf (_SC_LEVEL1_DCACHE_LINESIZE);
+	const struct {
+		const char *what;
+		size_t unit_size;
+	} units[] = {
+		{ "Pages", sysconf (_SC_PAGESIZE) },
+		{ "Cache lines", line > 0 ? line : DEFAULT_CACHE_LINE }
+	};
+
+	for (size_t i = 0; i < sizeof (units) / sizeof (*units); i++) {
+		struct distribution d;
+
+		memset (&d, 0, sizeof (d));
+		if (   footprint_walk (db->mem, units[i].unit_size, NULL,
+							   count_lookup, &d) != 0
+			|| d.failed) {
+			fprintf (stderr, "Memory allocation failure\n");
+			free (d.lookups);
+			return -1;
+		}
+
+		if (d.total == 0) {
+			printf ("No lookups: the database is empty\n");
+			free (d.lookups);
+			return 0;
+		}
+		if (i != 0)
+			printf ("\n");
+		report (units[i].what, units[i].unit_size, &d);
+		free (d.lookups);
+	}
+	return 0;
+}
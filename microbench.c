@@ -0,0 +1,310 @@
+/* Microbenchmarks of the individual kernels of the verifier and the
+   dumper.
+
+   Every kernel runs over fixed inputs built in memory, first for a
+   warmup, then for a number of timed repetitions sized to last about
+   MICROBENCH_REP_NS each.  The median and the best time per operation
+   are reported.  Output of the printing kernels goes to /dev/null, so
+   what is measured is the formatting through stdio, not a terminal.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nscd_dump.h"
+
+#define MICROBENCH_REPS			7
+#define MICROBENCH_REP_NS		100000000ULL
+#define MICROBENCH_WARMUP_NS	50000000ULL
+
+/* Size of the map the sweep kernel scans per operation. */
+#define SWEEP_BYTES				(16 * 1024 * 1024)
+
+/* Hash entries marked per operation of the check_use () kernel. */
+#define CHECK_USE_SLOTS			4096
+
+struct bench_input {
+	struct db_builder b;
+	struct datahead *hst, *ai;
+	uint8_t *usemap;			/* Marks of the records in B. */
+	uint8_t *fresh_map;
+	uint8_t *sweep_map;
+	uint8_t addr4[4], addr6[16];
+	nscd_time_t timeout;
+};
+
+/* A kernel runs OPS operations over IN. */
+typedef void (*kernel_fn) (struct bench_input *in, unsigned long ops);
+
+static unsigned long long
+now_ns (void) {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Fresh hash entries: each operation marks CHECK_USE_SLOTS of them in a
+   cleared map.  Clearing is part of the operation, but is a fraction of
+   the marking.
+ */
+static void
+k_check_use_fresh (struct bench_input *in, unsigned long ops) {
+	size_t size = CHECK_USE_SLOTS * sizeof (struct hashentry);
+
+	while (ops-- > 0) {
+		memset (in->fresh_map, 0, size);
+		for (ref_t i = 0; i < CHECK_USE_SLOTS; i++)
+			check_use (in->b.data, size, in->fresh_map, use_he,
+					   i * sizeof (struct hashentry),
+					   sizeof (struct hashentry));
+	}
+}
+
+/* A packet referenced again, as by alias entries: walks the markers of
+   the whole packet without changing them.
+ */
+static void
+k_check_use_shared (struct bench_input *in, unsigned long ops) {
+	ref_t packet = (char *) in->hst - in->b.data;
+
+	while (ops-- > 0)
+		check_use (in->b.data, in->b.first_free, in->usemap, use_data,
+				   packet, in->hst->allocsize);
+}
+
+static void
+k_sweep (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0)
+		sweep_unreferenced (in->sweep_map, SWEEP_BYTES, 1);
+}
+
+static void
+k_print_hst (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0) {
+		hst_response_header hst_resp = in->hst->data[0].hstdata;
+		print_hst_resp_data (GETHOSTBYNAME, &hst_resp,
+							 (char *) (&in->hst->data[0].hstdata + 1), 1);
+	}
+}
+
+static void
+k_print_ai (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0) {
+		ai_response_header ai_resp = in->ai->data[0].aidata;
+		print_ai_resp_data (&ai_resp,
+							(char *) (&in->ai->data[0].aidata + 1), 1);
+	}
+}
+
+static void
+k_addr4 (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0)
+		print_ip_addr (AF_INET, in->addr4);
+}
+
+static void
+k_addr6 (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0)
+		print_ip_addr (AF_INET6, in->addr6);
+}
+
+/* The timestamp formatting of print_hashentry_datahead (). */
+static void
+k_timestamp (struct bench_input *in, unsigned long ops) {
+	while (ops-- > 0) {
+		const char *tstamp = asctime (gmtime ((time_t *) &in->timeout));
+		printf ("%s", tstamp ? tstamp : "Invalid");
+	}
+}
+
+static const struct {
+	const char *name;
+	kernel_fn fn;
+	int prints;
+} kernels[] = {
+	{ "check_use, fresh x4096", k_check_use_fresh, 0 },
+	{ "check_use, shared packet", k_check_use_shared, 0 },
+	{ "unreferenced sweep, 16MiB", k_sweep, 0 },
+	{ "print_hst_resp_data", k_print_hst, 1 },
+	{ "print_ai_resp_data", k_print_ai, 1 },
+	{ "IPv4 address formatting", k_addr4, 1 },
+	{ "IPv6 address formatting", k_addr6, 1 },
+	{ "timestamp formatting", k_timestamp, 1 }
+};
+
+/* Records typical of a cache of host names: a handful of aliases and
+   addresses.
+ */
+static int
+build_inputs (struct bench_input *in) {
+	static const char *const aliases[] = {
+		"www.example.com", "web.example.com", "static.example.com"
+	};
+	static const uint8_t hst_addrs[] = {
+		192, 0, 2, 1,  192, 0, 2, 2,  192, 0, 2, 3,  192, 0, 2, 4
+	};
+	static const uint8_t ai_families[] = { AF_INET, AF_INET6, AF_INET };
+	uint8_t ai_addrs[4 + 16 + 4] = {
+		192, 0, 2, 10,
+		0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x10,
+		192, 0, 2, 11
+	};
+
+	if (builder_init (&in->b, DEFAULT_SUGGESTED_MODULE) != 0)
+		return -1;
+
+	struct builder_hst hst = {
+		.type = GETHOSTBYNAME,
+		.key = "frontend.example.com",
+		.keylen = sizeof ("frontend.example.com"),
+		.name = "frontend.example.com",
+		.aliases = aliases,
+		.naliases = 3,
+		.addrs = hst_addrs,
+		.naddrs = 4,
+		.addrlen = 4,
+		.ttl = 600
+	};
+	struct builder_ai ai = {
+		.key = "api.example.com",
+		.canon = "api.example.com",
+		.addrs = ai_addrs,
+		.families = ai_families,
+		.naddrs = 3,
+		.ttl = 600
+	};
+
+	/* Offsets are stable across the builder growing its buffer. */
+	ref_t hst_off = in->b.first_free;
+	if (builder_add_hst (&in->b, &hst) != 0)
+		return -1;
+	ref_t ai_off = in->b.first_free;
+	if (builder_add_ai (&in->b, &ai) != 0)
+		return -1;
+	in->hst = (struct datahead *) (in->b.data + hst_off);
+	in->ai = (struct datahead *) (in->b.data + ai_off);
+
+	in->usemap = calloc (in->b.first_free, 1);
+	in->fresh_map = calloc (CHECK_USE_SLOTS, sizeof (struct hashentry));
+	in->sweep_map = calloc (SWEEP_BYTES, 1);
+	if (in->usemap == NULL || in->fresh_map == NULL || in->sweep_map == NULL)
+		return -1;
+	/* The shared packet kernel needs the packet marked once. */
+	check_use (in->b.data, in->b.first_free, in->usemap,
+			   use_data | use_first, hst_off, in->hst->allocsize);
+	/* A map of live hash entries: no unreferenced data, and no pages
+	   left to the zero page.
+	 */
+	memset (in->sweep_map, use_he, SWEEP_BYTES);
+
+	memcpy (in->addr4, ai_addrs, sizeof (in->addr4));
+	memcpy (in->addr6, ai_addrs + 4, sizeof (in->addr6));
+	in->timeout = in->b.now;
+	return 0;
+}
+
+static void
+free_inputs (struct bench_input *in) {
+	free (in->usemap);
+	free (in->fresh_map);
+	free (in->sweep_map);
+	builder_free (&in->b);
+}
+
+static int
+compare_ull (const void *a, const void *b) {
+	unsigned long long x = *(const unsigned long long *) a;
+	unsigned long long y = *(const unsigned long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Run kernel I: warm up while finding how many operations make a
+   repetition, then time the repetitions.  Stores nanoseconds per
+   operation.
+ */
+static void
+run_kernel (struct bench_input *in, size_t i, double *median, double *best,
+			unsigned long *ops) {
+	unsigned long long rep_ns[MICROBENCH_REPS];
+	unsigned long n = 1;
+	unsigned long long spent = 0, t;
+
+	while (spent < MICROBENCH_WARMUP_NS) {
+		t = now_ns ();
+		kernels[i].fn (in, n);
+		t = now_ns () - t;
+		spent += t;
+		if (t < MICROBENCH_WARMUP_NS / 8)
+			n *= 2;
+	}
+	n = MAX (1, (unsigned long) ((double) n * MICROBENCH_REP_NS / MAX (t, 1)));
+
+	for (int rep = 0; rep < MICROBENCH_REPS; rep++) {
+		t = now_ns ();
+		kernels[i].fn (in, n);
+		rep_ns[rep] = now_ns () - t;
+	}
+
+	qsort (rep_ns, MICROBENCH_REPS, sizeof (*rep_ns), compare_ull);
+	*median = (double) rep_ns[MICROBENCH_REPS / 2] / n;
+	*best = (double) rep_ns[0] / n;
+	*ops = n;
+}
+
+int
+microbench (void) {
+	struct bench_input in;
+
+	memset (&in, 0, sizeof (in));
+	if (build_inputs (&in) != 0) {
+		fprintf (stderr, "Memory allocation failure\n");
+		free_inputs (&in);
+		return -1;
+	}
+
+	int null_fd = open ("/dev/null", O_WRONLY);
+	int stdout_fd = dup (STDOUT_FILENO);
+	if (null_fd == -1 || stdout_fd == -1) {
+		fprintf (stderr, "Cannot redirect standard output\n");
+		free_inputs (&in);
+		return -1;
+	}
+
+	printf ("%-28s %12s %12s %12s\n", "Kernel", "ns/op", "best ns/op",
+			"ops/rep");
+	for (size_t i = 0; i < sizeof (kernels) / sizeof (*kernels); i++) {
+		double median, best;
+		unsigned long ops;
+
+		fflush (stdout);
+		if (kernels[i].prints)
+			dup2 (null_fd, STDOUT_FILENO);
+		run_kernel (&in, i, &median, &best, &ops);
+		fflush (stdout);
+		dup2 (stdout_fd, STDOUT_FILENO);
+
+		printf ("%-28s %12.1f %12.1f %12lu\n", kernels[i].name, median, best,
+				ops);
+	}
+
+	close (null_fd);
+	close (stdout_fd);
+	free_inputs (&in);
+	return 0;
+}
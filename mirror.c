@@ -0,0 +1,459 @@
+/* Incremental replica of a live database.
+
+   The replica is a pair of files DEST.0 and DEST.1 and a symbolic link
+   DEST to the one holding the last good copy.  A sync copies the live
+   part of the database, the header, bucket array and data up to
+   first_free, into a new file in place of the other one, leaving the
+   rest of it zero, then verifies it, renames it over the other one and
+   turns the link to it.  Readers of DEST thus always see a complete
+   replica that passed verification, and a file once opened never
+   changes under them, however long they keep it.
+
+   The new file starts as a copy of the one it replaces, made with
+   copy_file_range () so that the kernel copies or shares the extents,
+   and each file keeps a hash per chunk of what it holds, so a sync only
+   writes the chunks that changed since the file was last written, two
+   syncs earlier.  Every chunk is copied to a buffer before it is hashed
+   and written, so the hashes describe what is on disk even while nscd
+   writes to the database.  A copy is only used if the GC cycle was even
+   and the same before and after it, and if it verifies; otherwise it is
+   retried, and the link keeps pointing to the previous replica.
+
+   Syncs are driven by the watch loop of watch.c, so that a directory
+   of databases is mirrored from one process that sleeps while nothing
+   changes.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nscd_dump.h"
+
+#define MIRROR_CHUNK		(64 * 1024)
+#define MIRROR_RETRIES		5
+#define MIRROR_RETRY_MS		20
+#define MIRROR_HASH_SEED	0x6e7363645f6d6972ULL
+
+/* One of the two files of the replica. */
+struct replica {
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 8];		/* The new file while it is written. */
+	int fd;						/* Of the new file, if there is one. */
+	size_t size;
+	uint64_t *hashes;			/* Of the first NHASHES chunks. */
+	size_t nhashes, capacity;
+};
+
+struct mirror {
+	char source[PATH_MAX];
+	char dest[PATH_MAX];
+	struct db_file db;
+	int opened;
+	struct replica files[2];
+	int active;					/* The one DEST links to, -1 if none. */
+	uint8_t *buf;
+	unsigned long syncs;
+};
+
+static void
+sleep_ms (unsigned ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+	while (nanosleep (&ts, &ts) != 0 && errno == EINTR)
+		;
+}
+
+/* Size of the live part of the database DB. */
+static size_t
+live_size (const struct db_file *db) {
+	struct database_pers_head *head = db->mem;
+	size_t live = db_data (head) - (char *) db->mem
+		+ (size_t) MAX (head->first_free, 0);
+
+	return MIN (live, (size_t) db->st.st_size);
+}
+
+/* Bring replica R up to date with the live part of the database.
+   Returns the number of chunks written, -1 on error.
+ */
+static long
+copy_chunks (struct mirror *m, struct replica *r) {
+	size_t size = m->db.st.st_size;
+	size_t live = live_size (&m->db);
+	size_t nchunks = (size + MIRROR_CHUNK - 1) / MIRROR_CHUNK;
+	long written = 0;
+
+	if (nchunks > r->capacity) {
+		uint64_t *hashes = realloc (r->hashes, nchunks * sizeof (*hashes));
+		if (hashes == NULL) {
+			fprintf (stderr, "Memory allocation failure\n");
+			return -1;
+		}
+		r->hashes = hashes;
+		r->capacity = nchunks;
+	}
+
+	for (size_t i = 0; i < nchunks; i++) {
+		size_t start = i * MIRROR_CHUNK;
+		size_t len = MIN ((size_t) MIRROR_CHUNK, size - start);
+		size_t copy = start < live ? MIN (len, live - start) : 0;
+
+		memcpy (m->buf, (char *) m->db.mem + start, copy);
+		memset (m->buf + copy, 0, len - copy);
+		uint64_t hash = xxh64 (m->buf, len, MIRROR_HASH_SEED);
+
+		if (i < r->nhashes && r->hashes[i] == hash && start + len <= r->size)
+			continue;
+		if (pwrite (r->fd, m->buf, len, start) != (ssize_t) len) {
+			fprintf (stderr, "Cannot write \"%s\": %s\n",
+					 r->path, strerror (errno));
+			r->nhashes = MIN (r->nhashes, i);
+			return -1;
+		}
+		r->hashes[i] = hash;
+		written++;
+		if (i >= r->nhashes)
+			r->nhashes = i + 1;
+	}
+
+	if (r->size != size && ftruncate (r->fd, size) != 0) {
+		fprintf (stderr, "Cannot write \"%s\": %s\n",
+				 r->path, strerror (errno));
+		return -1;
+	}
+	r->size = size;
+	r->nhashes = nchunks;
+	return written;
+}
+
+/* Start a new file for replica R as a copy of what it holds. */
+static int
+replica_begin (struct replica *r) {
+	snprintf (r->tmp, sizeof (r->tmp), "%s.XXXXXX", r->path);
+	int fd = mkstemp (r->tmp);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n", r->tmp, strerror (errno));
+		return -1;
+	}
+	fchmod (fd, 0644);
+
+	loff_t in = 0, out = 0;
+	while ((size_t) in < r->size) {
+		ssize_t n = copy_file_range (r->fd, &in, fd, &out, r->size - in, 0);
+		if (n <= 0) {
+			/* Write it all. */
+			r->size = 0;
+			r->nhashes = 0;
+			break;
+		}
+	}
+
+	close (r->fd);
+	r->fd = fd;
+	return 0;
+}
+
+/* Whether the new file of replica R is a database that passes
+   verification.
+ */
+static int
+replica_valid (struct replica *r) {
+	struct db_file copy;
+
+	if (fdatasync (r->fd) != 0 || db_open (&copy, r->tmp) != 0)
+		return 0;
+
+	const char *msg = verify_persistent_db (copy.mem, &copy.head);
+	if (msg != NULL)
+		fprintf (stderr, "Copy in \"%s\" not used: %s\n", r->path, msg);
+	db_close (&copy);
+	return msg == NULL;
+}
+
+/* Point DEST to replica INDEX. */
+static int
+switch_link (struct mirror *m, int index) {
+	char tmp[PATH_MAX + 16], target[PATH_MAX + 16];
+	const char *base = strrchr (m->dest, '/');
+
+	snprintf (target, sizeof (target), "%s.%d", base ? base + 1 : m->dest,
+			  index);
+	snprintf (tmp, sizeof (tmp), "%s.link", m->dest);
+	unlink (tmp);
+	if (symlink (target, tmp) != 0 || rename (tmp, m->dest) != 0) {
+		fprintf (stderr, "Cannot link \"%s\": %s\n", m->dest, strerror (errno));
+		unlink (tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/* Open the database, or reopen it if it was replaced or outgrew its
+   mapping.
+ */
+static int
+refresh_source (struct mirror *m) {
+	struct db_file *db = &m->db;
+	struct stat64 st;
+
+	if (!m->opened) {
+		m->opened = db_open (db, m->source) == 0;
+		return m->opened ? 0 : -1;
+	}
+
+	if (stat64 (db->name, &st) != 0) {
+		fprintf (stderr, "Cannot access database file \"%s\": %s\n",
+				 db->name, strerror (errno));
+		return -1;
+	}
+	/* Truncated in place, not by nscd: the mapping would fault. */
+	if ((size_t) st.st_size < sizeof (struct database_pers_head)) {
+		fprintf (stderr, "Database file \"%s\" truncated\n", db->name);
+		return -1;
+	}
+	if (   st.st_dev == db->st.st_dev && st.st_ino == db->st.st_ino
+		&& (size_t) st.st_size <= db->mapsize) {
+		db->st = st;
+		return 0;
+	}
+
+	struct db_file fresh;
+	if (db_open (&fresh, db->name) != 0)
+		return -1;
+	db_close (db);
+	*db = fresh;
+	return 0;
+}
+
+/* Update the replica once.  Returns 1 if the database did not change
+   since the last sync, 0 if DEST was switched to a new copy, -1 if no
+   consistent copy could be made this time.
+ */
+static int
+mirror_sync (struct mirror *m) {
+	struct database_pers_head *head;
+
+	if (refresh_source (m) != 0)
+		return -1;
+	head = m->db.mem;
+
+	int standby = m->active == 0;
+	struct replica *r = &m->files[standby];
+	if (replica_begin (r) != 0)
+		return -1;
+	for (int attempt = 0; attempt < MIRROR_RETRIES; attempt++) {
+		if (attempt > 0)
+			sleep_ms (MIRROR_RETRY_MS);
+
+		int32_t gc_cycle = head->gc_cycle;
+		if (gc_cycle & 1)
+			continue;
+		long written = copy_chunks (m, r);
+		if (written < 0)
+			break;
+		if (head->gc_cycle != gc_cycle)
+			continue;
+
+		/* Nothing new compared with the replica in use. */
+		struct replica *cur = m->active >= 0 ? &m->files[m->active] : NULL;
+		if (   cur != NULL && cur->size == r->size
+			&& cur->nhashes == r->nhashes
+			&& memcmp (cur->hashes, r->hashes,
+					   r->nhashes * sizeof (*r->hashes)) == 0) {
+			unlink (r->tmp);
+			return 1;
+		}
+
+		if (!replica_valid (r))
+			continue;
+		if (rename (r->tmp, r->path) != 0) {
+			fprintf (stderr, "Cannot write \"%s\": %s\n",
+					 r->path, strerror (errno));
+			break;
+		}
+		if (switch_link (m, standby) != 0)
+			return -1;
+		m->active = standby;
+		m->syncs++;
+		printf ("Replica \"%s\" of \"%s\": %ld of %zu chunks written,"
+				" GC cycle %d, %d entries\n", r->path, m->db.name, written,
+				r->nhashes, gc_cycle, head->nentries);
+		fflush (stdout);
+		return 0;
+	}
+
+	/* The hashes still describe the new file, which the next sync
+	   starts from.
+	 */
+	unlink (r->tmp);
+	fprintf (stderr, "No consistent copy of \"%s\" this time\n",
+			 m->db.name);
+	return -1;
+}
+
+/* Which of the two files DEST links to, -1 if none. */
+static int
+current_link (const char *dest) {
+	char target[PATH_MAX];
+	ssize_t n = readlink (dest, target, sizeof (target) - 1);
+
+	if (n < 2 || target[n - 2] != '.')
+		return -1;
+	return target[n - 1] == '0' ? 0 : target[n - 1] == '1' ? 1 : -1;
+}
+
+static int
+mirror_init (struct mirror *m, const char *source, const char *dest) {
+	struct stat st;
+
+	memset (m, 0, sizeof (*m));
+	snprintf (m->source, sizeof (m->source), "%s", source);
+	snprintf (m->dest, sizeof (m->dest), "%s", dest);
+	m->files[0].fd = m->files[1].fd = -1;
+	if (lstat (dest, &st) == 0 && !S_ISLNK (st.st_mode)) {
+		fprintf (stderr, "\"%s\" exists and is not a link to a replica\n",
+				 dest);
+		return -1;
+	}
+	m->active = current_link (dest);
+
+	m->buf = malloc (MIRROR_CHUNK);
+	if (m->buf == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	/* What the files hold is unknown: the first sync to each copies
+	   all of it.
+	 */
+	for (int i = 0; i < 2; i++) {
+		struct replica *r = &m->files[i];
+
+		snprintf (r->path, sizeof (r->path), "%s.%d", dest, i);
+		r->fd = open (r->path, O_RDWR | O_CREAT, 0644);
+		if (r->fd == -1) {
+			fprintf (stderr, "Cannot create \"%s\": %s\n",
+					 r->path, strerror (errno));
+			return -1;
+		}
+		struct stat64 rst;
+		r->size = fstat64 (r->fd, &rst) == 0 ? rst.st_size : 0;
+	}
+	return 0;
+}
+
+static void
+mirror_free (struct mirror *m) {
+	for (int i = 0; i < 2; i++) {
+		if (m->files[i].fd != -1)
+			close (m->files[i].fd);
+		free (m->files[i].hashes);
+	}
+	free (m->buf);
+	if (m->opened)
+		db_close (&m->db);
+}
+
+static int
+sync_changed (unsigned index, enum watch_reason reason, void *arg) {
+	struct mirror *mirrors = arg;
+
+	mirror_sync (&mirrors[index]);
+	return 0;
+}
+
+static int
+is_database (const struct dirent *d) {
+	return d->d_name[0] != '.'
+		&& (d->d_type == DT_REG || d->d_type == DT_UNKNOWN);
+}
+
+/* Keep replicas of the database SOURCE in DEST, or of every database
+   in the directory SOURCE in the directory DEST.  They are synced when
+   the watch loop reports a possible change, for COUNT rounds or forever
+   if 0, checking for changes made through mappings every INTERVAL_MS
+   milliseconds.
+ */
+int
+mirror_db (const char *source, const char *dest, unsigned interval_ms,
+		   unsigned count) {
+	struct dirent **names = NULL;
+	struct stat st;
+	int n = 1;
+
+	if (stat (source, &st) == 0 && S_ISDIR (st.st_mode)) {
+		n = scandir (source, &names, is_database, alphasort);
+		if (n < 0) {
+			fprintf (stderr, "Cannot read \"%s\": %s\n",
+					 source, strerror (errno));
+			return -1;
+		}
+		if (mkdir (dest, 0755) != 0 && errno != EEXIST) {
+			fprintf (stderr, "Cannot create \"%s\": %s\n",
+					 dest, strerror (errno));
+			n = 0;
+		}
+	}
+
+	struct mirror *mirrors = calloc (n + 1, sizeof (*mirrors));
+	const char **paths = calloc (n + 1, sizeof (*paths));
+	int nmirrors = 0, rc = -1;
+	for (int i = 0; mirrors != NULL && paths != NULL && i < n; i++) {
+		struct mirror *m = &mirrors[nmirrors];
+		char src[PATH_MAX], dst[PATH_MAX];
+
+		if (names == NULL)
+			rc = mirror_init (m, source, dest);
+		else {
+			snprintf (src, sizeof (src), "%s/%s", source, names[i]->d_name);
+			snprintf (dst, sizeof (dst), "%s/%s", dest, names[i]->d_name);
+			/* Only the files that are databases now. */
+			struct db_file db;
+			if (db_open (&db, src) != 0)
+				continue;
+			db_close (&db);
+			rc = mirror_init (m, src, dst);
+		}
+		if (rc != 0) {
+			mirror_free (m);
+			break;
+		}
+		paths[nmirrors++] = m->source;
+	}
+
+	if (mirrors == NULL || paths == NULL)
+		fprintf (stderr, "Memory allocation failure\n");
+	else if (rc == 0 && nmirrors == 0) {
+		fprintf (stderr, "No databases in \"%s\"\n", source);
+		rc = -1;
+	} else if (rc == 0)
+		rc = watch_files (paths, nmirrors, interval_ms, count, sync_changed,
+						  mirrors);
+
+	for (int i = 0; i < nmirrors; i++)
+		mirror_free (&mirrors[i]);
+	for (int i = 0; names != NULL && i < n; i++)
+		free (names[i]);
+	free (names);
+	free (mirrors);
+	free (paths);
+	return rc;
+}
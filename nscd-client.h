@@ -31,6 +31,9 @@
 #include "nscd-types.h"
 //#include <sys/uio.h>
 
+/* Version number of the daemon interface.  */
+#define NSCD_VERSION 2
+
 /* Maximum allowed length for the key.  */
 #define MAXKEYLEN 1024
 
@@ -29,9 +29,11 @@
 #include <error.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <resolv.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <sys/param.h>
@@ -39,7 +41,7 @@
 #include <sys/un.h>
 #include <arpa/inet.h>
 
-#include "nscd.h"
+#include "nscd_dump.h"
 
 const char *af2str[AF_MAX] = {
 	[AF_INET] = "IPv4",
@@ -66,28 +68,6 @@ const char *const serv2str[LASTREQ] = {
 	[INITGROUPS] = "INITGROUPS"
 };
 
-enum usekey {
-    use_not = 0,
-    /* The following three are not really used, they are symbolic constants.  */
-    use_first = 16,
-    use_begin = 32,
-    use_end = 64,
-
-    use_he = 1,
-    use_he_begin = use_he | use_begin,
-    use_he_end = use_he | use_end,
-#if SEPARATE_KEY
-    use_key = 2,
-    use_key_begin = use_key | use_begin,
-    use_key_end = use_key | use_end,
-    use_key_first = use_key_begin | use_first,
-#endif
-    use_data = 3,
-    use_data_begin = use_data | use_begin,
-    use_data_end = use_data | use_end,
-    use_data_first = use_data_begin | use_first
-};
-
 const char *
 check_use (const char *data, nscd_ssize_t first_free, uint8_t *usemap,
 		   enum usekey use, ref_t start, size_t len) {
@@ -97,6 +77,10 @@ check_use (const char *data, nscd_ssize_t first_free, uint8_t *usemap,
 		|| (start & BLOCK_ALIGN_M1))
 		return "Hash entry isn't properly aligned";
 
+	/* Sampling runs keep no map; only the bounds can be checked. */
+	if (usemap == NULL)
+		return NULL;
+
 	if (usemap[start] == use_not) {
 		/* Add the start marker. */
 		usemap[start] = use | use_begin;
@@ -132,16 +116,58 @@ check_use (const char *data, nscd_ssize_t first_free, uint8_t *usemap,
 	return NULL;
 }
 
-/* Verify data in persistent database.  */
+struct sweep_arg {
+	const uint8_t *usemap;
+	size_t len;
+	volatile int found;
+};
+
+#define SWEEP_SLICE 65536
+
+/* Worker for sweep_unreferenced (): scans slices [BEGIN, END). */
+static void
+sweep_range (size_t begin, size_t end, unsigned index, void *p) {
+	struct sweep_arg *arg = p;
+
+	/* Going slice by slice lets gentle mode pace the sweep and stops
+	   this thread early on a hit in another one.
+	 */
+	for (size_t slice = begin; slice < end && !arg->found; slice++) {
+		const uint8_t *start = arg->usemap + slice * SWEEP_SLICE;
+		size_t len = MIN (arg->len - slice * SWEEP_SLICE, SWEEP_SLICE);
+
+#if SEPARATE_KEY
+		if (memchr (start, use_key_begin, len) != NULL)
+			arg->found = 1;
+#endif
+		if (memchr (start, use_data_begin, len) != NULL)
+			arg->found = 1;
+
+		gentle_charge (len, 0);
+	}
+}
+
+/* See if any data or key in USEMAP is left without a reference from a
+   he->first == true hashentry, scanning with THREADS threads.
+ */
+int
+sweep_unreferenced (const uint8_t *usemap, size_t len, unsigned threads) {
+	struct sweep_arg arg = { .usemap = usemap, .len = len, .found = 0 };
+
+	parallel_for (threads, (len + SWEEP_SLICE - 1) / SWEEP_SLICE,
+				  sweep_range, &arg);
+	return arg.found;
+}
+
+/* Sanity checks of the database header alone, HEAD being the mapped
+   one and READHEAD the one read () before mapping.
+ */
 const char *
-verify_persistent_db (void *mem, struct database_pers_head *readhead)
+verify_db_header (struct database_pers_head *head,
+				  struct database_pers_head *readhead)
 {
-	const char *msg;
 	time_t now = time (NULL);
 
-	struct database_pers_head *head = mem;
-	struct database_pers_head head_copy = *head;
-
 	/* Check that the header that was read matches the head in the database. */
 	if (memcmp (head, readhead, sizeof (*head)) != 0)
 		return "Header read differs from databas header";
@@ -185,25 +211,57 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 
 	if (head->maxnsearched < 0)
 		return "Negative number of maximum search entries";
-    
-	uint8_t *usemap = calloc (head->first_free, 1);
-	if (usemap == NULL)
+
+	return NULL;
+}
+
+/* Verify data in persistent database.  */
+const char *
+verify_persistent_db (void *mem, struct database_pers_head *readhead)
+{
+	return verify_persistent_db_plan (mem, readhead, &default_plan);
+}
+
+/* Same, with the resources used for it given by PLAN. */
+const char *
+verify_persistent_db_plan (void *mem, struct database_pers_head *readhead,
+						   const struct exec_plan *plan)
+{
+	const char *msg;
+
+	struct database_pers_head *head = mem;
+	struct database_pers_head head_copy = *head;
+
+	msg = verify_db_header (head, readhead);
+	if (msg != NULL)
+		return msg;
+
+	if (plan->prefault && prefault (mem, PREFAULT_THREADS) < 0)
+		return "Memory allocation failure";
+
+	uint8_t *usemap = usemap_alloc (plan, head->first_free);
+	if (usemap == NULL && plan->usemap != USEMAP_NONE)
 		return "Memory allocation failure";
 
 	const char *data = (char *) &head->array[roundup (head->module,
 					   ALIGN / sizeof (ref_t))];
 
 	nscd_ssize_t he_cnt = 0;
-	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt) {
+	size_t bytes = 0;
+	progress_start ("verify", head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module;
+		 cnt += plan->sample_stride) {
 		ref_t trail = head->array[cnt];
 		ref_t work = trail;
 		int tick = 0;
 
+		progress_tick (cnt, he_cnt, bytes);
+
 		while (work != ENDREF) {
 			msg = check_use (data, head->first_free, usemap, use_he, work,
 							sizeof (struct hashentry));
 			if (msg != NULL) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return msg;
 			}
 
@@ -211,10 +269,11 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 			struct hashentry *here = (struct hashentry *) (data + work);
 
 			++he_cnt;
+			progress_tick (cnt, he_cnt, bytes);
 
 			/* Make sure the record is for this type of service. */
 			if (here->type >= LASTREQ) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Record type is out of bounds";
 			}
 
@@ -223,39 +282,39 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 				|| here->type == GETHOSTBYADDR
 				|| here->type == GETHOSTBYADDRv6
 				|| here->type == GETAI)) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid record type";
 			}
 
 			/* Validate boolean field value.  */
 			if (here->first != false && here->first != true) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid boolean field";
 			}
 
 			if (here->len < 0) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Negative record length";
 			}
 
 			/* Now the data. */
 			if (here->packet < 0) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Negative packet offset";
 			}
 
 			if (here->packet > head->first_free) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Packet offset beyond first free byte";
 			}
 
 			if (here->packet + sizeof (struct datahead) > head->first_free) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Packet data offset beyond first free byte";
 			}
 
 			if (here->first != false && here->first != true) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid \"first\" field contents";
 			}
 
@@ -265,24 +324,24 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 			   				use_data | (here->first ? use_first : 0),
 			   				here->packet, dh->allocsize);
 			if (msg != NULL) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return msg;
 			}
 
 			if (dh->allocsize < sizeof (struct datahead)) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Short data header size";
 			}
 			if (dh->recsize > dh->allocsize) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Data size is above allocated one";
 			}
 			if (dh->notfound != false && dh->notfound != true) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid \"notfound\" field contents";
 			}
 			if (dh->usable != false && dh->usable != true) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid \"usable\" field contents";
 			}
 
@@ -297,11 +356,11 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 				   				 use_key | (here->first ? use_first : 0),
 				   				 here->key, here->len);
 				if (msg != NULL) {
-					free (usemap);
+					usemap_free (plan, usemap, head->first_free);
 					return msg;
 				}
 #endif
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Invalid hash entry";
 			}
 
@@ -309,7 +368,7 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 
 			/* A circular list, this must not happen.  */
 			if (work == trail) {
-				free (usemap);
+				usemap_free (plan, usemap, head->first_free);
 				return "Circullar list detected";
 			}
 			
@@ -317,37 +376,35 @@ verify_persistent_db (void *mem, struct database_pers_head *readhead)
 				trail = ((struct hashentry *) (data + trail))->next;
 			
 			tick = 1 - tick;
+
+			bytes += sizeof (struct hashentry) + dh->allocsize;
+			gentle_charge (sizeof (struct hashentry) + dh->allocsize, 1);
 		}
 	}
+	progress_finish (he_cnt, bytes);
 
-	if (he_cnt != head->nentries) {
-		free (usemap);
+	/* A sample can't be checked for completeness. */
+	if (plan->sample_stride == 1 && he_cnt != head->nentries) {
+		usemap_free (plan, usemap, head->first_free);
 		return "Actual number of records doesn't match with one in header";
 	}
 
 	/* See if all data and keys had at least one reference from
 	   he->first == true hashentry.
 	 */
-	for (ref_t idx = 0; idx < head->first_free; ++idx) {
-#if SEPARATE_KEY
-		if (usemap[idx] == use_key_begin) {
-			free (usemap);
-			return "Unreferenced data and/or keys found";
-		}
-#endif
-		if (usemap[idx] == use_data_begin) {
-			free (usemap);
-			return "Unreferenced data and/or keys found";
-		}
+	if (   usemap != NULL
+		&& sweep_unreferenced (usemap, head->first_free, plan->threads)) {
+		usemap_free (plan, usemap, head->first_free);
+		return "Unreferenced data and/or keys found";
 	}
 
 	/* Finally, make sure the database hasn't changed since the first test. */
 	if (memcmp (mem, &head_copy, sizeof (*head)) != 0) {
-		free (usemap);
+		usemap_free (plan, usemap, head->first_free);
 		return "Database header changed in transit";
 	}
 
-	free (usemap);
+	usemap_free (plan, usemap, head->first_free);
 	return NULL;
 }
 
@@ -408,6 +465,11 @@ print_hashentry_datahead (struct hashentry *he, struct datahead *dh,
 	}
 }
 
+static const char *
+af_name (int af) {
+	return af >= 0 && af < AF_MAX && af2str[af] ? af2str[af] : "Unknown";
+}
+
 void
 print_ip_addr (int af_family, void *addr) {
 	char ip_addr_buf[MAX(INET_ADDRSTRLEN,INET6_ADDRSTRLEN)];
@@ -455,8 +517,7 @@ print_hst_resp_data (request_type type, hst_response_header *hst_resp,
 		for (int i = 0 ; i < hst_resp->h_addr_list_cnt; i++) {
 			printf ("%s ", i > 0 ? "," : "");
 
-			printf ("(%s) ", af2str[hst_resp->h_addrtype]
-						? af2str[hst_resp->h_addrtype] : "Unknown");
+			printf ("(%s) ", af_name (hst_resp->h_addrtype));
 			print_ip_addr (    type == GETHOSTBYADDR
 							|| type == GETHOSTBYNAME
 								? AF_INET : AF_INET6, addr);
@@ -510,7 +571,7 @@ print_ai_resp_data (ai_response_header *ai_resp,
 	printf ("  Addresses: ");
 	for (int i = 0 ; i < ai_resp->naddrs; i++) {
 		printf ("%s ", i > 0 ? "," : "");
-		printf ("(%s) ", af2str[families[i]] ? af2str[families[i]] : "Unknown");
+		printf ("(%s) ", af_name (families[i]));
 		print_ip_addr (families[i], addrs);
 		int addr_sz = families[i] == AF_INET6
 			? sizeof (struct in6_addr) : sizeof (struct in_addr);
@@ -530,8 +591,11 @@ print_ai_resp_data (ai_response_header *ai_resp,
 	return consumed;
 }
 
+/* Print the records of every STRIDE. bucket, the buckets a plan with
+   that sample stride verified: the others may hold anything.
+ */
 void
-print_entries (void *mem, int verbose) {
+print_entries (void *mem, int verbose, nscd_ssize_t stride) {
 
 	struct database_pers_head *head = mem;
 
@@ -539,30 +603,45 @@ print_entries (void *mem, int verbose) {
 					   ALIGN / sizeof (ref_t))];
 
 	nscd_ssize_t he_cnt = 0;
-	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt) {
+	size_t bytes = 0;
+	progress_start ("dump", head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module; cnt += stride) {
 		ref_t work = head->array[cnt];
 
+		progress_tick (cnt, he_cnt, bytes);
+
 		while (work != ENDREF) {
 			struct hashentry *here = (struct hashentry *) (data + work);
 			struct datahead *dh = (struct datahead *) (data + here->packet);
 			const char *key = data + here->key;
 
 			++he_cnt;
+			progress_tick (cnt, he_cnt, bytes);
 
 			print_hashentry_datahead (here, dh, key, he_cnt, verbose);
 
+			/* No verifier looks into the records, and a sampling one
+			   skips whole buckets where damage may show: only records
+			   whose counts fit in them are printed.
+			 */
+			struct hst_view hst;
+			struct ai_view ai;
 			ref_t consumed = 0;
-			if (   here->type == GETHOSTBYNAME
-				|| here->type == GETHOSTBYNAMEv6
-				|| here->type == GETHOSTBYADDR
-				|| here->type == GETHOSTBYADDRv6) {
+			if (   here->type == GETAI
+				? decode_ai (dh, &ai) != 0 : decode_hst (dh, &hst) != 0) {
+				printf ("  Malformed record\n");
+				consumed = dh->recsize;
+			} else if (   here->type == GETHOSTBYNAME
+					   || here->type == GETHOSTBYNAMEv6
+					   || here->type == GETHOSTBYADDR
+					   || here->type == GETHOSTBYADDRv6) {
 				hst_response_header hst_resp = dh->data[0].hstdata;
 				char *resp_data = (char *) (&dh->data[0].hstdata + 1);
 				consumed = print_hst_resp_data (here->type, &hst_resp,
 												resp_data, verbose);
 			}
 
-			if (here->type == GETAI) {
+			else if (here->type == GETAI) {
 				ai_response_header ai_resp = dh->data[0].aidata;
 				char *resp_data = (char *) (&dh->data[0].aidata + 1);
 				consumed = print_ai_resp_data (&ai_resp, resp_data, verbose);
@@ -576,88 +655,77 @@ print_entries (void *mem, int verbose) {
 
 			printf ("\n");
 			work = here->next;
+
+			bytes += sizeof (struct hashentry) + dh->allocsize;
+			gentle_charge (sizeof (struct hashentry) + dh->allocsize, 1);
 		}
 	}
+	progress_finish (he_cnt, bytes);
 }
 
+/* Open and map database file FILENAME into DB, checking that its
+   header is sane enough to walk it.  Errors are reported on stderr.
+ */
 int
-main (int argc, char *argv[])
+db_open (struct db_file *db, const char *filename)
 {
-	if (!(argc == 2 || argc == 3)) {
-		printf ("Usage: nscd_dump [-v] <NSCD persistent database file>\n");
-		return 1;
-	}
+	struct database_pers_head *head = &db->head;
 
-	const char *db_filename;
-	int verbose = 0;
-
-	for (argv++; *argv; argv++) {
-		if (!strcmp (*argv, "-v")) {
-			verbose = 1;
-			continue;
-		}
-
-		db_filename = *argv;
-		continue;
-	}
+	db->name = filename;
 
  	/* Try to open the appropriate file on disk. */
-	int fd = open (db_filename, O_RDONLY);
+	int fd = open (filename, O_RDONLY);
 	if (fd == -1) {
     	fprintf (stderr, "Cannot access database file \"%s\": %s\n",
-				 db_filename, strerror (errno));
-    	return 1;
+				 filename, strerror (errno));
+    	return -1;
 	}
 
-	struct stat64 st;
-	void *mem;
-	size_t total;
-	struct database_pers_head head;
-
-	ssize_t n = read (fd, &head, sizeof (head));
-	if (n != sizeof (head)) {
+	ssize_t n = read (fd, head, sizeof (*head));
+	if (n != sizeof (*head)) {
 		fprintf (stderr, "Short read on database file \"%s\"\n",
-				 db_filename);
+				 filename);
 		close (fd);
-		return 1;
+		return -1;
 	}
 
-	if (fstat64 (fd, &st) != 0) {
+	if (fstat64 (fd, &db->st) != 0) {
 		fprintf (stderr, "fstat() error on database file \"%s\": %s\n",
-				 db_filename, strerror (errno));
+				 filename, strerror (errno));
 		close (fd);
-		return 1;
+		return -1;
 	}
 
 	/* The file has been created, but the head has not
 	   been initialized yet.  */
-	if (head.module == 0 && head.data_size == 0) {
+	if (head->module == 0 && head->data_size == 0) {
 		fprintf (stderr, "Invalid persistent database file \"%s\": "
 				"uninitialized header\n",
-				db_filename);
+				filename);
 		close (fd);
-		return 1;
+		return -1;
 	}
 	
-	if (head.header_size != (int) sizeof (head)) {
+	if (head->header_size != (int) sizeof (*head)) {
 		fprintf (stderr, "Invalid persistent database file \"%s\": "
 				"header size does not match\n",
-				db_filename);
+				filename);
 		close (fd);
-		return 1;
+		return -1;
 	}
 	
-	if ((total = (sizeof (head)
-			   + roundup (head.module * sizeof (ref_t),
+	size_t total;
+	if ((total = (sizeof (*head)
+			   + roundup (head->module * sizeof (ref_t),
 					  ALIGN)
-			   + head.data_size))
-		 > st.st_size
-		 || total < sizeof (head)) {
+			   + head->data_size))
+		 > db->st.st_size
+		 || total < sizeof (*head)) {
 		fprintf (stderr, "Invalid persistent database file \"%s\": "
 				"file size does not match\n",
-				db_filename);
+				filename);
 		close (fd);
-		return 1;
+		return -1;
 	}
 
 	/* Note we map with the maximum size allowed for the
@@ -665,30 +733,610 @@ main (int argc, char *argv[])
 	   actual file size.  This is OK on most OSes since
 	   extensions of the underlying file will
 	   automatically translate more pages available for
-	   memory access.
+	   memory access.  Files grown past that limit are
+	   mapped whole.
 	 */
-	if ((mem = mmap (NULL, DEFAULT_MAX_DB_SIZE,
+	db->mapsize = MAX ((size_t) DEFAULT_MAX_DB_SIZE, (size_t) db->st.st_size);
+	if ((db->mem = mmap (NULL, db->mapsize,
 					 PROT_READ,
 					 MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
 		fprintf (stderr, "mmap() error on database file \"%s\": %s\n",
-				 db_filename, strerror (errno));
+				 filename, strerror (errno));
 		close (fd);
-		return 1;
+		return -1;
 	}
 
-	const char *msg = verify_persistent_db (mem, &head);
+	db->fd = fd;
+	return 0;
+}
+
+void
+db_close (struct db_file *db)
+{
+	munmap (db->mem, db->mapsize);
+  	close (db->fd);
+}
+
+/* How the default verification and dump run. */
+struct dump_options {
+	int verbose;
+	int automatic;
+	unsigned threads;
+	const char *spill_dir;
+	int prefault;
+};
+
+/* Verify DB with the plan OPTS ask for and dump it. */
+static int
+verify_and_dump (struct db_file *db, const struct dump_options *opts) {
+	struct exec_plan plan = default_plan;
+	unsigned threads = opts->threads;
+
+	if (gentle.enabled)
+		threads = 1;
+	if (opts->automatic)
+		plan_auto (&plan, db);
+	if (threads != 0)
+		plan.threads = threads;
+	/* A map is only complete, and the sweep for unreferenced data only
+	   sound, when every bucket is walked.
+	 */
+	if (opts->spill_dir != NULL) {
+		plan.usemap = USEMAP_SPILL;
+		plan.spill_dir = opts->spill_dir;
+		plan.sample_stride = 1;
+	}
+	if (opts->prefault && !gentle.enabled)
+		plan.prefault = 1;
+	if (opts->automatic || opts->verbose)
+		plan_report (stderr, &plan, db);
+
+	const char *msg = verify_persistent_db_plan (db->mem, &db->head, &plan);
 	if (msg != NULL) {
 		fprintf (stderr, "Error validating database file \"%s\": %s\n",
-				 db_filename, msg);
-		munmap (mem, total);
-		close (fd);
+				 db->name, msg);
+		return -1;
+	}
+	if (plan.sample_stride > 1)
+		printf ("Database file \"%s\" validated on a sample of buckets,"
+				" dumping every %d. bucket\n\n", db->name,
+				plan.sample_stride);
+	else
+		printf ("Database file \"%s\" validated\n\n",	db->name);
+
+	print_db_header_stats (&db->head);
+	print_entries (db->mem, opts->verbose, plan.sample_stride);
+	gentle_report (stderr);
+	return 0;
+}
+
+static void
+usage (void) {
+	printf ("Usage: nscd_dump [options] <NSCD persistent database file>\n"
+			"       nscd_dump --anonymize [--anon-key=SECRET] <in> <out>\n"
+			"       nscd_dump --generate=KIND [--count=N] <out>\n"
+			"       nscd_dump --microbench\n"
+			"       nscd_dump --difftest [--count=N]\n"
+			"       nscd_dump --heatmap[=text|ppm] <NSCD persistent database file>\n"
+			"       nscd_dump --residency <NSCD persistent database file>\n"
+			"       nscd_dump --locality <NSCD persistent database file>\n"
+			"       nscd_dump --fingerprint[=layout] <NSCD persistent database file>\n"
+			"       nscd_dump --set-digest[=RANGES] [--threads=N] <NSCD persistent database file>\n"
+			"       nscd_dump --store=DIR <NSCD persistent database file>\n"
+			"       nscd_dump --restore=DIR <manifest> <out>\n"
+			"       nscd_dump --delta <base> <new> <out>\n"
+			"       nscd_dump --apply <base> <delta> <out>\n"
+			"       nscd_dump --history=DIR <key>\n"
+			"       nscd_dump --mirror=DEST [--interval=MS] [--count=N] <NSCD persistent database file or directory>\n"
+			"       nscd_dump --pid=PID [options]\n"
+			"       nscd_dump --hold <NSCD persistent database file>\n"
+			"       nscd_dump --strings <NSCD persistent database file>\n"
+			"       nscd_dump --reloads[=COUNT] <NSCD persistent database file>\n"
+			"       nscd_dump --storm[=SHARE] [--interval=MS] [--count=N] <NSCD persistent database file>\n"
+			"       nscd_dump --prefix=CIDR <NSCD persistent database file>\n"
+			"       nscd_dump --aggregate[=V4LEN,V6LEN] <NSCD persistent database file>\n"
+			"       nscd_dump --addr-stats <NSCD persistent database file>\n"
+			"  -v                      Verbose output\n"
+			"  --gentle[=BYTES[:RECS]] Run at idle CPU/I/O priority, pacing the\n"
+			"                          walk to BYTES touched and RECS decoded\n"
+			"                          per second (default %u:%u)\n"
+			"  --auto                  Pick memory use and threads for the\n"
+			"                          verifier from the file and the host\n"
+			"  --threads=N             Threads for the parallel stages\n"
+			"  --spill-dir=DIR         Keep the verifier map in a file in DIR\n"
+			"  --prefault              Fault the file in from several threads\n"
+			"                          before walking it\n"
+			"  --time-budget=MS        Only sample random buckets for MS\n"
+			"                          milliseconds and extrapolate statistics\n"
+			"  --progress              Report progress on stderr every second\n"
+			"                          (also done once on SIGUSR1)\n"
+			"  --anonymize             Write a copy of <in> to <out> with\n"
+			"                          keys, names and addresses replaced by\n"
+			"                          pseudonyms of the same length\n"
+			"  --anon-key=SECRET       Key pseudonyms by SECRET, so copies\n"
+			"                          made with it stay consistent\n"
+			"  --generate=KIND         Write a pathological database of KIND\n"
+			"                          (onebucket, maxkey, bigai, aliases,\n"
+			"                          fragmented) to <out>\n"
+			"  --count=N               Records to generate, databases to\n"
+			"                          compare, syncs to make or samples\n"
+			"                          to take\n"
+			"  --microbench            Time the verifier and dumper kernels\n"
+			"  --difftest              Compare the optimized verifier plans\n"
+			"                          with the reference over generated and\n"
+			"                          fuzzed databases\n"
+			"  --heatmap[=FORMAT]      Print occupancy of each page of the\n"
+			"                          data area as text or a PPM image\n"
+			"  --residency             Report which parts of the file are in\n"
+			"                          the page cache and the cold pages per\n"
+			"                          lookup\n"
+			"  --locality              Report the pages and cache lines each\n"
+			"                          lookup touches\n"
+			"  --fingerprint[=layout]  Print a hash of the live file and one\n"
+			"                          of the answers independent of layout\n"
+			"  --set-digest[=RANGES]   Print the order independent digest of\n"
+			"                          the answers, by type and by RANGES\n"
+			"                          ranges of the key hash\n"
+			"  --store=DIR             Add a snapshot to the deduplicated\n"
+			"                          store in DIR\n"
+			"  --restore=DIR           Reassemble the snapshot of <manifest>\n"
+			"                          from the store in DIR into <out>\n"
+			"  --delta                 Write the records changed from <base>\n"
+			"                          to <new> to <out>\n"
+			"  --apply                 Rebuild the snapshot of <delta> from\n"
+			"                          <base> into <out>\n"
+			"  --history=DIR           Print every state of <key> in the\n"
+			"                          snapshots in DIR, indexing each once\n"
+			"  --mirror=DEST           Keep a verified replica of the file in\n"
+			"                          DEST.0 and DEST.1, DEST linking to the\n"
+			"                          current one, copying changed chunks;\n"
+			"                          for a directory, one in DEST per file\n"
+			"  --interval=MS           Milliseconds between checks for changes\n"
+			"                          made through mappings or between\n"
+			"                          samples (1000)\n"
+			"  --pid=PID               Verify and dump the caches found in the\n"
+			"                          memory of process PID\n"
+			"  --hold                  Keep a copy of the file in memory like\n"
+			"                          nscd without persistent caches\n"
+			"  --strings               Report strings stored more than once\n"
+			"                          and what sharing them would save\n"
+			"  --reloads[=COUNT]       Report records reloaded without use,\n"
+			"                          COUNT being the reload-count of nscd\n"
+			"  --storm[=SHARE]         Sample the new records of a live file\n"
+			"                          and alert when negative ones take more\n"
+			"                          than SHARE percent of the growth (50)\n"
+			"  --prefix=CIDR           List the names resolving into CIDR\n"
+			"  --aggregate[=V4,V6]     Count addresses and names by IPv4 and\n"
+			"                          IPv6 prefix length (24,48)\n"
+			"  --addr-stats            Report the address families of names\n"
+			"                          and the numbers of addresses and\n"
+			"                          aliases per record\n",
+			GENTLE_DEFAULT_BYTE_RATE, GENTLE_DEFAULT_RECORD_RATE);
+}
+
+enum {
+	OPT_GENTLE = 256,
+	OPT_AUTO,
+	OPT_THREADS,
+	OPT_SPILL_DIR,
+	OPT_PREFAULT,
+	OPT_TIME_BUDGET,
+	OPT_PROGRESS,
+	OPT_ANONYMIZE,
+	OPT_ANON_KEY,
+	OPT_GENERATE,
+	OPT_COUNT,
+	OPT_MICROBENCH,
+	OPT_DIFFTEST,
+	OPT_HEATMAP,
+	OPT_RESIDENCY,
+	OPT_LOCALITY,
+	OPT_FINGERPRINT,
+	OPT_SET_DIGEST,
+	OPT_STORE,
+	OPT_RESTORE,
+	OPT_DELTA,
+	OPT_APPLY,
+	OPT_HISTORY,
+	OPT_MIRROR,
+	OPT_INTERVAL,
+	OPT_PID,
+	OPT_HOLD,
+	OPT_STRINGS,
+	OPT_RELOADS,
+	OPT_STORM,
+	OPT_PREFIX,
+	OPT_AGGREGATE,
+	OPT_ADDR_STATS
+};
+
+/* What the run does, besides the default verification and dump. */
+enum mode {
+	MODE_DUMP,
+	MODE_BUDGET,
+	MODE_ANONYMIZE,
+	MODE_GENERATE,
+	MODE_MICROBENCH,
+	MODE_DIFFTEST,
+	MODE_HEATMAP,
+	MODE_RESIDENCY,
+	MODE_LOCALITY,
+	MODE_FINGERPRINT,
+	MODE_SET_DIGEST,
+	MODE_STORE,
+	MODE_RESTORE,
+	MODE_DELTA,
+	MODE_APPLY,
+	MODE_HISTORY,
+	MODE_MIRROR,
+	MODE_PID,
+	MODE_HOLD,
+	MODE_STRINGS,
+	MODE_RELOADS,
+	MODE_STORM,
+	MODE_PREFIX,
+	MODE_AGGREGATE,
+	MODE_ADDR_STATS
+};
+
+static const struct option long_options[] = {
+	{ "gentle", optional_argument, NULL, OPT_GENTLE },
+	{ "auto", no_argument, NULL, OPT_AUTO },
+	{ "threads", required_argument, NULL, OPT_THREADS },
+	{ "spill-dir", required_argument, NULL, OPT_SPILL_DIR },
+	{ "prefault", no_argument, NULL, OPT_PREFAULT },
+	{ "time-budget", required_argument, NULL, OPT_TIME_BUDGET },
+	{ "progress", no_argument, NULL, OPT_PROGRESS },
+	{ "anonymize", no_argument, NULL, OPT_ANONYMIZE },
+	{ "anon-key", required_argument, NULL, OPT_ANON_KEY },
+	{ "generate", required_argument, NULL, OPT_GENERATE },
+	{ "count", required_argument, NULL, OPT_COUNT },
+	{ "microbench", no_argument, NULL, OPT_MICROBENCH },
+	{ "difftest", no_argument, NULL, OPT_DIFFTEST },
+	{ "heatmap", optional_argument, NULL, OPT_HEATMAP },
+	{ "residency", no_argument, NULL, OPT_RESIDENCY },
+	{ "locality", no_argument, NULL, OPT_LOCALITY },
+	{ "fingerprint", optional_argument, NULL, OPT_FINGERPRINT },
+	{ "set-digest", optional_argument, NULL, OPT_SET_DIGEST },
+	{ "store", required_argument, NULL, OPT_STORE },
+	{ "restore", required_argument, NULL, OPT_RESTORE },
+	{ "delta", no_argument, NULL, OPT_DELTA },
+	{ "apply", no_argument, NULL, OPT_APPLY },
+	{ "history", required_argument, NULL, OPT_HISTORY },
+	{ "mirror", required_argument, NULL, OPT_MIRROR },
+	{ "interval", required_argument, NULL, OPT_INTERVAL },
+	{ "pid", required_argument, NULL, OPT_PID },
+	{ "hold", no_argument, NULL, OPT_HOLD },
+	{ "strings", no_argument, NULL, OPT_STRINGS },
+	{ "reloads", optional_argument, NULL, OPT_RELOADS },
+	{ "storm", optional_argument, NULL, OPT_STORM },
+	{ "prefix", required_argument, NULL, OPT_PREFIX },
+	{ "aggregate", optional_argument, NULL, OPT_AGGREGATE },
+	{ "addr-stats", no_argument, NULL, OPT_ADDR_STATS },
+	{ NULL, 0, NULL, 0 }
+};
+
+int
+main (int argc, char *argv[])
+{
+	const char *db_filename;
+	enum mode mode = MODE_DUMP;
+	int nargs = 1;
+	int verbose = 0;
+	int automatic = 0;
+	unsigned threads = 0;
+	const char *spill_dir = NULL;
+	int prefault_file = 0;
+	unsigned time_budget = 0;
+	int periodic_progress = 0;
+	const char *anon_key = NULL;
+	const char *kind = NULL;
+	unsigned count = 0;
+	const char *heatmap_format = NULL;
+	int layout_only = 0;
+	unsigned nranges = 0;
+	const char *store_dir = NULL;
+	const char *history_dir = NULL;
+	const char *mirror_dest = NULL;
+	unsigned interval = 1000;
+	pid_t pid = 0;
+	unsigned reload_count = 0;
+	unsigned storm_share = 0;
+	const char *cidr = NULL;
+	unsigned v4_len = 0, v6_len = 0;
+	int opt;
+
+	while ((opt = getopt_long (argc, argv, "v", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = 1;
+			break;
+		case OPT_GENTLE: {
+			double byte_rate = GENTLE_DEFAULT_BYTE_RATE;
+			double record_rate = GENTLE_DEFAULT_RECORD_RATE;
+
+			if (   optarg != NULL
+				&& sscanf (optarg, "%lf:%lf", &byte_rate, &record_rate) < 1) {
+				usage ();
+				return 1;
+			}
+			if (gentle_init (byte_rate, record_rate) != 0) {
+				fprintf (stderr, "Invalid gentle mode rates \"%s\"\n", optarg);
+				return 1;
+			}
+			break;
+		}
+		case OPT_AUTO:
+			automatic = 1;
+			break;
+		case OPT_THREADS:
+			threads = atoi (optarg);
+			if (threads == 0) {
+				usage ();
+				return 1;
+			}
+			break;
+		case OPT_SPILL_DIR:
+			spill_dir = optarg;
+			break;
+		case OPT_PREFAULT:
+			prefault_file = 1;
+			break;
+		case OPT_PROGRESS:
+			periodic_progress = 1;
+			break;
+		case OPT_TIME_BUDGET:
+			time_budget = atoi (optarg);
+			if (time_budget == 0) {
+				usage ();
+				return 1;
+			}
+			mode = MODE_BUDGET;
+			break;
+		case OPT_ANONYMIZE:
+			mode = MODE_ANONYMIZE;
+			nargs = 2;
+			break;
+		case OPT_ANON_KEY:
+			anon_key = optarg;
+			break;
+		case OPT_GENERATE:
+			mode = MODE_GENERATE;
+			kind = optarg;
+			break;
+		case OPT_COUNT:
+			count = atoi (optarg);
+			break;
+		case OPT_MICROBENCH:
+			mode = MODE_MICROBENCH;
+			nargs = 0;
+			break;
+		case OPT_DIFFTEST:
+			mode = MODE_DIFFTEST;
+			nargs = 0;
+			break;
+		case OPT_HEATMAP:
+			mode = MODE_HEATMAP;
+			heatmap_format = optarg ? optarg : "text";
+			break;
+		case OPT_RESIDENCY:
+			mode = MODE_RESIDENCY;
+			break;
+		case OPT_LOCALITY:
+			mode = MODE_LOCALITY;
+			break;
+		case OPT_FINGERPRINT:
+			if (optarg != NULL && strcmp (optarg, "layout") != 0) {
+				usage ();
+				return 1;
+			}
+			mode = MODE_FINGERPRINT;
+			layout_only = optarg != NULL;
+			break;
+		case OPT_SET_DIGEST:
+			mode = MODE_SET_DIGEST;
+			nranges = optarg ? atoi (optarg) : 0;
+			break;
+		case OPT_STORE:
+			mode = MODE_STORE;
+			store_dir = optarg;
+			break;
+		case OPT_RESTORE:
+			mode = MODE_RESTORE;
+			store_dir = optarg;
+			nargs = 2;
+			break;
+		case OPT_DELTA:
+			mode = MODE_DELTA;
+			nargs = 3;
+			break;
+		case OPT_APPLY:
+			mode = MODE_APPLY;
+			nargs = 3;
+			break;
+		case OPT_HISTORY:
+			mode = MODE_HISTORY;
+			history_dir = optarg;
+			break;
+		case OPT_MIRROR:
+			mode = MODE_MIRROR;
+			mirror_dest = optarg;
+			break;
+		case OPT_INTERVAL:
+			interval = atoi (optarg);
+			if (interval == 0) {
+				usage ();
+				return 1;
+			}
+			break;
+		case OPT_PID:
+			pid = atoi (optarg);
+			if (pid <= 0) {
+				usage ();
+				return 1;
+			}
+			mode = MODE_PID;
+			nargs = 0;
+			break;
+		case OPT_HOLD:
+			mode = MODE_HOLD;
+			break;
+		case OPT_STRINGS:
+			mode = MODE_STRINGS;
+			break;
+		case OPT_RELOADS:
+			mode = MODE_RELOADS;
+			reload_count = optarg ? atoi (optarg) : 0;
+			break;
+		case OPT_STORM:
+			mode = MODE_STORM;
+			storm_share = optarg ? atoi (optarg) : 0;
+			break;
+		case OPT_PREFIX:
+			mode = MODE_PREFIX;
+			cidr = optarg;
+			break;
+		case OPT_AGGREGATE:
+			mode = MODE_AGGREGATE;
+			if (optarg != NULL && sscanf (optarg, "%u,%u", &v4_len, &v6_len) < 1) {
+				usage ();
+				return 1;
+			}
+			break;
+		case OPT_ADDR_STATS:
+			mode = MODE_ADDR_STATS;
+			break;
+		default:
+			usage ();
+			return 1;
+		}
+	}
+
+	if (optind != argc - nargs) {
+		usage ();
+		return 1;
+	}
+	db_filename = argv[optind];
+	progress_init (periodic_progress);
+
+	/* Modes not reading a database. */
+	if (mode == MODE_GENERATE)
+		return generate_db (kind, count, db_filename) != 0;
+	if (mode == MODE_MICROBENCH)
+		return microbench () != 0;
+	if (mode == MODE_DIFFTEST)
+		return difftest (count) != 0;
+	if (mode == MODE_RESTORE)
+		return restore_db (store_dir, argv[optind], argv[optind + 1]) != 0;
+	if (mode == MODE_HISTORY)
+		return history_db (history_dir, argv[optind]) != 0;
+	if (mode == MODE_MIRROR)
+		return mirror_db (db_filename, mirror_dest, interval, count) != 0;
+	if (mode == MODE_HOLD)
+		return hold_db (db_filename) != 0;
+
+	struct dump_options opts = {
+		.verbose = verbose,
+		.automatic = automatic,
+		.threads = threads,
+		.spill_dir = spill_dir,
+		.prefault = prefault_file
+	};
+	if (mode == MODE_PID) {
+		struct pid_region regions[PID_MAX_CACHES];
+		int n = pid_caches (pid, regions, PID_MAX_CACHES);
+		int rc = n > 0 ? 0 : 1;
+
+		if (n == 0)
+			fprintf (stderr, "No caches found in process %d\n", (int) pid);
+		for (int i = 0; i < n; i++) {
+			struct db_file db;
+
+			if (pid_open (&db, pid, &regions[i]) != 0) {
+				rc = 1;
+				continue;
+			}
+			if (i > 0)
+				printf ("\n");
+			if (verify_and_dump (&db, &opts) != 0)
+				rc = 1;
+			db_close (&db);
+		}
+		return rc;
+	}
+
+ 	struct db_file db;
+	if (db_open (&db, db_filename) != 0)
 		return 1;
+
+	if (mode != MODE_DUMP) {
+		int rc = -1;
+
+		switch (mode) {
+		case MODE_BUDGET:
+			rc = budget_walk (&db, time_budget);
+			break;
+		case MODE_ANONYMIZE:
+			rc = anonymize_db (&db, argv[optind + 1], anon_key);
+			break;
+		case MODE_HEATMAP:
+			rc = heatmap_db (&db, heatmap_format);
+			break;
+		case MODE_RESIDENCY:
+			rc = residency_db (&db);
+			break;
+		case MODE_LOCALITY:
+			rc = locality_db (&db);
+			break;
+		case MODE_FINGERPRINT:
+			rc = fingerprint_db (&db, layout_only);
+			break;
+		case MODE_SET_DIGEST:
+			rc = set_digest_db (&db, nranges, threads);
+			break;
+		case MODE_STORE:
+			rc = store_db (&db, store_dir);
+			break;
+		case MODE_DELTA: {
+			struct db_file new;
+
+			if (db_open (&new, argv[optind + 1]) == 0) {
+				rc = delta_db (&db, &new, argv[optind + 2]);
+				db_close (&new);
+			}
+			break;
+		}
+		case MODE_APPLY:
+			rc = apply_db (&db, argv[optind + 1], argv[optind + 2]);
+			break;
+		case MODE_STRINGS:
+			rc = strdedup_db (&db);
+			break;
+		case MODE_RELOADS:
+			rc = reloads_db (&db, reload_count);
+			break;
+		case MODE_STORM:
+			rc = storm_db (&db, storm_share, interval, count);
+			break;
+		case MODE_PREFIX:
+			rc = prefix_db (&db, cidr);
+			break;
+		case MODE_AGGREGATE:
+			rc = aggregate_db (&db, v4_len, v6_len);
+			break;
+		case MODE_ADDR_STATS:
+			rc = addr_stats_db (&db);
+			break;
+		default:
+			break;
+		}
+		gentle_report (stderr);
+		db_close (&db);
+		return rc != 0;
 	}
-	printf ("Database file \"%s\" validated\n\n",	db_filename);
 
-	print_db_header_stats (&head);
-	print_entries (mem, verbose);
+	int rc = verify_and_dump (&db, &opts);
 
-	munmap (mem, total);
-  	close (fd);
+	db_close (&db);
+	return rc != 0;
 }
@@ -0,0 +1,439 @@
+/* Declarations shared between the nscd_dump modules.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#ifndef _NSCD_DUMP_H
+#define _NSCD_DUMP_H	1
+
+#include <limits.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+#include "nscd.h"
+
+/* An opened and mapped database file. */
+struct db_file {
+	const char *name;
+	int fd;
+	struct stat64 st;
+	struct database_pers_head head;	/* As read (), not mapped. */
+	void *mem;
+	size_t mapsize;
+};
+
+/* Where the verifier keeps its map of used data bytes. */
+enum usemap_kind {
+	USEMAP_MEMORY,
+	USEMAP_SPILL,
+	USEMAP_NONE
+};
+
+struct exec_plan {
+	enum usemap_kind usemap;
+	const char *spill_dir;		/* NULL picks one. */
+	unsigned threads;
+	nscd_ssize_t sample_stride;	/* Verify every this many buckets. */
+	int prefault;				/* Fault the file in first, in parallel. */
+};
+
+/* Start of the data area following the bucket array. */
+static inline char *
+db_data (struct database_pers_head *head) {
+	return (char *) &head->array[roundup (head->module,
+										  ALIGN / sizeof (ref_t))];
+}
+
+/* Set bit BIT of BITMAP, returning whether it was set already. */
+static inline int
+test_and_set (uint8_t *bitmap, size_t bit) {
+	int was = (bitmap[bit / 8] >> (bit % 8)) & 1;
+
+	bitmap[bit / 8] |= 1 << (bit % 8);
+	return was;
+}
+
+/* Markers in the verifier map of used data bytes. */
+enum usekey {
+    use_not = 0,
+    /* The following three are not really used, they are symbolic constants.  */
+    use_first = 16,
+    use_begin = 32,
+    use_end = 64,
+
+    use_he = 1,
+    use_he_begin = use_he | use_begin,
+    use_he_end = use_he | use_end,
+#if SEPARATE_KEY
+    use_key = 2,
+    use_key_begin = use_key | use_begin,
+    use_key_end = use_key | use_end,
+    use_key_first = use_key_begin | use_first,
+#endif
+    use_data = 3,
+    use_data_begin = use_data | use_begin,
+    use_data_end = use_data | use_end,
+    use_data_first = use_data_begin | use_first
+};
+
+/* nscd_dump.c */
+extern const char *af2str[AF_MAX];
+extern const char *const serv2str[LASTREQ];
+
+const char *check_use (const char *data, nscd_ssize_t first_free,
+					   uint8_t *usemap, enum usekey use, ref_t start,
+					   size_t len);
+int db_open (struct db_file *db, const char *filename);
+void db_close (struct db_file *db);
+const char *verify_db_header (struct database_pers_head *head,
+							  struct database_pers_head *readhead);
+int sweep_unreferenced (const uint8_t *usemap, size_t len, unsigned threads);
+const char *verify_persistent_db (void *mem,
+								  struct database_pers_head *readhead);
+const char *verify_persistent_db_plan (void *mem,
+									   struct database_pers_head *readhead,
+									   const struct exec_plan *plan);
+void print_db_header_stats (struct database_pers_head *head);
+void print_hashentry_datahead (struct hashentry *he, struct datahead *dh,
+							   const char *key, int nr, int verbose);
+void print_ip_addr (int af_family, void *addr);
+ref_t print_hst_resp_data (request_type type, hst_response_header *hst_resp,
+						   char *resp_data, int verbose);
+ref_t print_ai_resp_data (ai_response_header *ai_resp, char *resp_data,
+						  int verbose);
+void print_entries (void *mem, int verbose, nscd_ssize_t stride);
+
+/* workers.c */
+typedef void (*parallel_fn) (size_t begin, size_t end, unsigned index,
+							 void *arg);
+
+void parallel_for (unsigned nthreads, size_t n, parallel_fn fn, void *arg);
+
+/* microbench.c */
+int microbench (void);
+
+/* difftest.c */
+int difftest (unsigned cases);
+
+/* plan.c */
+extern const struct exec_plan default_plan;
+
+unsigned long long available_memory (void);
+void plan_auto (struct exec_plan *plan, const struct db_file *db);
+void plan_report (FILE *out, const struct exec_plan *plan,
+				  const struct db_file *db);
+uint8_t *usemap_alloc (const struct exec_plan *plan, size_t size);
+void usemap_free (const struct exec_plan *plan, uint8_t *usemap,
+				  size_t size);
+
+/* anonymize.c */
+int anonymize_db (struct db_file *in, const char *out_name,
+				  const char *secret);
+
+/* builder.c */
+struct db_builder {
+	nscd_ssize_t module;
+	ref_t *array;
+	nscd_ssize_t *chain_len;
+	char *data;
+	size_t capacity;
+	size_t first_free;
+	nscd_ssize_t nentries;
+	nscd_ssize_t maxnsearched;
+	nscd_time_t now;
+	/* Knobs for pathological layouts. */
+	nscd_ssize_t bucket;		/* Put every entry here if >= 0. */
+	size_t gap;					/* Free bytes left behind each allocation. */
+	/* Header to take the timestamp, GC cycle and statistics from. */
+	const struct database_pers_head *like;
+};
+
+/* A host record to add; ADDRS holds NADDRS addresses of ADDRLEN bytes. */
+struct builder_hst {
+	request_type type;
+	const char *key;
+	nscd_ssize_t keylen;
+	const char *name;
+	const char *const *aliases;
+	int naliases;
+	const uint8_t *addrs;
+	int naddrs;
+	int addrlen;
+	bool notfound;
+	bool alias_entries;
+	unsigned ttl;
+};
+
+/* An addrinfo record to add; ADDRS holds addresses sized by FAMILIES. */
+struct builder_ai {
+	const char *key;
+	const char *canon;
+	const uint8_t *addrs;
+	const uint8_t *families;
+	int naddrs;
+	unsigned ttl;
+};
+
+int builder_init (struct db_builder *b, nscd_ssize_t module);
+void builder_free (struct db_builder *b);
+ref_t builder_alloc (struct db_builder *b, size_t size);
+int builder_add_entry (struct db_builder *b, request_type type, bool first,
+					   ref_t key, nscd_ssize_t len, ref_t packet);
+int builder_add_packet (struct db_builder *b, const void *packet,
+						size_t allocsize, ref_t *off);
+int builder_add_hst (struct db_builder *b, const struct builder_hst *rec);
+int builder_add_ai (struct db_builder *b, const struct builder_ai *rec);
+int builder_write (struct db_builder *b, const char *filename, size_t slack);
+
+/* heatmap.c */
+int heatmap_db (struct db_file *db, const char *format);
+
+/* prefault.c */
+
+/* Threads faulting pages in; they wait on I/O, not on CPUs. */
+#define PREFAULT_THREADS	16
+
+long prefault (void *mem, unsigned threads);
+
+/* fingerprint.c */
+uint64_t layout_fingerprint (void *mem);
+uint64_t entry_digest (const char *data, struct hashentry *he);
+uint64_t semantic_fingerprint (void *mem);
+int fingerprint_db (struct db_file *db, int layout_only);
+
+/* setdigest.c */
+int set_digest_db (struct db_file *db, unsigned nranges, unsigned threads);
+
+/* store.c */
+int write_atomic (const char *path, const void *p, size_t len);
+int store_db (struct db_file *db, const char *dir);
+int restore_db (const char *dir, const char *manifest, const char *out);
+
+/* delta.c */
+int delta_db (struct db_file *base, struct db_file *new, const char *out_name);
+int apply_db (struct db_file *base, const char *delta_name, const char *out);
+
+/* history.c */
+int history_db (const char *dir, const char *key);
+
+/* strdedup.c */
+int strdedup_db (struct db_file *db);
+
+/* reloads.c */
+int reloads_db (struct db_file *db, unsigned limit);
+
+/* storm.c */
+int storm_db (struct db_file *db, unsigned share, unsigned interval_ms,
+			  unsigned count);
+
+/* prefix.c */
+int prefix_db (struct db_file *db, const char *cidr);
+int aggregate_db (struct db_file *db, unsigned v4_len, unsigned v6_len);
+
+/* addrstats.c */
+int addr_stats_db (struct db_file *db);
+
+/* pid.c */
+#define PID_MAX_CACHES	16
+
+/* A cache found in the memory of a process. */
+struct pid_region {
+	uintptr_t start;
+	size_t size;
+	char name[PATH_MAX + 64];
+};
+
+int pid_caches (pid_t pid, struct pid_region *regions, int max);
+int pid_open (struct db_file *db, pid_t pid, const struct pid_region *region);
+int hold_db (const char *filename);
+
+/* mirror.c */
+int mirror_db (const char *source, const char *dest, unsigned interval_ms,
+			   unsigned count);
+
+/* watch.c */
+enum watch_reason {
+	WATCH_NONE,
+	WATCH_START,				/* First round. */
+	WATCH_EVENT,				/* inotify reported a change. */
+	WATCH_TIMER					/* Interval for changes through mappings. */
+};
+
+typedef int (*watch_fn) (unsigned index, enum watch_reason reason, void *arg);
+int watch_files (const char *const *paths, unsigned n, unsigned interval_ms,
+				 unsigned rounds, watch_fn fn, void *arg);
+
+/* footprint.c */
+
+/* Called per hash entry with the UNITS its lookup touches. */
+typedef void (*footprint_fn) (nscd_ssize_t bucket, struct hashentry *he,
+							  unsigned units, void *arg);
+
+int footprint_walk (void *mem, size_t unit_size,
+					const unsigned char *resident, footprint_fn fn,
+					void *arg);
+
+/* locality.c */
+int locality_db (struct db_file *db);
+
+/* residency.c */
+int residency_db (struct db_file *db);
+
+/* budget.c */
+int budget_walk (struct db_file *db, unsigned budget_ms);
+
+/* progress.c */
+
+/* Buckets and entries walked between two looks at whether a report
+   is due.
+ */
+#define PROGRESS_INTERVAL	1024
+
+struct progress_state {
+	int periodic;
+	volatile sig_atomic_t requested;
+	unsigned countdown;
+	const char *phase;
+	nscd_ssize_t buckets, entries;
+	double start, last;
+};
+
+extern struct progress_state progress;
+
+void progress_init (int periodic);
+void progress_start (const char *phase,
+					 const struct database_pers_head *head);
+void progress_poll (nscd_ssize_t bucket, nscd_ssize_t entries,
+					size_t bytes);
+void progress_finish (nscd_ssize_t entries, size_t bytes);
+
+/* Called once per bucket and once per entry of its chain by the walks,
+   with the buckets done so far, entries seen and bytes touched.
+ */
+static inline void
+progress_tick (nscd_ssize_t bucket, nscd_ssize_t entries, size_t bytes) {
+	if (--progress.countdown == 0)
+		progress_poll (bucket, entries, bytes);
+}
+
+/* hash.c */
+struct sipkey {
+	uint64_t k0, k1;
+};
+
+struct xxh64_state {
+	uint64_t total_len;
+	uint64_t seed;
+	uint64_t v[4];
+	uint8_t buf[32];
+	size_t buffered;
+};
+
+uint64_t siphash24 (const struct sipkey *key, const void *src, size_t len);
+uint32_t nscd_hash (const void *key, size_t len);
+void sipkey_from_string (struct sipkey *key, const char *secret);
+void xxh64_init (struct xxh64_state *st, uint64_t seed);
+void xxh64_update (struct xxh64_state *st, const void *src, size_t len);
+uint64_t xxh64_digest (const struct xxh64_state *st);
+uint64_t xxh64 (const void *src, size_t len, uint64_t seed);
+
+/* decode.c */
+struct hst_view {
+	hst_response_header *resp;
+	char *name;
+	uint8_t *aliases_len;		/* Unaligned uint32_t array. */
+	uint8_t *addrs;
+	char *aliases;				/* First of the alias strings. */
+};
+
+struct ai_view {
+	ai_response_header *resp;
+	uint8_t *addrs;
+	uint8_t *families;
+	char *canon;
+};
+
+int decode_hst (struct datahead *dh, struct hst_view *view);
+int decode_ai (struct datahead *dh, struct ai_view *view);
+
+static inline uint32_t
+hst_alias_len (const struct hst_view *view, nscd_ssize_t i) {
+	uint32_t len;
+
+	memcpy (&len, view->aliases_len + i * sizeof (uint32_t), sizeof (len));
+	return len;
+}
+
+/* Size of a GETAI address of FAMILY, as print_ai_resp_data () has it. */
+static inline size_t
+ai_addr_len (uint8_t family) {
+	return family == AF_INET6
+		? sizeof (struct in6_addr) : sizeof (struct in_addr);
+}
+
+/* generate.c */
+int generate_db (const char *kind, unsigned count, const char *filename);
+
+/* gentle.c */
+
+/* Default pacing of the gentle mode: bytes of the database touched and
+   records decoded per second.
+ */
+#define GENTLE_DEFAULT_BYTE_RATE	(32 * 1024 * 1024)
+#define GENTLE_DEFAULT_RECORD_RATE	50000
+
+struct gentle_state {
+	int enabled;
+	/* Charges accumulated since the last visit to the token buckets. */
+	size_t pending_bytes;
+	size_t pending_records;
+	/* Accumulated charges that trigger a visit to the token buckets. */
+	size_t quantum_bytes;
+	size_t quantum_records;
+	/* Token buckets; see gentle_throttle ().  */
+	double byte_rate, byte_tokens, byte_burst;
+	double record_rate, record_tokens, record_burst;
+	double last;
+	/* Statistics for the final report. */
+	double slept;
+	unsigned long pauses;
+	unsigned long long bytes, records;
+};
+
+extern struct gentle_state gentle;
+
+int gentle_init (double byte_rate, double record_rate);
+void gentle_throttle (void);
+void gentle_report (FILE *out);
+unsigned available_cpus (void);
+
+/* Account BYTES of the database touched and RECORDS decoded.  Cheap
+   enough to be called once per record from the hot loops.
+ */
+static inline void
+gentle_charge (size_t bytes, size_t records) {
+	if (!gentle.enabled)
+		return;
+
+	gentle.pending_bytes += bytes;
+	gentle.pending_records += records;
+	if (   gentle.pending_bytes >= gentle.quantum_bytes
+		|| gentle.pending_records >= gentle.quantum_records)
+		gentle_throttle ();
+}
+
+#endif /* nscd_dump.h */
@@ -0,0 +1,214 @@
+/* Caches in the memory of a running nscd.
+
+   Without persistent databases, nscd keeps each cache in a mapping of
+   a file it unlinks right away (shared caches) and nscd_dump has no
+   file to open.  The mapping still starts with the usual header, bucket
+   array and data area, so the mappings of the process listed in
+   /proc/PID/maps are probed for a header that describes a database
+   fitting in them, and those found are copied out of the process with
+   process_vm_readv (), in batches of large iovecs and without stopping
+   it.  The copy is then verified and dumped like a file.  Like the
+   mirror, a copy is retried while a garbage collection ran during it.
+
+   Caches nscd keeps in private heap memory, with the bucket array and
+   the data area in separate allocations and a zero header, carry no
+   signature to find them by and are not found.
+
+   hold_db () is a stand-in for nscd to try this on: it copies a
+   database file into shared anonymous memory and waits.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include "nscd_dump.h"
+
+#define PID_IOV_SIZE	(1024 * 1024)
+#define PID_IOV_MAX		256
+#define PID_RETRIES		5
+
+/* Read LEN bytes at REMOTE in process PID into LOCAL.  Returns 0 if all
+   of them could be read.
+ */
+static int
+read_remote (pid_t pid, void *local, uintptr_t remote, size_t len) {
+	struct iovec liov[PID_IOV_MAX], riov[PID_IOV_MAX];
+
+	while (len > 0) {
+		size_t batch = 0;
+		int n;
+
+		for (n = 0; n < PID_IOV_MAX && batch < len; n++) {
+			size_t piece = MIN ((size_t) PID_IOV_SIZE, len - batch);
+
+			liov[n].iov_base = (char *) local + batch;
+			riov[n].iov_base = (void *) (remote + batch);
+			liov[n].iov_len = riov[n].iov_len = piece;
+			batch += piece;
+		}
+
+		ssize_t got = process_vm_readv (pid, liov, n, riov, n, 0);
+		if (got <= 0)
+			return -1;
+		local = (char *) local + got;
+		remote += got;
+		len -= got;
+	}
+	return 0;
+}
+
+/* Size of the database whose header is HEAD, 0 if the header does not
+   look like one fitting in LEN bytes.
+ */
+static size_t
+database_size (const struct database_pers_head *head, size_t len) {
+	if (   head->version != DB_VERSION
+		|| head->header_size != (int) sizeof (*head)
+		|| head->module <= 0
+		|| (size_t) head->module > INT32_MAX / sizeof (ref_t)
+		|| head->data_size < 0 || head->first_free < 0
+		|| head->first_free > head->data_size)
+		return 0;
+
+	size_t total = sizeof (*head) + roundup (head->module * sizeof (ref_t),
+											 ALIGN)
+		+ head->data_size;
+	return total <= len ? total : 0;
+}
+
+/* Find the caches in the memory of process PID, storing up to MAX of
+   them in REGIONS.  Returns their number, -1 on error.
+ */
+int
+pid_caches (pid_t pid, struct pid_region *regions, int max) {
+	char path[64], line[PATH_MAX + 128];
+	int n = 0;
+
+	snprintf (path, sizeof (path), "/proc/%d/maps", (int) pid);
+	FILE *maps = fopen (path, "r");
+	if (maps == NULL) {
+		fprintf (stderr, "Cannot read \"%s\": %s\n", path, strerror (errno));
+		return -1;
+	}
+
+	while (n < max && fgets (line, sizeof (line), maps) != NULL) {
+		unsigned long start, end;
+		char perms[8];
+		int name_at = 0;
+
+		if (   sscanf (line, "%lx-%lx %7s %*s %*s %*s %n", &start, &end,
+					   perms, &name_at) < 3
+			|| perms[0] != 'r')
+			continue;
+
+		struct database_pers_head head;
+		if (read_remote (pid, &head, start, sizeof (head)) != 0)
+			continue;
+		size_t size = database_size (&head, end - start);
+		if (size == 0)
+			continue;
+
+		struct pid_region *r = &regions[n++];
+		char *mapping = line + name_at;
+		mapping[strcspn (mapping, "\n")] = '\0';
+		r->start = start;
+		r->size = size;
+		snprintf (r->name, sizeof (r->name), "pid %d at %#lx%s%s", (int) pid,
+				  start, *mapping ? " " : "", mapping);
+	}
+
+	fclose (maps);
+	return n;
+}
+
+/* Copy the cache REGION of process PID into DB, as db_open () would
+   map a file.
+ */
+int
+pid_open (struct db_file *db, pid_t pid, const struct pid_region *region) {
+	memset (db, 0, sizeof (*db));
+	db->name = region->name;
+	db->fd = -1;
+	db->mapsize = region->size;
+	db->mem = mmap (NULL, db->mapsize, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (db->mem == MAP_FAILED) {
+		fprintf (stderr, "Cannot copy %s: %s\n", db->name, strerror (errno));
+		return -1;
+	}
+
+	struct database_pers_head *head = db->mem;
+	int consistent = 0;
+	for (int attempt = 0; attempt < PID_RETRIES && !consistent; attempt++) {
+		int32_t gc_cycle;
+
+		if (attempt > 0)
+			usleep (20000);
+		if (   read_remote (pid, db->mem, region->start, region->size) != 0
+			|| read_remote (pid, &gc_cycle, region->start
+							+ offsetof (struct database_pers_head, gc_cycle),
+							sizeof (gc_cycle)) != 0) {
+			fprintf (stderr, "Cannot read %s: %s\n", db->name,
+					 strerror (errno));
+			munmap (db->mem, db->mapsize);
+			return -1;
+		}
+		consistent = gc_cycle == head->gc_cycle && !(gc_cycle & 1)
+			&& database_size (head, region->size) == region->size;
+	}
+
+	if (!consistent) {
+		fprintf (stderr, "No consistent copy of %s\n", db->name);
+		munmap (db->mem, db->mapsize);
+		return -1;
+	}
+	db->head = *head;
+	db->st.st_size = region->size;
+	mprotect (db->mem, db->mapsize, PROT_READ);
+	return 0;
+}
+
+/* Keep a copy of the database FILENAME in shared anonymous memory, as
+   nscd does for caches that are not persistent, until killed.
+ */
+int
+hold_db (const char *filename) {
+	struct db_file db;
+
+	if (db_open (&db, filename) != 0)
+		return -1;
+
+	size_t size = db.st.st_size;
+	void *mem = mmap (NULL, size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		fprintf (stderr, "Cannot map %zu bytes: %s\n", size, strerror (errno));
+		db_close (&db);
+		return -1;
+	}
+	memcpy (mem, db.mem, size);
+	db_close (&db);
+
+	printf ("Holding \"%s\" in process %d at %p\n", filename, (int) getpid (),
+			mem);
+	fflush (stdout);
+	for (;;)
+		pause ();
+}
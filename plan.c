@@ -0,0 +1,273 @@
+/* Execution plans for the verifier.
+
+   The verifier keeps a map with one byte per byte of live data, which
+   for a large cache may not fit into what the host or the cgroup has to
+   spare.  A plan says where that map lives (memory, a spill file on
+   disk, or nowhere when only a sample of the buckets is verified) and
+   how many threads the parallel stages may use, and whether the file is
+   prefaulted before the walk.  plan_auto () picks
+   one from the database geometry and the resources of the host.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/statfs.h>
+#include <sys/statvfs.h>
+
+#include "nscd_dump.h"
+
+#ifndef TMPFS_MAGIC
+# define TMPFS_MAGIC 0x01021994
+#endif
+
+/* Live data handled by one sweep thread at least; below that the
+   thread start-up costs more than it saves.
+ */
+#define PLAN_BYTES_PER_THREAD	(16 * 1024 * 1024)
+#define PLAN_MAX_THREADS		8
+
+/* Fraction of the available memory the verifier map may take. */
+#define PLAN_MEMORY_SHARE		2
+
+/* Bucket stride used when the map fits nowhere. */
+#define PLAN_SAMPLE_STRIDE		8
+
+/* Prefault files of which less than this percentage is cached. */
+#define PLAN_PREFAULT_RESIDENT	50
+
+const struct exec_plan default_plan = {
+	.usemap = USEMAP_MEMORY,
+	.spill_dir = NULL,
+	.threads = 1,
+	.sample_stride = 1,
+	.prefault = 0
+};
+
+static const char *const usemap2str[] = {
+	[USEMAP_MEMORY] = "in memory",
+	[USEMAP_SPILL] = "spilled to disk",
+	[USEMAP_NONE] = "not kept (sampling)"
+};
+
+/* Read a single unsigned number from PATH, 0 if not possible.  "max"
+   reads as 0 as well.
+ */
+static unsigned long long
+read_ull (const char *path) {
+	unsigned long long val = 0;
+	FILE *f = fopen (path, "r");
+
+	if (f == NULL)
+		return 0;
+	if (fscanf (f, "%llu", &val) != 1)
+		val = 0;
+	fclose (f);
+	return val;
+}
+
+/* Memory the verifier can use without pushing the host or its own
+   cgroup into reclaim.
+ */
+unsigned long long
+available_memory (void) {
+	unsigned long long avail = 0, kb;
+	char line[512], path[600];
+	FILE *f;
+
+	if ((f = fopen ("/proc/meminfo", "r")) != NULL) {
+		while (fgets (line, sizeof (line), f) != NULL)
+			if (sscanf (line, "MemAvailable: %llu kB", &kb) == 1) {
+				avail = kb * 1024;
+				break;
+			}
+		fclose (f);
+	}
+
+	unsigned long long limit = 0, usage = 0;
+	if ((f = fopen ("/proc/self/cgroup", "r")) != NULL) {
+		while (fgets (line, sizeof (line), f) != NULL) {
+			if (strncmp (line, "0::", 3) != 0)
+				continue;
+			line[strcspn (line, "\n")] = '\0';
+			snprintf (path, sizeof (path), "/sys/fs/cgroup%s/memory.max",
+					  line + 3);
+			limit = read_ull (path);
+			snprintf (path, sizeof (path), "/sys/fs/cgroup%s/memory.current",
+					  line + 3);
+			usage = read_ull (path);
+			break;
+		}
+		fclose (f);
+	}
+	if (limit == 0) {
+		limit = read_ull ("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+		usage = read_ull ("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+	}
+
+	/* cgroup v1 reports "no limit" as a huge page-aligned number. */
+	if (limit != 0 && limit < (1ULL << 60)) {
+		unsigned long long room = limit > usage ? limit - usage : 0;
+		avail = avail ? MIN (avail, room) : room;
+	}
+
+	return avail;
+}
+
+/* Directory for the spill file: $TMPDIR unless it is memory backed,
+   then /var/tmp.  Stores FREE bytes of free space there.
+ */
+static const char *
+spill_dir (const struct exec_plan *plan, unsigned long long *free) {
+	static const char *const candidates[] = { NULL, "/var/tmp", "/tmp" };
+	struct statvfs vfs;
+	struct statfs fs;
+
+	if (plan->spill_dir != NULL) {
+		*free = statvfs (plan->spill_dir, &vfs) == 0
+				? (unsigned long long) vfs.f_bavail * vfs.f_frsize : 0;
+		return plan->spill_dir;
+	}
+
+	for (size_t i = 0; i < sizeof (candidates) / sizeof (*candidates); i++) {
+		const char *dir = i == 0 ? getenv ("TMPDIR") : candidates[i];
+
+		if (   dir == NULL
+			|| statfs (dir, &fs) != 0 || fs.f_type == TMPFS_MAGIC
+			|| statvfs (dir, &vfs) != 0)
+			continue;
+		*free = (unsigned long long) vfs.f_bavail * vfs.f_frsize;
+		return dir;
+	}
+
+	*free = 0;
+	return NULL;
+}
+
+/* Percentage of the pages of the header, the bucket array and the live
+   data of DB in the page cache, 100 if unknown.
+ */
+static unsigned
+resident_percent (const struct db_file *db) {
+	size_t page_size = sysconf (_SC_PAGESIZE);
+	size_t size = MIN ((size_t) db->st.st_size,
+					   db_data ((struct database_pers_head *) db->mem)
+					   - (char *) db->mem + db->head.first_free);
+	size_t npages = (size + page_size - 1) / page_size, resident = 0;
+	unsigned char *vec = malloc (npages);
+
+	if (vec == NULL || npages == 0 || mincore (db->mem, size, vec) != 0) {
+		free (vec);
+		return 100;
+	}
+	for (size_t i = 0; i < npages; i++)
+		resident += vec[i] & 1;
+	free (vec);
+	return resident * 100 / npages;
+}
+
+void
+plan_auto (struct exec_plan *plan, const struct db_file *db) {
+	size_t mapsize = db->head.first_free;
+	unsigned long long mem = available_memory ();
+	unsigned long long disk;
+
+	*plan = default_plan;
+
+	const char *dir = spill_dir (plan, &disk);
+	if (mem == 0 || mapsize <= mem / PLAN_MEMORY_SHARE)
+		plan->usemap = USEMAP_MEMORY;
+	else if (dir != NULL && mapsize <= disk / PLAN_MEMORY_SHARE) {
+		plan->usemap = USEMAP_SPILL;
+		plan->spill_dir = dir;
+	} else {
+		plan->usemap = USEMAP_NONE;
+		plan->sample_stride = PLAN_SAMPLE_STRIDE;
+	}
+
+	/* Gentle mode trades run time for impact; keep it single threaded. */
+	if (!gentle.enabled) {
+		unsigned threads = mapsize / PLAN_BYTES_PER_THREAD + 1;
+
+		threads = MIN (threads, available_cpus ());
+		plan->threads = MIN (threads, PLAN_MAX_THREADS);
+		plan->prefault = resident_percent (db) < PLAN_PREFAULT_RESIDENT;
+	}
+}
+
+void
+plan_report (FILE *out, const struct exec_plan *plan,
+			 const struct db_file *db) {
+	fprintf (out, "Execution plan: verifier map %s", usemap2str[plan->usemap]);
+	if (plan->usemap == USEMAP_SPILL)
+		fprintf (out, " (%s)", plan->spill_dir);
+	fprintf (out, ", %u thread(s)", plan->threads);
+	if (plan->sample_stride > 1)
+		fprintf (out, ", every %d. bucket verified",
+				 plan->sample_stride);
+	else
+		fprintf (out, ", full verification");
+	if (plan->prefault)
+		fprintf (out, ", prefault with %u threads", PREFAULT_THREADS);
+	fprintf (out, "\n Based on: file %lld bytes (%u%% cached), live data %d"
+			 " bytes, %d entries in %d buckets, %llu bytes of memory"
+			 " available, %u CPU(s)\n",
+			 (long long) db->st.st_size, resident_percent (db),
+			 db->head.first_free, db->head.nentries, db->head.module,
+			 available_memory (), available_cpus ());
+}
+
+/* Allocate the zeroed verifier map of SIZE bytes the way PLAN says.
+   Returns NULL on failure, and also for USEMAP_NONE.
+ */
+uint8_t *
+usemap_alloc (const struct exec_plan *plan, size_t size) {
+	if (plan->usemap == USEMAP_NONE)
+		return NULL;
+	if (plan->usemap == USEMAP_MEMORY || size == 0)
+		return calloc (size, 1);
+
+	unsigned long long disk;
+	const char *dir = spill_dir (plan, &disk);
+	if (dir == NULL)
+		return NULL;
+
+	char path[PATH_MAX];
+	snprintf (path, sizeof (path), "%s/nscd_dump.XXXXXX", dir);
+	int fd = mkstemp (path);
+	if (fd == -1)
+		return NULL;
+	unlink (path);
+
+	void *map = MAP_FAILED;
+	if (ftruncate (fd, size) == 0)
+		map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+
+	return map == MAP_FAILED ? NULL : map;
+}
+
+void
+usemap_free (const struct exec_plan *plan, uint8_t *usemap, size_t size) {
+	if (usemap == NULL)
+		return;
+	if (plan->usemap == USEMAP_MEMORY || size == 0)
+		free (usemap);
+	else
+		munmap (usemap, size);
+}
@@ -0,0 +1,223 @@
+/* Parallel prefaulting of a cold database.
+
+   The chain walks fault the file in one page at a time, each fault
+   waiting for the previous one, which on network or rotating storage
+   makes them bound by the latency of the device.  prefault () instead
+   walks all chains in lock step, a level at a time: the pages of every
+   hash entry at the current depth, of the data heads of the packets
+   they point to, and of the rest of the packets whose heads came in
+   with the previous level, are collected, sorted, announced to the
+   kernel with MADV_WILLNEED in runs of adjacent pages, and touched from
+   several threads.  The number of serial round trips is then the depth
+   of the longest chain plus two instead of the number of pages.
+
+   The database has not been verified yet: references outside the live
+   data are dropped, and every hash entry and packet is visited once so
+   that cycles end.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nscd_dump.h"
+
+/* A growable array of offsets. */
+struct refs {
+	size_t *v;
+	size_t n, size;
+};
+
+struct prefault_state {
+	char *mem;
+	size_t data_off, first_free;
+	size_t page_size;
+	uint8_t *faulted;			/* Bit per page of the file. */
+	uint8_t *seen;				/* Bit per BLOCK_ALIGN unit of data. */
+	struct refs pages;			/* Of the current level. */
+	/* Hash entries of the current level and the next one, packets to
+	   fault the data head of, and packets to fault the rest of.
+	 */
+	struct refs entries, next;
+	struct refs heads, bodies;
+	unsigned threads;
+	size_t total;
+};
+
+static int
+refs_add (struct refs *r, size_t val) {
+	if (r->n == r->size) {
+		size_t size = MAX (256, 2 * r->size);
+		size_t *v = realloc (r->v, size * sizeof (*v));
+		if (v == NULL)
+			return -1;
+		r->v = v;
+		r->size = size;
+	}
+	r->v[r->n++] = val;
+	return 0;
+}
+
+/* Queue the pages of LEN bytes at data offset START not faulted yet. */
+static int
+add_range (struct prefault_state *st, size_t start, size_t len) {
+	size_t first = (st->data_off + start) / st->page_size;
+	size_t last = (st->data_off + start + len - 1) / st->page_size;
+
+	for (size_t page = first; len != 0 && page <= last; page++)
+		if (   !test_and_set (st->faulted, page)
+			&& refs_add (&st->pages, page) != 0)
+			return -1;
+	return 0;
+}
+
+/* Whether a LEN byte object at data offset REF lies in the live data
+   and was not seen before.
+ */
+static int
+fresh (struct prefault_state *st, ref_t ref, size_t len) {
+	return ref != ENDREF && ref % BLOCK_ALIGN == 0
+		&& (size_t) ref + len <= st->first_free
+		&& !test_and_set (st->seen, ref / BLOCK_ALIGN);
+}
+
+static void
+touch_pages (size_t begin, size_t end, unsigned index, void *arg) {
+	struct prefault_state *st = arg;
+	unsigned sum = 0;
+
+	for (size_t i = begin; i < end; i++)
+		sum += *(volatile const char *) (st->mem
+										 + st->pages.v[i] * st->page_size);
+	(void) sum;
+}
+
+static int
+compare_size (const void *a, const void *b) {
+	size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Fault in the queued pages of one level. */
+static void
+fault_level (struct prefault_state *st) {
+	size_t *v = st->pages.v;
+
+	qsort (v, st->pages.n, sizeof (*v), compare_size);
+	for (size_t i = 0, j; i < st->pages.n; i = j) {
+		for (j = i + 1; j < st->pages.n && v[j] == v[j - 1] + 1; j++)
+			;
+		madvise (st->mem + v[i] * st->page_size,
+				 (j - i) * st->page_size, MADV_WILLNEED);
+	}
+	parallel_for (st->threads, st->pages.n, touch_pages, st);
+
+	st->total += st->pages.n;
+	st->pages.n = 0;
+}
+
+/* Walk the chains of HEAD level by level, faulting in each. */
+static int
+walk (struct prefault_state *st, struct database_pers_head *head) {
+	char *data = st->mem + st->data_off;
+
+	/* The bucket array is read sequentially; fault it in first. */
+	for (size_t page = 0; page * st->page_size < st->data_off; page++) {
+		test_and_set (st->faulted, page);
+		if (refs_add (&st->pages, page) != 0)
+			return -1;
+	}
+	fault_level (st);
+
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		if (   fresh (st, head->array[cnt], sizeof (struct hashentry))
+			&& refs_add (&st->entries, head->array[cnt]) != 0)
+			return -1;
+
+	while (st->entries.n != 0 || st->heads.n != 0 || st->bodies.n != 0) {
+		for (size_t i = 0; i < st->entries.n; i++)
+			if (add_range (st, st->entries.v[i],
+						   sizeof (struct hashentry)) != 0)
+				return -1;
+		for (size_t i = 0; i < st->heads.n; i++)
+			if (add_range (st, st->heads.v[i], sizeof (struct datahead)) != 0)
+				return -1;
+		for (size_t i = 0; i < st->bodies.n; i++) {
+			ref_t packet = st->bodies.v[i];
+			struct datahead *dh = (struct datahead *) (data + packet);
+
+			if (add_range (st, packet, MIN ((size_t) dh->allocsize,
+											st->first_free - packet)) != 0)
+				return -1;
+		}
+		fault_level (st);
+
+		/* The packets whose heads came in are next, as is the next hash
+		   entry of every chain.
+		 */
+		struct refs tmp = st->bodies;
+		st->bodies = st->heads;
+		st->heads = tmp;
+		st->heads.n = 0;
+		st->next.n = 0;
+		for (size_t i = 0; i < st->entries.n; i++) {
+			struct hashentry *he = (struct hashentry *) (data
+														 + st->entries.v[i]);
+
+			if (   fresh (st, he->next, sizeof (struct hashentry))
+				&& refs_add (&st->next, he->next) != 0)
+				return -1;
+			if (   fresh (st, he->packet, sizeof (struct datahead))
+				&& refs_add (&st->heads, he->packet) != 0)
+				return -1;
+		}
+		tmp = st->entries;
+		st->entries = st->next;
+		st->next = tmp;
+	}
+	return 0;
+}
+
+/* Fault in the bucket array and the live data of the database at MEM
+   reachable from it with THREADS threads.  Returns the number of pages
+   faulted, -1 if out of memory.
+ */
+long
+prefault (void *mem, unsigned threads) {
+	struct database_pers_head *head = mem;
+	struct prefault_state st;
+	long rc = -1;
+
+	memset (&st, 0, sizeof (st));
+	st.mem = mem;
+	st.data_off = db_data (head) - st.mem;
+	st.first_free = head->first_free;
+	st.page_size = sysconf (_SC_PAGESIZE);
+	st.threads = threads;
+	st.faulted = calloc ((st.data_off + st.first_free) / st.page_size / 8 + 1,
+						 1);
+	st.seen = calloc (st.first_free / BLOCK_ALIGN / 8 + 1, 1);
+	if (st.faulted != NULL && st.seen != NULL && walk (&st, head) == 0)
+		rc = st.total;
+
+	free (st.faulted);
+	free (st.seen);
+	free (st.pages.v);
+	free (st.entries.v);
+	free (st.next.v);
+	free (st.heads.v);
+	free (st.bodies.v);
+	return rc;
+}
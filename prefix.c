@@ -0,0 +1,474 @@
+/* Index of the cached addresses by prefix.
+
+   Every address of the positive host and addrinfo records, IPv4 ones
+   as IPv4-mapped IPv6 addresses, goes into a PATRICIA tree over 128 bit
+   keys: a leaf per distinct address holds the names resolving to it,
+   and an internal node the first bit its two subtrees differ in.  The
+   names within a prefix are then those under the node the prefix leads
+   to, found in one descent instead of decoding and matching every
+   record, and an in order walk visits the addresses sorted, so that
+   counting them by /24 or /48 is a single pass.
+
+   The name of a record is its key for forward lookups and the official
+   name for reverse ones, whose key is the address itself.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "nscd_dump.h"
+
+#define PREFIX_LEAF				0x80000000u	/* Reference to a leaf. */
+#define PREFIX_NONE				UINT32_MAX
+#define PREFIX_V4_BITS			96			/* Of the IPv4-mapped prefix. */
+#define PREFIX_DEFAULT_V4_LEN	24
+#define PREFIX_DEFAULT_V6_LEN	48
+
+/* An address and the first of the names resolving to it. */
+struct prefix_leaf {
+	uint8_t addr[16];
+	uint32_t names;
+	uint32_t count;
+};
+
+struct prefix_node {
+	uint32_t bit;
+	uint32_t child[2];
+};
+
+/* A name resolving to an address, and the next one to it. */
+struct prefix_name {
+	const char *name;
+	uint32_t len;
+	uint32_t next;
+	request_type type;
+};
+
+struct prefix_tree {
+	uint32_t root;
+	struct prefix_node *nodes;
+	struct prefix_leaf *leaves;
+	struct prefix_name *names;
+	size_t nnodes, nleaves, nnames, size;
+};
+
+static const uint8_t v4_mapped[12] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+static inline int
+key_bit (const uint8_t *key, unsigned bit) {
+	return (key[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+/* Whether the first LEN bits of A and B are the same. */
+static int
+same_prefix (const uint8_t *a, const uint8_t *b, unsigned len) {
+	if (memcmp (a, b, len / 8) != 0)
+		return 0;
+	if (len % 8 == 0)
+		return 1;
+	uint8_t mask = 0xff << (8 - len % 8);
+	return ((a[len / 8] ^ b[len / 8]) & mask) == 0;
+}
+
+/* Make room for one more node, leaf and name. */
+static int
+tree_reserve (struct prefix_tree *t) {
+	if (t->nnames < t->size)
+		return 0;
+
+	size_t size = t->size ? 2 * t->size : 4096;
+	if (size >= PREFIX_LEAF)
+		return -1;
+	struct prefix_node *nodes = realloc (t->nodes, size * sizeof (*nodes));
+	if (nodes == NULL)
+		return -1;
+	t->nodes = nodes;
+	struct prefix_leaf *leaves = realloc (t->leaves, size * sizeof (*leaves));
+	if (leaves == NULL)
+		return -1;
+	t->leaves = leaves;
+	struct prefix_name *names = realloc (t->names, size * sizeof (*names));
+	if (names == NULL)
+		return -1;
+	t->names = names;
+	t->size = size;
+	return 0;
+}
+
+/* The leaf reached from the root by the bits of KEY. */
+static struct prefix_leaf *
+tree_descend (struct prefix_tree *t, const uint8_t *key) {
+	uint32_t ref = t->root;
+
+	while (!(ref & PREFIX_LEAF))
+		ref = t->nodes[ref].child[key_bit (key, t->nodes[ref].bit)];
+	return &t->leaves[ref & ~PREFIX_LEAF];
+}
+
+/* Add NAME of LEN bytes, from a record of TYPE, to the 16 byte address
+   ADDR.
+ */
+static int
+tree_insert (struct prefix_tree *t, const uint8_t *addr, const char *name,
+			 uint32_t len, request_type type) {
+	if (tree_reserve (t) != 0)
+		return -1;
+
+	struct prefix_leaf *leaf = NULL;
+	unsigned bit = 128;
+	if (t->root != PREFIX_NONE) {
+		leaf = tree_descend (t, addr);
+		for (bit = 0; bit < 128; bit++)
+			if (key_bit (leaf->addr, bit) != key_bit (addr, bit))
+				break;
+	}
+
+	if (bit < 128 || t->root == PREFIX_NONE) {
+		uint32_t ref = t->nleaves++ | PREFIX_LEAF;
+
+		leaf = &t->leaves[ref & ~PREFIX_LEAF];
+		memcpy (leaf->addr, addr, sizeof (leaf->addr));
+		leaf->names = PREFIX_NONE;
+		leaf->count = 0;
+
+		/* Hang the leaf where the first differing bit goes. */
+		uint32_t *where = &t->root;
+		while (   *where != PREFIX_NONE && !(*where & PREFIX_LEAF)
+			   && t->nodes[*where].bit < bit)
+			where = &t->nodes[*where].child[key_bit (addr,
+													  t->nodes[*where].bit)];
+		if (*where == PREFIX_NONE)
+			*where = ref;
+		else {
+			struct prefix_node *node = &t->nodes[t->nnodes];
+
+			node->bit = bit;
+			node->child[key_bit (addr, bit)] = ref;
+			node->child[!key_bit (addr, bit)] = *where;
+			*where = t->nnodes++;
+		}
+	}
+
+	struct prefix_name *n = &t->names[t->nnames];
+	n->name = name;
+	n->len = len;
+	n->type = type;
+	n->next = leaf->names;
+	leaf->names = t->nnames++;
+	leaf->count++;
+	return 0;
+}
+
+/* Add the addresses of the record HE points to. */
+static int
+index_record (struct prefix_tree *t, const char *data, struct hashentry *he) {
+	struct datahead *dh = (struct datahead *) (data + he->packet);
+	const char *name = data + he->key;
+	uint32_t len = he->len;
+	uint8_t addr[16];
+
+	if (dh->notfound)
+		return 0;
+
+	if (he->type == GETAI) {
+		struct ai_view view;
+
+		if (decode_ai (dh, &view) != 0)
+			return 0;
+		const uint8_t *a = view.addrs;
+		for (nscd_ssize_t i = 0; i < view.resp->naddrs; i++) {
+			if (view.families[i] == AF_INET6)
+				memcpy (addr, a, 16);
+			else {
+				memcpy (addr, v4_mapped, 12);
+				memcpy (addr + 12, a, 4);
+			}
+			if (tree_insert (t, addr, name, len, he->type) != 0)
+				return -1;
+			a += ai_addr_len (view.families[i]);
+		}
+		return 0;
+	}
+
+	if (   he->type != GETHOSTBYNAME && he->type != GETHOSTBYNAMEv6
+		&& he->type != GETHOSTBYADDR && he->type != GETHOSTBYADDRv6)
+		return 0;
+
+	struct hst_view view;
+	if (   decode_hst (dh, &view) != 0
+		|| (view.resp->h_length != 4 && view.resp->h_length != 16))
+		return 0;
+	if (he->type == GETHOSTBYADDR || he->type == GETHOSTBYADDRv6) {
+		name = view.name;
+		len = view.resp->h_name_len;
+	}
+	for (nscd_ssize_t i = 0; i < view.resp->h_addr_list_cnt; i++) {
+		const uint8_t *a = view.addrs + i * view.resp->h_length;
+
+		if (view.resp->h_length == 16)
+			memcpy (addr, a, 16);
+		else {
+			memcpy (addr, v4_mapped, 12);
+			memcpy (addr + 12, a, 4);
+		}
+		if (tree_insert (t, addr, name, len, he->type) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+build_tree (struct db_file *db, struct prefix_tree *t) {
+	struct database_pers_head *head = db->mem;
+
+	/* Empty even on failure, for the caller to free. */
+	memset (t, 0, sizeof (*t));
+	t->root = PREFIX_NONE;
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	char *data = db_data (head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+
+			if (he->first && index_record (t, data, he) != 0) {
+				fprintf (stderr, "Memory allocation failure\n");
+				return -1;
+			}
+			run = he->next;
+		}
+	return 0;
+}
+
+static void
+free_tree (struct prefix_tree *t) {
+	free (t->nodes);
+	free (t->leaves);
+	free (t->names);
+}
+
+/* Format ADDR, IPv4-mapped ones as IPv4, with LEN bits of prefix unless
+   LEN is 128.
+ */
+static const char *
+format_addr (const uint8_t *addr, unsigned len, char *buf, size_t size) {
+	char text[INET6_ADDRSTRLEN];
+	int v4 = memcmp (addr, v4_mapped, sizeof (v4_mapped)) == 0;
+
+	if (v4) {
+		inet_ntop (AF_INET, addr + 12, text, sizeof (text));
+		len -= PREFIX_V4_BITS;
+	} else
+		inet_ntop (AF_INET6, addr, text, sizeof (text));
+	if (len == (v4 ? 32u : 128u))
+		snprintf (buf, size, "%s", text);
+	else
+		snprintf (buf, size, "%s/%u", text, len);
+	return buf;
+}
+
+/* Parse the prefix TEXT, an IPv4 or IPv6 address with an optional
+   length, into the 16 byte ADDR and its length in bits.
+ */
+static int
+parse_prefix (const char *text, uint8_t *addr, unsigned *len) {
+	char buf[INET6_ADDRSTRLEN + 8];
+	char *slash, *end;
+
+	snprintf (buf, sizeof (buf), "%s", text);
+	slash = strchr (buf, '/');
+	if (slash != NULL)
+		*slash++ = '\0';
+
+	unsigned max;
+	memset (addr, 0, 16);
+	if (inet_pton (AF_INET, buf, addr + 12) == 1) {
+		memcpy (addr, v4_mapped, sizeof (v4_mapped));
+		max = 32;
+	} else if (inet_pton (AF_INET6, buf, addr) == 1)
+		max = 128;
+	else
+		return -1;
+
+	*len = max;
+	if (slash != NULL) {
+		unsigned long n = strtoul (slash, &end, 10);
+
+		if (*slash == '\0' || *end != '\0' || n > max)
+			return -1;
+		*len = n;
+	}
+	if (max == 32)
+		*len += PREFIX_V4_BITS;
+
+	/* Host bits set are ignored. */
+	for (unsigned bit = *len; bit < 128; bit++)
+		addr[bit / 8] &= ~(0x80 >> (bit % 8));
+	return 0;
+}
+
+struct walk_totals {
+	unsigned long addrs, names;
+};
+
+/* Print the addresses under REF with their names. */
+static void
+print_subtree (struct prefix_tree *t, uint32_t ref, struct walk_totals *w) {
+	if (!(ref & PREFIX_LEAF)) {
+		print_subtree (t, t->nodes[ref].child[0], w);
+		print_subtree (t, t->nodes[ref].child[1], w);
+		return;
+	}
+
+	struct prefix_leaf *leaf = &t->leaves[ref & ~PREFIX_LEAF];
+	char buf[INET6_ADDRSTRLEN + 8];
+
+	format_addr (leaf->addr, 128, buf, sizeof (buf));
+	for (uint32_t i = leaf->names; i != PREFIX_NONE; i = t->names[i].next) {
+		struct prefix_name *n = &t->names[i];
+
+		printf ("%-39s %-17s %.*s\n", buf, serv2str[n->type],
+				(int) strnlen (n->name, n->len), n->name);
+	}
+	w->addrs++;
+	w->names += leaf->count;
+}
+
+/* Print the names in DB resolving into the prefix CIDR. */
+int
+prefix_db (struct db_file *db, const char *cidr) {
+	struct prefix_tree t;
+	uint8_t addr[16];
+	unsigned len;
+
+	if (parse_prefix (cidr, addr, &len) != 0) {
+		fprintf (stderr, "Invalid prefix \"%s\"\n", cidr);
+		return -1;
+	}
+	if (build_tree (db, &t) != 0) {
+		free_tree (&t);
+		return -1;
+	}
+
+	/* Descend while the nodes test bits within the prefix.  The
+	   addresses under the node reached agree on all the bits before
+	   its own, so either all of them or none are in the prefix, and
+	   those elsewhere differ from it in a bit tested on the way.
+	 */
+	struct walk_totals w = { 0, 0 };
+	uint32_t ref = t.root;
+	while (   ref != PREFIX_NONE && !(ref & PREFIX_LEAF)
+		   && t.nodes[ref].bit < len)
+		ref = t.nodes[ref].child[key_bit (addr, t.nodes[ref].bit)];
+	if (ref != PREFIX_NONE) {
+		uint32_t r = ref;
+
+		while (!(r & PREFIX_LEAF))
+			r = t.nodes[r].child[0];
+		if (same_prefix (t.leaves[r & ~PREFIX_LEAF].addr, addr, len))
+			print_subtree (&t, ref, &w);
+	}
+
+	char buf[INET6_ADDRSTRLEN + 8];
+	printf ("%lu names, %lu addresses in %s (%zu addresses indexed)\n",
+			w.names, w.addrs, format_addr (addr, len, buf, sizeof (buf)),
+			t.nleaves);
+	free_tree (&t);
+	return 0;
+}
+
+struct aggregate {
+	unsigned v4_len, v6_len;
+	uint8_t addr[16];
+	unsigned len;
+	unsigned long addrs, names;
+	unsigned long prefixes;
+};
+
+static void
+flush_group (struct aggregate *a) {
+	char buf[INET6_ADDRSTRLEN + 8];
+
+	if (a->addrs == 0)
+		return;
+	printf ("%-43s %9lu %9lu\n", format_addr (a->addr, a->len, buf,
+											  sizeof (buf)),
+			a->addrs, a->names);
+	a->prefixes++;
+	a->addrs = a->names = 0;
+}
+
+/* Count the addresses under REF by prefix, in address order. */
+static void
+aggregate_subtree (struct prefix_tree *t, uint32_t ref, struct aggregate *a) {
+	if (!(ref & PREFIX_LEAF)) {
+		aggregate_subtree (t, t->nodes[ref].child[0], a);
+		aggregate_subtree (t, t->nodes[ref].child[1], a);
+		return;
+	}
+
+	struct prefix_leaf *leaf = &t->leaves[ref & ~PREFIX_LEAF];
+	unsigned len = memcmp (leaf->addr, v4_mapped, sizeof (v4_mapped)) == 0
+		? PREFIX_V4_BITS + a->v4_len : a->v6_len;
+	if (a->addrs == 0 || len != a->len || !same_prefix (leaf->addr, a->addr,
+														 len)) {
+		flush_group (a);
+		memset (a->addr, 0, sizeof (a->addr));
+		memcpy (a->addr, leaf->addr, len / 8);
+		if (len % 8 != 0)
+			a->addr[len / 8] = leaf->addr[len / 8] & (0xff << (8 - len % 8));
+		a->len = len;
+	}
+	a->addrs++;
+	a->names += leaf->count;
+}
+
+/* Print the number of addresses and names of DB by prefix, of V4_LEN
+   bits for IPv4 and V6_LEN for IPv6 (0 for the defaults).
+ */
+int
+aggregate_db (struct db_file *db, unsigned v4_len, unsigned v6_len) {
+	struct prefix_tree t;
+	struct aggregate a;
+
+	memset (&a, 0, sizeof (a));
+	a.v4_len = v4_len ? v4_len : PREFIX_DEFAULT_V4_LEN;
+	a.v6_len = v6_len ? v6_len : PREFIX_DEFAULT_V6_LEN;
+	if (a.v4_len > 32 || a.v6_len > 128) {
+		fprintf (stderr, "Prefix lengths are at most 32 and 128 bits\n");
+		return -1;
+	}
+	if (build_tree (db, &t) != 0) {
+		free_tree (&t);
+		return -1;
+	}
+
+	printf ("%-43s %9s %9s\n", "Prefix", "Addresses", "Names");
+	if (t.root != PREFIX_NONE)
+		aggregate_subtree (&t, t.root, &a);
+	flush_group (&a);
+	printf ("\n%lu prefixes, %zu addresses, %zu names\n", a.prefixes,
+			t.nleaves, t.nnames);
+	free_tree (&t);
+	return 0;
+}
@@ -0,0 +1,123 @@
+/* Progress reporting for long verification and dump runs.
+
+   The hot loops only decrement a countdown once per bucket and once per
+   entry, so that a single long chain is reported on too; every
+   PROGRESS_INTERVAL of them progress_poll () looks whether a report is
+   due, either because --progress asked for one per second or because
+   SIGUSR1 arrived.  Reports go to stderr so they never mix with the
+   dump.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nscd_dump.h"
+
+/* Seconds between two periodic reports. */
+#define PROGRESS_PERIOD		1.0
+
+struct progress_state progress = {
+	.countdown = PROGRESS_INTERVAL
+};
+
+static double
+now_seconds (void) {
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sigusr1_handler (int sig) {
+	progress.requested = 1;
+}
+
+/* Enable periodic reports if PERIODIC, and reports on SIGUSR1 always. */
+void
+progress_init (int periodic) {
+	struct sigaction sa;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = sigusr1_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGUSR1, &sa, NULL);
+
+	progress.periodic = periodic;
+}
+
+/* Start reporting on PHASE over the buckets and entries of HEAD. */
+void
+progress_start (const char *phase, const struct database_pers_head *head) {
+	progress.phase = phase;
+	progress.buckets = head->module;
+	progress.entries = head->nentries;
+	progress.countdown = PROGRESS_INTERVAL;
+	progress.start = progress.last = now_seconds ();
+}
+
+static void
+format_eta (char *buf, size_t size, double seconds) {
+	if (seconds < 0 || seconds > 1e7)
+		snprintf (buf, size, "unknown");
+	else if (seconds < 120)
+		snprintf (buf, size, "%.1f s", seconds);
+	else
+		snprintf (buf, size, "%d:%02d min", (int) seconds / 60,
+				  (int) seconds % 60);
+}
+
+/* Slow path of progress_tick (). */
+void
+progress_poll (nscd_ssize_t bucket, nscd_ssize_t entries, size_t bytes) {
+	progress.countdown = PROGRESS_INTERVAL;
+	if (!progress.periodic && !progress.requested)
+		return;
+
+	double now = now_seconds ();
+	if (!progress.requested && now - progress.last < PROGRESS_PERIOD)
+		return;
+	progress.requested = 0;
+	progress.last = now;
+
+	/* Entries are the better measure of the remaining work when chains
+	   are skewed, buckets when the header count is off.
+	 */
+	double elapsed = now - progress.start;
+	double done = progress.entries > 0
+		? MIN ((double) entries / progress.entries, 1.0)
+		: (double) bucket / progress.buckets;
+	char eta[32];
+	format_eta (eta, sizeof (eta),
+				done > 0 ? elapsed * (1 - done) / done : -1);
+
+	fprintf (stderr, "%s: %d/%d buckets, %d/%d entries, %.1f MB/s, ETA %s\n",
+			 progress.phase, bucket, progress.buckets,
+			 entries, progress.entries,
+			 elapsed > 0 ? bytes / elapsed / 1e6 : 0.0, eta);
+}
+
+/* Final report of the phase, only when reports were asked for. */
+void
+progress_finish (nscd_ssize_t entries, size_t bytes) {
+	if (!progress.periodic)
+		return;
+
+	double elapsed = now_seconds () - progress.start;
+	fprintf (stderr, "%s: done, %d entries in %.3f s, %.1f MB/s\n",
+			 progress.phase, entries, elapsed,
+			 elapsed > 0 ? bytes / elapsed / 1e6 : 0.0);
+}
@@ -0,0 +1,185 @@
+/* Report of reloads without use.
+
+   When a record times out, nscd asks the name service again and keeps
+   the answer, counting in datahead.nreloads the reloads since the
+   record was last used; a record reloaded reload-count times without
+   use is dropped at its next timeout instead.  Every such reload is a
+   query sent upstream for nothing.
+
+   The report gives the distribution of nreloads by type, positive and
+   negative, lists records at the limit, and estimates the queries
+   wasted per hour: every record reloaded at least once but not yet at
+   the limit will be reloaded again once per time to live.  The file
+   does not record the time to live of a record, so the defaults of the
+   nscd.conf shipped with glibc are assumed for its database.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+
+#include "nscd_dump.h"
+
+#define RELOADS_DEFAULT_LIMIT	5		/* reload-count of nscd. */
+#define RELOADS_MAX_LIMIT		254
+#define RELOADS_LIST			20
+
+/* Positive and negative time to live of the database of a type, in
+   seconds, as in the default nscd.conf.
+ */
+static void
+default_ttl (request_type type, unsigned ttl[2]) {
+	switch (type) {
+	case GETPWBYNAME:
+	case GETPWBYUID:
+		ttl[0] = 600;
+		ttl[1] = 20;
+		break;
+	case GETGRBYNAME:
+	case GETGRBYGID:
+	case INITGROUPS:
+		ttl[0] = 3600;
+		ttl[1] = 60;
+		break;
+	default:
+		ttl[0] = 3600;
+		ttl[1] = 20;
+		break;
+	}
+}
+
+struct reload_stats {
+	unsigned limit;
+	/* By type and negative, nreloads up to LIMIT, the last bucket
+	   holding those at or above it.
+	 */
+	unsigned long (*counts)[2][RELOADS_MAX_LIMIT + 1];
+	unsigned long long reloads;
+	double per_hour;
+	unsigned listed;
+};
+
+static void
+print_key (struct hashentry *he, const char *key) {
+	char buf[INET6_ADDRSTRLEN];
+
+	if (he->type == GETHOSTBYADDR || he->type == GETHOSTBYADDRv6)
+		printf ("%s", inet_ntop (he->type == GETHOSTBYADDRv6
+								 ? AF_INET6 : AF_INET, key, buf,
+								 sizeof (buf)));
+	else
+		printf ("%.*s", (int) MAX (he->len - 1, 0), key);
+}
+
+static void
+count_record (struct reload_stats *s, const char *data, struct hashentry *he) {
+	struct datahead *dh = (struct datahead *) (data + he->packet);
+	unsigned n = MIN (dh->nreloads, s->limit);
+	unsigned ttl[2];
+
+	s->counts[he->type][dh->notfound != 0][n]++;
+	s->reloads += dh->nreloads;
+
+	default_ttl (he->type, ttl);
+	if (n > 0 && n < s->limit)
+		s->per_hour += 3600.0 / ttl[dh->notfound != 0];
+
+	if (n == s->limit && s->listed < RELOADS_LIST) {
+		if (s->listed++ == 0)
+			printf ("Records at the reload limit:\n");
+		printf ("  %-17s %s, %u reloads  \"", serv2str[he->type],
+				dh->notfound ? "negative" : "positive", dh->nreloads);
+		print_key (he, data + he->key);
+		printf ("\"\n");
+	}
+}
+
+/* Report the reloads without use in DB, LIMIT being the reload-count
+   of nscd (0 for its default).
+ */
+int
+reloads_db (struct db_file *db, unsigned limit) {
+	struct database_pers_head *head = db->mem;
+	struct reload_stats s;
+
+	if (limit == 0)
+		limit = RELOADS_DEFAULT_LIMIT;
+	if (limit > RELOADS_MAX_LIMIT) {
+		fprintf (stderr, "The reload count is at most %u\n",
+				 RELOADS_MAX_LIMIT);
+		return -1;
+	}
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	memset (&s, 0, sizeof (s));
+	s.limit = limit;
+	s.counts = calloc (LASTREQ, sizeof (*s.counts));
+	if (s.counts == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	/* A record is counted through the entry of its main key. */
+	char *data = db_data (head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+
+			if (he->first)
+				count_record (&s, data, he);
+			run = he->next;
+		}
+	if (s.listed != 0)
+		printf ("\n");
+
+	printf ("%-17s %-8s %8s", "Type", "Answer", "Records");
+	for (unsigned n = 0; n < limit; n++)
+		printf (" %6u", n);
+	printf (" %5u+\n", limit);
+
+	unsigned long records = 0, reloaded = 0, at_limit = 0;
+	for (int type = 0; type < LASTREQ; type++)
+		for (int neg = 0; neg < 2; neg++) {
+			unsigned long *c = s.counts[type][neg];
+			unsigned long total = 0;
+
+			for (unsigned n = 0; n <= limit; n++)
+				total += c[n];
+			if (total == 0)
+				continue;
+
+			printf ("%-17s %-8s %8lu", serv2str[type],
+					neg ? "negative" : "positive", total);
+			for (unsigned n = 0; n <= limit; n++)
+				printf (" %6lu", c[n]);
+			printf ("\n");
+			records += total;
+			reloaded += total - c[0];
+			at_limit += c[limit];
+		}
+
+	printf ("\nRecords reloaded w/o use  : %lu of %lu, %lu at the limit"
+			" of %u\n", reloaded, records, at_limit, limit);
+	printf ("Reloads w/o use so far    : %llu\n", s.reloads);
+	printf ("Wasted queries per hour   : %.0f (default nscd.conf time to"
+			" live)\n", s.per_hour);
+
+	free (s.counts);
+	return 0;
+}
@@ -0,0 +1,155 @@
+/* Page cache residency of a database.
+
+   mincore () is asked which pages of the file are resident before
+   anything but the header is read, then the database is verified and
+   walked to report the resident fraction of the bucket array, of the
+   hash entries and of the packets, and how many cold pages an average
+   lookup would fault in.  The kernel only reports the page cache of
+   files the caller could write to; for others it reports the pages
+   mapped by this process, none.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "nscd_dump.h"
+
+struct residency {
+	const unsigned char *vec;
+	size_t page_size;
+	/* Bytes resident and total, by region. */
+	unsigned long long he_in, he_all, packet_in, packet_all;
+	/* Lookups and the cold pages they touch. */
+	unsigned long long lookups, cold, cold_lookups;
+	unsigned max_cold;
+};
+
+/* Bytes of the LEN at file offset OFF in resident pages. */
+static size_t
+resident_bytes (const struct residency *r, size_t off, size_t len) {
+	size_t end = off + len, in = 0;
+
+	while (off < end) {
+		size_t page = off / r->page_size;
+		size_t chunk = MIN (end, (page + 1) * r->page_size) - off;
+
+		if (r->vec[page] & 1)
+			in += chunk;
+		off += chunk;
+	}
+	return in;
+}
+
+static void
+count_lookup (nscd_ssize_t bucket, struct hashentry *he, unsigned units,
+			  void *arg) {
+	struct residency *r = arg;
+
+	r->lookups++;
+	r->cold += units;
+	r->cold_lookups += units != 0;
+	if (units > r->max_cold)
+		r->max_cold = units;
+}
+
+static double
+percent (unsigned long long part, unsigned long long all) {
+	return all ? 100.0 * part / all : 0;
+}
+
+int
+residency_db (struct db_file *db) {
+	struct database_pers_head *head = db->mem;
+	size_t size = db->st.st_size;
+	struct residency r;
+
+	memset (&r, 0, sizeof (r));
+	r.page_size = sysconf (_SC_PAGESIZE);
+
+	/* Before the verifier faults everything in. */
+	size_t npages = (size + r.page_size - 1) / r.page_size;
+	unsigned char *vec = malloc (npages);
+	if (vec == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+	if (mincore (db->mem, size, vec) != 0) {
+		fprintf (stderr, "mincore() error on database file \"%s\": %s\n",
+				 db->name, strerror (errno));
+		free (vec);
+		return -1;
+	}
+	r.vec = vec;
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		free (vec);
+		return -1;
+	}
+
+	char *data = db_data (head);
+	size_t data_off = data - (char *) db->mem;
+	uint8_t *seen = calloc (head->first_free / BLOCK_ALIGN / 8 + 1, 1);
+	if (seen == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		free (vec);
+		return -1;
+	}
+
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+			struct datahead *dh = (struct datahead *) (data + he->packet);
+
+			r.he_in += resident_bytes (&r, data_off + run, sizeof (*he));
+			r.he_all += sizeof (*he);
+			if (!test_and_set (seen, he->packet / BLOCK_ALIGN)) {
+				r.packet_in += resident_bytes (&r, data_off + he->packet,
+											   dh->allocsize);
+				r.packet_all += dh->allocsize;
+			}
+			run = he->next;
+		}
+	free (seen);
+
+	int rc = footprint_walk (db->mem, r.page_size, vec, count_lookup, &r);
+	if (rc != 0)
+		fprintf (stderr, "Memory allocation failure\n");
+
+	size_t resident = 0;
+	for (size_t i = 0; i < npages; i++)
+		resident += vec[i] & 1;
+
+	printf ("Resident pages            : %zu of %zu (%.1f%%)\n",
+			resident, npages, percent (resident, npages));
+	printf ("Header and bucket array   : %.1f%% resident\n",
+			percent (resident_bytes (&r, 0, data_off), data_off));
+	printf ("Hash entries              : %.1f%% resident\n",
+			percent (r.he_in, r.he_all));
+	printf ("Packets                   : %.1f%% resident\n",
+			percent (r.packet_in, r.packet_all));
+	if (rc == 0 && r.lookups != 0)
+		printf ("Cold pages per lookup     : %.2f average, %u at most;"
+				" %.1f%% of %llu lookups fault\n",
+				(double) r.cold / r.lookups, r.max_cold,
+				percent (r.cold_lookups, r.lookups), r.lookups);
+
+	free (vec);
+	return rc;
+}
@@ -0,0 +1,154 @@
+/* Order-independent set digest of a database.
+
+   The digest of a cache is the sum of the entry digests of
+   fingerprint.c, so it equals the semantic fingerprint and does not
+   depend on the module, the chain order or the layout of the data
+   area.  Comparing two hosts is then a comparison of two numbers.  Sub
+   digests by record type and by range of the key hash localize a
+   difference before a full diff: the ranges split the 32-bit bucket
+   hash of the key, not the buckets, so that they line up between
+   caches of different modules.
+
+   Bucket ranges are handed to threads, each summing into sub digests
+   of its own that are added up at the end; addition being commutative,
+   the result does not depend on the split.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "nscd_dump.h"
+
+#define SET_DIGEST_DEFAULT_RANGES	16
+#define SET_DIGEST_MAX_RANGES		65536
+
+struct sub_digest {
+	uint64_t sum;
+	unsigned long long count;
+};
+
+struct set_digest {
+	struct database_pers_head *head;
+	const char *data;
+	unsigned nranges;
+	/* For each thread, LASTREQ sub digests by type followed by NRANGES
+	   by key hash range.
+	 */
+	struct sub_digest *subs;
+};
+
+static inline struct sub_digest *
+thread_subs (const struct set_digest *sd, unsigned index) {
+	return sd->subs + (size_t) index * (LASTREQ + sd->nranges);
+}
+
+static void
+digest_buckets (size_t begin, size_t end, unsigned index, void *arg) {
+	struct set_digest *sd = arg;
+	struct sub_digest *by_type = thread_subs (sd, index);
+	struct sub_digest *by_range = by_type + LASTREQ;
+
+	for (size_t cnt = begin; cnt < end; ++cnt)
+		for (ref_t run = sd->head->array[cnt]; run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (sd->data + run);
+			uint64_t digest = entry_digest (sd->data, he);
+			uint32_t hash = nscd_hash (sd->data + he->key, he->len);
+			unsigned range = (uint64_t) hash * sd->nranges >> 32;
+
+			by_type[he->type].sum += digest;
+			by_type[he->type].count++;
+			by_range[range].sum += digest;
+			by_range[range].count++;
+			run = he->next;
+		}
+}
+
+/* Print the set digest of DB with sub digests for NRANGES ranges of the
+   key hash (0 for the default), computed by THREADS threads (0 for one
+   per CPU).
+ */
+int
+set_digest_db (struct db_file *db, unsigned nranges, unsigned threads) {
+	struct database_pers_head *head = db->mem;
+	struct set_digest sd;
+
+	if (nranges == 0)
+		nranges = SET_DIGEST_DEFAULT_RANGES;
+	if (nranges > SET_DIGEST_MAX_RANGES) {
+		fprintf (stderr, "At most %u ranges\n", SET_DIGEST_MAX_RANGES);
+		return -1;
+	}
+	if (threads == 0)
+		threads = available_cpus ();
+	/* The pacing state of gentle mode is not shared between threads. */
+	if (gentle.enabled)
+		threads = 1;
+
+	struct exec_plan plan = default_plan;
+	plan.threads = threads;
+	const char *msg = verify_persistent_db_plan (db->mem, &db->head, &plan);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	sd.head = head;
+	sd.data = db_data (head);
+	sd.nranges = nranges;
+	sd.subs = calloc ((size_t) threads * (LASTREQ + nranges),
+					  sizeof (*sd.subs));
+	if (sd.subs == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	parallel_for (threads, head->module, digest_buckets, &sd);
+
+	struct sub_digest *total = thread_subs (&sd, 0), all = { 0, 0 };
+	for (unsigned t = 1; t < threads; t++) {
+		struct sub_digest *subs = thread_subs (&sd, t);
+
+		for (unsigned i = 0; i < LASTREQ + nranges; i++) {
+			total[i].sum += subs[i].sum;
+			total[i].count += subs[i].count;
+		}
+	}
+	for (unsigned i = 0; i < LASTREQ; i++) {
+		all.sum += total[i].sum;
+		all.count += total[i].count;
+	}
+
+	printf ("Set digest                : %016llx (%llu entries)\n",
+			(unsigned long long) all.sum, all.count);
+	printf ("\nBy type:\n");
+	for (unsigned i = 0; i < LASTREQ; i++)
+		if (total[i].count != 0)
+			printf ("  %-23s : %016llx (%llu entries)\n", serv2str[i],
+					(unsigned long long) total[i].sum, total[i].count);
+
+	printf ("\nBy key hash range:\n");
+	for (unsigned i = 0; i < nranges; i++) {
+		struct sub_digest *sub = &total[LASTREQ + i];
+		/* The hashes H with H * nranges >> 32 == I. */
+		uint32_t first = (((uint64_t) i << 32) + nranges - 1) / nranges;
+		uint32_t last = ((((uint64_t) i + 1) << 32) + nranges - 1) / nranges
+			- 1;
+
+		printf ("  %08x-%08x       : %016llx (%llu entries)\n", first, last,
+				(unsigned long long) sub->sum, sub->count);
+	}
+
+	free (sd.subs);
+	return 0;
+}
@@ -0,0 +1,399 @@
+/* Deduplicated store of database snapshots.
+
+   Successive snapshots of a cache share most of their bytes, but not
+   at fixed offsets: records come and go and shift what follows.  The
+   live part of a snapshot (header, bucket array and data up to
+   first_free) is therefore cut into chunks at content-defined
+   boundaries, found with a gear rolling hash, so that an insertion only
+   changes the chunks around it.  Each chunk is stored once under its
+   128-bit hash in DIR/chunks, and a manifest in DIR/manifests lists the
+   chunks of a snapshot in order.  The rest of the file is recorded as
+   its length when it is zero, as nscd leaves it, and chunked otherwise.
+
+   Restoring concatenates the chunks of a manifest, checking the hash
+   of each and the digest of the whole file, and leaves a zero tail as
+   a hole.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "nscd_dump.h"
+
+/* Chunk sizes: boundaries are looked for after the minimum, are forced
+   at the maximum, and come every 2^STORE_CHUNK_BITS bytes on average.
+ */
+#define STORE_CHUNK_MIN		2048
+#define STORE_CHUNK_MAX		65536
+#define STORE_CHUNK_BITS	13
+
+#define STORE_MANIFEST_MAGIC	"nscd_dump store manifest 1"
+
+/* Seeds of the two halves of the chunk hash and of the file digest. */
+#define CHUNK_SEED_LO		0x73746f72655f6c6fULL
+#define CHUNK_SEED_HI		0x73746f72655f6869ULL
+#define FILE_SEED			0x73746f72655f6669ULL
+
+struct chunk_id {
+	uint64_t hi, lo;
+};
+
+struct store_stats {
+	unsigned long chunks, new_chunks;
+	unsigned long long bytes, new_bytes;
+};
+
+static uint64_t gear[256];
+
+/* Pseudo-random but fixed gear table, from splitmix64. */
+static void
+gear_init (void) {
+	uint64_t x = 0;
+
+	if (gear[0] != 0)
+		return;
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/* Length of the chunk starting at P, at most LEN bytes long. */
+static size_t
+chunk_length (const uint8_t *p, size_t len) {
+	/* The top bits depend on the most recent 64 bytes. */
+	const uint64_t mask = ((1ULL << STORE_CHUNK_BITS) - 1)
+		<< (64 - STORE_CHUNK_BITS);
+	size_t max = MIN (len, STORE_CHUNK_MAX);
+	uint64_t h = 0;
+
+	if (len <= STORE_CHUNK_MIN)
+		return len;
+	for (size_t i = STORE_CHUNK_MIN; i < max; i++) {
+		h = (h << 1) + gear[p[i]];
+		if ((h & mask) == 0)
+			return i + 1;
+	}
+	return max;
+}
+
+static struct chunk_id
+chunk_hash (const void *p, size_t len) {
+	struct chunk_id id = {
+		xxh64 (p, len, CHUNK_SEED_HI), xxh64 (p, len, CHUNK_SEED_LO)
+	};
+	return id;
+}
+
+static void
+chunk_path (char *path, size_t size, const char *dir,
+			const struct chunk_id *id) {
+	snprintf (path, size, "%s/chunks/%02x/%016llx%016llx", dir,
+			  (unsigned) (id->hi >> 56), (unsigned long long) id->hi,
+			  (unsigned long long) id->lo);
+}
+
+static int
+make_dir (const char *path) {
+	if (mkdir (path, 0755) != 0 && errno != EEXIST) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n", path, strerror (errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Write LEN bytes at P to PATH through a temporary file, synced
+   before it is renamed, so that it either exists whole or not at all,
+   even after a crash.
+ */
+int
+write_atomic (const char *path, const void *p, size_t len) {
+	char tmp[PATH_MAX];
+
+	snprintf (tmp, sizeof (tmp), "%s.XXXXXX", path);
+	int fd = mkstemp (tmp);
+	if (fd == -1) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n", tmp, strerror (errno));
+		return -1;
+	}
+
+	int rc = write (fd, p, len) == (ssize_t) len ? 0 : -1;
+	if (rc == 0 && fsync (fd) != 0)
+		rc = -1;
+	if (close (fd) != 0)
+		rc = -1;
+	if (rc == 0 && rename (tmp, path) != 0)
+		rc = -1;
+	if (rc != 0) {
+		fprintf (stderr, "Cannot write \"%s\": %s\n", path, strerror (errno));
+		unlink (tmp);
+	}
+	return rc;
+}
+
+/* Store the chunk of LEN bytes at P unless already there, and list it
+   in the manifest.  One of the wrong size, cut short by a crash before
+   chunks were synced, is written again.
+ */
+static int
+store_chunk (const char *dir, const uint8_t *p, size_t len, FILE *manifest,
+			 struct store_stats *stats) {
+	struct chunk_id id = chunk_hash (p, len);
+	char path[PATH_MAX];
+	struct stat st;
+
+	chunk_path (path, sizeof (path), dir, &id);
+	stats->chunks++;
+	stats->bytes += len;
+	if (stat (path, &st) != 0 || st.st_size != (off_t) len) {
+		char sub[PATH_MAX];
+
+		snprintf (sub, sizeof (sub), "%s/chunks/%02x", dir,
+				  (unsigned) (id.hi >> 56));
+		if (make_dir (sub) != 0 || write_atomic (path, p, len) != 0)
+			return -1;
+		stats->new_chunks++;
+		stats->new_bytes += len;
+	}
+
+	fprintf (manifest, "chunk %016llx%016llx %zu\n",
+			 (unsigned long long) id.hi, (unsigned long long) id.lo, len);
+	return 0;
+}
+
+static int
+store_region (const char *dir, const uint8_t *p, size_t len, FILE *manifest,
+			  struct store_stats *stats) {
+	while (len > 0) {
+		size_t n = chunk_length (p, len);
+
+		if (store_chunk (dir, p, n, manifest, stats) != 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int
+all_zero (const uint8_t *p, size_t len) {
+	return len == 0 || (p[0] == 0 && memcmp (p, p + 1, len - 1) == 0);
+}
+
+/* Add a snapshot of DB to the store in DIR. */
+int
+store_db (struct db_file *db, const char *dir) {
+	struct database_pers_head *head = db->mem;
+	const uint8_t *mem = db->mem;
+	size_t size = db->st.st_size;
+	char path[PATH_MAX], name[64];
+
+	/* The header has to be sane for the live data to lie in the file. */
+	const char *msg = verify_db_header (head, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	snprintf (path, sizeof (path), "%s/chunks", dir);
+	if (make_dir (dir) != 0 || make_dir (path) != 0)
+		return -1;
+	snprintf (path, sizeof (path), "%s/manifests", dir);
+	if (make_dir (path) != 0)
+		return -1;
+
+	/* Named by the time of the snapshot and the digest of all of it:
+	   statistics and the GC cycle change without the layout.
+	 */
+	uint64_t file_digest = xxh64 (mem, size, FILE_SEED);
+	time_t timestamp = head->timestamp;
+	struct tm tm;
+	strftime (name, sizeof (name), "%Y%m%dT%H%M%SZ",
+			  gmtime_r (&timestamp, &tm));
+	snprintf (name + strlen (name), sizeof (name) - strlen (name), "-%016llx",
+			  (unsigned long long) file_digest);
+	snprintf (path, sizeof (path), "%s/manifests/%s", dir, name);
+
+	struct stat st;
+	if (stat (path, &st) == 0) {
+		printf ("Snapshot \"%s\" is stored already as %s\n", db->name, name);
+		return 0;
+	}
+
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *manifest = open_memstream (&text, &text_len);
+	if (manifest == NULL) {
+		fprintf (stderr, "Memory allocation failure\n");
+		return -1;
+	}
+
+	size_t live = MIN (size, (size_t) (db_data (head) - (char *) mem)
+					   + head->first_free);
+	struct store_stats stats = { 0, 0, 0, 0 };
+
+	gear_init ();
+	fprintf (manifest, "%s\nsize %zu\ndigest %016llx\n", STORE_MANIFEST_MAGIC,
+			 size, (unsigned long long) file_digest);
+	int rc = store_region (dir, mem, live, manifest, &stats);
+	if (rc == 0 && all_zero (mem + live, size - live)) {
+		if (size > live)
+			fprintf (manifest, "zero %zu\n", size - live);
+	} else if (rc == 0)
+		rc = store_region (dir, mem + live, size - live, manifest, &stats);
+
+	if (fclose (manifest) != 0)
+		rc = -1;
+	if (rc == 0)
+		rc = write_atomic (path, text, text_len);
+	free (text);
+	if (rc != 0)
+		return -1;
+
+	printf ("Stored \"%s\" as %s: %lu chunks of %llu bytes, %lu new of %llu"
+			" bytes, manifest %zu bytes\n", db->name, name, stats.chunks,
+			stats.bytes, stats.new_chunks, stats.new_bytes, text_len);
+	return 0;
+}
+
+/* Append the chunk ID of LEN bytes from the store in DIR to FD,
+   checking its hash.  BUF holds STORE_CHUNK_MAX bytes.
+ */
+static int
+restore_chunk (const char *dir, const struct chunk_id *id, size_t len,
+			   uint8_t *buf, int fd, struct xxh64_state *digest) {
+	char path[PATH_MAX];
+
+	chunk_path (path, sizeof (path), dir, id);
+	int in = open (path, O_RDONLY);
+	if (in == -1) {
+		fprintf (stderr, "Missing chunk \"%s\": %s\n", path, strerror (errno));
+		return -1;
+	}
+	ssize_t n = read (in, buf, len + 1);
+	close (in);
+
+	struct chunk_id got = chunk_hash (buf, n > 0 ? n : 0);
+	if (n != (ssize_t) len || got.hi != id->hi || got.lo != id->lo) {
+		fprintf (stderr, "Damaged chunk \"%s\"\n", path);
+		return -1;
+	}
+	xxh64_update (digest, buf, len);
+	if (write (fd, buf, len) != (ssize_t) len) {
+		fprintf (stderr, "Cannot write: %s\n", strerror (errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Reassemble the snapshot of MANIFEST (a name in DIR/manifests, or a
+   path) from the store in DIR into OUT.
+ */
+int
+restore_db (const char *dir, const char *manifest, const char *out) {
+	char path[PATH_MAX], line[256];
+
+	if (strchr (manifest, '/') == NULL) {
+		snprintf (path, sizeof (path), "%s/manifests/%s", dir, manifest);
+		manifest = path;
+	}
+	FILE *f = fopen (manifest, "r");
+	if (f == NULL) {
+		fprintf (stderr, "Cannot open manifest \"%s\": %s\n",
+				 manifest, strerror (errno));
+		return -1;
+	}
+
+	size_t size = 0;
+	unsigned long long expected = 0;
+	if (   fgets (line, sizeof (line), f) == NULL
+		|| strncmp (line, STORE_MANIFEST_MAGIC, strlen (STORE_MANIFEST_MAGIC))
+		|| fscanf (f, "size %zu\ndigest %llx\n", &size, &expected) != 2) {
+		fprintf (stderr, "Invalid manifest \"%s\"\n", manifest);
+		fclose (f);
+		return -1;
+	}
+
+	uint8_t *buf = malloc (STORE_CHUNK_MAX + 1);
+	int fd = open (out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (buf == NULL || fd == -1) {
+		fprintf (stderr, "Cannot create \"%s\": %s\n", out, strerror (errno));
+		free (buf);
+		fclose (f);
+		if (fd != -1)
+			close (fd);
+		return -1;
+	}
+
+	struct xxh64_state digest;
+	size_t done = 0;
+	int rc = 0;
+	xxh64_init (&digest, FILE_SEED);
+	while (rc == 0 && fgets (line, sizeof (line), f) != NULL) {
+		unsigned long long hi, lo;
+		char hex[33];
+		size_t len = 0;
+
+		if (   sscanf (line, "chunk %32[0-9a-f] %zu", hex, &len) == 2
+			&& strlen (hex) == 32 && len <= STORE_CHUNK_MAX
+			&& sscanf (hex, "%16llx%16llx", &hi, &lo) == 2) {
+			struct chunk_id id = { hi, lo };
+
+			rc = restore_chunk (dir, &id, len, buf, fd, &digest);
+		} else if (sscanf (line, "zero %zu", &len) == 1) {
+			/* A hole reads as zeros; the digest needs them hashed. */
+			memset (buf, 0, STORE_CHUNK_MAX);
+			for (size_t left = len; left > 0; ) {
+				size_t n = MIN (left, (size_t) STORE_CHUNK_MAX);
+
+				xxh64_update (&digest, buf, n);
+				left -= n;
+			}
+			if (lseek (fd, len, SEEK_CUR) < 0)
+				rc = -1;
+		} else {
+			fprintf (stderr, "Invalid manifest line: %s", line);
+			rc = -1;
+		}
+		done += len;
+	}
+
+	if (rc == 0 && (ftruncate (fd, done) != 0 || close (fd) != 0)) {
+		fprintf (stderr, "Cannot write \"%s\": %s\n", out, strerror (errno));
+		rc = -1;
+	} else if (rc != 0)
+		close (fd);
+	if (rc == 0 && (done != size || xxh64_digest (&digest) != expected)) {
+		fprintf (stderr, "Restored \"%s\" does not match the manifest\n",
+				 out);
+		rc = -1;
+	}
+	if (rc != 0)
+		unlink (out);
+	else
+		printf ("Restored %zu bytes into \"%s\"\n", done, out);
+
+	free (buf);
+	fclose (f);
+	return rc;
+}
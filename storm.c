@@ -0,0 +1,296 @@
+/* Detection of negative cache storms.
+
+   A burst of lookups of names that do not exist, random labels under
+   one domain typically, fills a cache with negative entries.  nscd
+   only removes them when they expire, so while the burst lasts they
+   take the room of the data area and the bucket chains from positive
+   ones.  The detector samples a live database every few seconds and
+   looks at the entries added since the previous sample only: nscd
+   allocates the data area upwards from first_free and pushes new hash
+   entries to the front of their chain, so the entries above the
+   previous first_free, the watermark, are found by walking each chain
+   until the first entry below it.  A garbage collection moves
+   everything, so after one the watermark is simply reset.
+
+   For the new records, a sample reports how many are negative, their
+   rate, their share of the growth of first_free, the most common domain
+   suffix of their keys and how many have a first label that looks
+   random.  It raises an alert when negative records outnumber positive
+   ones and take more than the given share of the growth.
+
+   The database is read while nscd changes it and is not verified:
+   every reference is checked to lie below first_free, and a sample is
+   dropped if the GC cycle changed while it was taken.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "nscd_dump.h"
+
+#define STORM_DEFAULT_SHARE		50		/* Percent of the growth. */
+#define STORM_MIN_NEGATIVE		10		/* Records in a sample to alert. */
+#define STORM_SUFFIXES			64
+#define STORM_SUFFIX_LEN		64
+#define STORM_RANDOM_LEN		10		/* Shortest random looking label. */
+#define STORM_RANDOM_ENTROPY	3.3		/* Bits per character. */
+
+struct storm {
+	struct db_file db;
+	unsigned share;
+	int baseline;				/* Whether WATERMARK is set. */
+	size_t watermark;
+	int32_t gc_cycle;
+	struct timespec when;
+	unsigned long alerts;
+};
+
+/* The new records of one sample. */
+struct sample {
+	unsigned long positive, negative;
+	unsigned long long positive_bytes, negative_bytes;
+	unsigned long random_labels, text_keys;
+	struct {
+		char suffix[STORM_SUFFIX_LEN];
+		unsigned long count;
+	} suffixes[STORM_SUFFIXES];
+	unsigned nsuffixes;
+};
+
+/* Whether the LEN byte label looks generated rather than chosen. */
+static int
+random_label (const char *label, size_t len) {
+	unsigned counts[256] = { 0 };
+	int letters = 0, digits = 0, vowels = 0;
+	double entropy = 0;
+
+	if (len < STORM_RANDOM_LEN)
+		return 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = label[i];
+
+		counts[c]++;
+		if (c >= '0' && c <= '9')
+			digits++;
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') {
+			letters++;
+			vowels += strchr ("aeiou", c | 0x20) != NULL;
+		}
+	}
+	for (int c = 0; c < 256; c++)
+		if (counts[c] != 0) {
+			double p = (double) counts[c] / len;
+
+			entropy -= p * log2 (p);
+		}
+	return entropy >= STORM_RANDOM_ENTROPY
+		&& ((letters != 0 && digits != 0) || (letters != 0 && vowels == 0));
+}
+
+/* Account the text key KEY of LEN bytes of a new negative record. */
+static void
+key_pattern (struct sample *s, const char *key, size_t len) {
+	len = strnlen (key, len);
+	while (len > 0 && key[len - 1] == '.')
+		len--;
+	if (len == 0)
+		return;
+	s->text_keys++;
+
+	const char *dot = memchr (key, '.', len);
+	if (dot != NULL && random_label (key, dot - key))
+		s->random_labels++;
+
+	/* The last two labels. */
+	size_t start = len, dots = 0;
+	while (start > 0 && !(key[start - 1] == '.' && ++dots == 2))
+		start--;
+	if (len - start >= STORM_SUFFIX_LEN)
+		return;
+
+	unsigned i;
+	for (i = 0; i < s->nsuffixes; i++)
+		if (   strncmp (s->suffixes[i].suffix, key + start, len - start) == 0
+			&& s->suffixes[i].suffix[len - start] == '\0')
+			break;
+	if (i == s->nsuffixes) {
+		if (i == STORM_SUFFIXES)
+			return;
+		memcpy (s->suffixes[i].suffix, key + start, len - start);
+		s->suffixes[i].suffix[len - start] = '\0';
+		s->nsuffixes++;
+	}
+	s->suffixes[i].count++;
+}
+
+/* Account the entries of the chain starting at RUN above the watermark,
+   below FIRST_FREE.
+ */
+static void
+walk_new (struct sample *s, const char *data, ref_t run, size_t watermark,
+		  size_t first_free) {
+	/* A chain of new entries cannot be longer than they can be many. */
+	size_t steps = (first_free - watermark) / sizeof (struct hashentry) + 1;
+
+	while (   run != ENDREF && run >= watermark && steps-- > 0
+		   && run % BLOCK_ALIGN == 0
+		   && run + sizeof (struct hashentry) <= first_free) {
+		struct hashentry *he = (struct hashentry *) (data + run);
+		ref_t packet = he->packet;
+
+		if (   packet % BLOCK_ALIGN != 0
+			|| packet + sizeof (struct datahead) > first_free)
+			break;
+
+		struct datahead *dh = (struct datahead *) (data + packet);
+		size_t bytes = sizeof (*he);
+		if (he->first && packet >= watermark)
+			bytes += dh->allocsize;
+		if (dh->notfound) {
+			s->negative_bytes += bytes;
+			if (he->first) {
+				s->negative++;
+				if (   he->type != GETHOSTBYADDR
+					&& he->type != GETHOSTBYADDRv6 && he->len > 0
+					&& he->key + (size_t) he->len <= first_free)
+					key_pattern (s, data + he->key, he->len);
+			}
+		} else {
+			s->positive_bytes += bytes;
+			s->positive += he->first;
+		}
+		run = he->next;
+	}
+}
+
+static double
+percent (unsigned long long part, unsigned long long all) {
+	return all ? 100.0 * part / all : 0;
+}
+
+static void
+print_sample (struct storm *st, const struct sample *s, size_t growth,
+			  double seconds) {
+	char when[32];
+	time_t now = time (NULL);
+	struct tm tm;
+
+	strftime (when, sizeof (when), "%H:%M:%S", localtime_r (&now, &tm));
+	printf ("%s +%lu records, %lu negative (%.0f%%), %.1f negative/s,"
+			" +%zu bytes, %.0f%% negative", when, s->positive + s->negative,
+			s->negative, percent (s->negative, s->positive + s->negative),
+			seconds > 0 ? s->negative / seconds : 0, growth,
+			percent (s->negative_bytes, growth));
+
+	unsigned top = 0;
+	for (unsigned i = 1; i < s->nsuffixes; i++)
+		if (s->suffixes[i].count > s->suffixes[top].count)
+			top = i;
+	if (s->text_keys != 0)
+		printf ("; %.0f%% under %s, %.0f%% random labels",
+				percent (s->suffixes[top].count, s->text_keys),
+				s->nsuffixes ? s->suffixes[top].suffix : "-",
+				percent (s->random_labels, s->text_keys));
+	printf ("\n");
+
+	if (   s->negative >= STORM_MIN_NEGATIVE && s->negative > s->positive
+		&& percent (s->negative_bytes, growth) >= st->share) {
+		printf ("ALERT: negative entries crowd out positive ones in \"%s\"\n",
+				st->db.name);
+		st->alerts++;
+	}
+	fflush (stdout);
+}
+
+/* Take a sample of the database of ST. */
+static int
+storm_sample (unsigned index, enum watch_reason reason, void *arg) {
+	struct storm *st = arg;
+	struct database_pers_head *head = st->db.mem;
+	struct stat64 fst;
+	struct timespec now;
+
+	/* A file cut short would fault on the first access. */
+	if (   fstat64 (st->db.fd, &fst) != 0
+		|| (size_t) fst.st_size < sizeof (*head))
+		return 0;
+	st->db.st = fst;
+
+	int32_t gc_cycle = head->gc_cycle;
+	size_t data_off = db_data (head) - (char *) st->db.mem;
+	size_t first_free = head->first_free;
+	if (   (gc_cycle & 1) || head->first_free < 0
+		|| data_off + first_free > (size_t) fst.st_size
+		|| (size_t) fst.st_size > st->db.mapsize)
+		return 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	if (   !st->baseline || gc_cycle != st->gc_cycle
+		|| first_free < st->watermark) {
+		if (st->baseline)
+			printf ("GC cycle %d, watching from %zu bytes\n", gc_cycle,
+					first_free);
+		st->baseline = 1;
+		st->watermark = first_free;
+		st->gc_cycle = gc_cycle;
+		st->when = now;
+		return 0;
+	}
+	if (first_free == st->watermark)
+		return 0;
+
+	struct sample s;
+	memset (&s, 0, sizeof (s));
+	const char *data = db_data (head);
+	for (nscd_ssize_t cnt = 0; cnt < head->module; ++cnt)
+		walk_new (&s, data, head->array[cnt], st->watermark, first_free);
+	if (head->gc_cycle != gc_cycle)
+		return 0;
+
+	double seconds = (now.tv_sec - st->when.tv_sec)
+		+ (now.tv_nsec - st->when.tv_nsec) / 1e9;
+	print_sample (st, &s, first_free - st->watermark, seconds);
+	st->watermark = first_free;
+	st->when = now;
+	return 0;
+}
+
+/* Watch DB for negative cache storms, sampling it every INTERVAL_MS
+   milliseconds COUNT times or forever if 0, and alerting when negative
+   records take more than SHARE percent (0 for the default) of the
+   growth.
+ */
+int
+storm_db (struct db_file *db, unsigned share, unsigned interval_ms,
+		  unsigned count) {
+	struct storm st;
+
+	memset (&st, 0, sizeof (st));
+	st.db = *db;
+	st.share = share ? share : STORM_DEFAULT_SHARE;
+
+	struct database_pers_head *head = db->mem;
+	printf ("Watching \"%s\" from %d bytes, alerting above %u%% negative\n",
+			db->name, head->first_free, st.share);
+	fflush (stdout);
+
+	const char *path = db->name;
+	int rc = watch_files (&path, 1, interval_ms, count, storm_sample, &st);
+	if (st.alerts != 0)
+		printf ("%lu alerts\n", st.alerts);
+	return rc;
+}
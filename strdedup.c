@@ -0,0 +1,267 @@
+/* Duplicate strings in a database.
+
+   nscd stores every string of a record in its packet, so a name that
+   is the key of one record, the canonical name of another and an alias
+   of a third is stored three times.  This analysis interns the strings
+   of every packet once, the text keys of its entries, the official name
+   and aliases of host records and the canonical name of addrinfo
+   records, as print_hst_resp_data () and print_ai_resp_data () show
+   them, into a hash-consed arena: each distinct string is kept once
+   with its number of occurrences.  The bytes beyond the first copy of
+   each string are what sharing strings would save.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nscd_dump.h"
+
+#define STRDEDUP_TOP		20
+#define STRDEDUP_SEED		0x6e7363645f737472ULL
+
+/* Where in a record a string is. */
+enum string_role {
+	ROLE_KEY,
+	ROLE_NAME,
+	ROLE_ALIAS,
+	ROLE_CANON,
+	NROLES
+};
+
+static const char *const role_names[NROLES] = {
+	"Keys", "Host names", "Aliases", "Canonical names"
+};
+
+/* A distinct string: LEN bytes at OFF in the arena. */
+struct interned {
+	uint64_t hash;
+	size_t off;
+	uint32_t len;
+	uint32_t count;
+};
+
+struct string_table {
+	struct interned *slots;		/* Open addressing, LEN 0 if free. */
+	size_t size, used;
+	char *arena;
+	size_t arena_len, arena_size;
+	unsigned long long strings[NROLES], bytes[NROLES];
+};
+
+static int
+table_grow (struct string_table *t) {
+	size_t size = t->size ? 2 * t->size : 4096;
+	struct interned *slots = calloc (size, sizeof (*slots));
+	if (slots == NULL)
+		return -1;
+
+	for (size_t i = 0; i < t->size; i++) {
+		if (t->slots[i].len == 0)
+			continue;
+		size_t j = t->slots[i].hash & (size - 1);
+		while (slots[j].len != 0)
+			j = (j + 1) & (size - 1);
+		slots[j] = t->slots[i];
+	}
+	free (t->slots);
+	t->slots = slots;
+	t->size = size;
+	return 0;
+}
+
+/* Count the LEN byte string S in ROLE, adding it to the arena the first
+   time it is seen.
+ */
+static int
+intern (struct string_table *t, const char *s, size_t len,
+		enum string_role role) {
+	if (len == 0 || len > UINT32_MAX)
+		return 0;
+	if (2 * (t->used + 1) > t->size && table_grow (t) != 0)
+		return -1;
+
+	t->strings[role]++;
+	t->bytes[role] += len;
+
+	uint64_t hash = xxh64 (s, len, STRDEDUP_SEED);
+	size_t j = hash & (t->size - 1);
+	for (; t->slots[j].len != 0; j = (j + 1) & (t->size - 1)) {
+		struct interned *in = &t->slots[j];
+
+		if (   in->hash == hash && in->len == len
+			&& memcmp (t->arena + in->off, s, len) == 0) {
+			in->count++;
+			return 0;
+		}
+	}
+
+	if (t->arena_len + len > t->arena_size) {
+		size_t size = MAX (2 * t->arena_size, t->arena_len + len + 65536);
+		char *arena = realloc (t->arena, size);
+		if (arena == NULL)
+			return -1;
+		t->arena = arena;
+		t->arena_size = size;
+	}
+	memcpy (t->arena + t->arena_len, s, len);
+	t->slots[j].hash = hash;
+	t->slots[j].off = t->arena_len;
+	t->slots[j].len = len;
+	t->slots[j].count = 1;
+	t->arena_len += len;
+	t->used++;
+	return 0;
+}
+
+/* Intern the strings of the record in DH, which HE points to. */
+static int
+intern_record (struct string_table *t, struct hashentry *he,
+			   struct datahead *dh) {
+	if (dh->notfound)
+		return 0;
+
+	if (he->type == GETAI) {
+		struct ai_view view;
+
+		if (decode_ai (dh, &view) != 0)
+			return 0;
+		return intern (t, view.canon, view.resp->canonlen, ROLE_CANON);
+	}
+
+	if (   he->type != GETHOSTBYNAME && he->type != GETHOSTBYNAMEv6
+		&& he->type != GETHOSTBYADDR && he->type != GETHOSTBYADDRv6)
+		return 0;
+
+	struct hst_view view;
+	if (decode_hst (dh, &view) != 0)
+		return 0;
+	if (intern (t, view.name, view.resp->h_name_len, ROLE_NAME) != 0)
+		return -1;
+
+	const char *alias = view.aliases;
+	for (nscd_ssize_t i = 0; i < view.resp->h_aliases_cnt; i++) {
+		uint32_t len = hst_alias_len (&view, i);
+
+		if (intern (t, alias, len, ROLE_ALIAS) != 0)
+			return -1;
+		alias += len;
+	}
+	return 0;
+}
+
+static int
+compare_waste (const void *a, const void *b) {
+	const struct interned *x = a, *y = b;
+	unsigned long long wx = (unsigned long long) (x->count - 1) * x->len;
+	unsigned long long wy = (unsigned long long) (y->count - 1) * y->len;
+
+	if (wx != wy)
+		return wx > wy ? -1 : 1;
+	return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static double
+percent (unsigned long long part, unsigned long long all) {
+	return all ? 100.0 * part / all : 0;
+}
+
+static void
+print_report (struct string_table *t, struct database_pers_head *head) {
+	unsigned long long strings = 0, bytes = 0, dup_strings = 0;
+
+	for (int r = 0; r < NROLES; r++) {
+		strings += t->strings[r];
+		bytes += t->bytes[r];
+	}
+	unsigned long long wasted = bytes - t->arena_len;
+
+	printf ("Strings                   : %llu, %llu bytes\n", strings, bytes);
+	printf ("Distinct strings          : %zu, %zu bytes\n", t->used,
+			t->arena_len);
+	printf ("Duplicate bytes           : %llu (%.1f%% of string bytes,"
+			" %.1f%% of used data)\n", wasted, percent (wasted, bytes),
+			percent (wasted, head->first_free));
+	for (int r = 0; r < NROLES; r++)
+		printf ("  %-23s : %llu, %llu bytes\n", role_names[r],
+				t->strings[r], t->bytes[r]);
+
+	/* Gather the repeated strings at the front and rank them. */
+	size_t n = 0;
+	for (size_t i = 0; i < t->size; i++)
+		if (t->slots[i].len != 0 && t->slots[i].count > 1) {
+			t->slots[n++] = t->slots[i];
+			dup_strings++;
+		}
+	qsort (t->slots, n, sizeof (*t->slots), compare_waste);
+
+	printf ("\nRepeated strings          : %llu\n", dup_strings);
+	if (n != 0)
+		printf ("\nTop repeated strings by duplicate bytes:\n");
+	for (size_t i = 0; i < n && i < STRDEDUP_TOP; i++) {
+		const struct interned *in = &t->slots[i];
+		int len = in->len;
+
+		/* Strings are stored with their terminating NUL. */
+		if (len > 0 && t->arena[in->off + len - 1] == '\0')
+			len--;
+		printf ("  %8llu bytes  %6u times  \"%.*s\"\n",
+				(unsigned long long) (in->count - 1) * in->len, in->count,
+				len, t->arena + in->off);
+	}
+}
+
+/* Report the strings stored more than once in DB. */
+int
+strdedup_db (struct db_file *db) {
+	struct database_pers_head *head = db->mem;
+	struct string_table t;
+	int rc = 0;
+
+	const char *msg = verify_persistent_db (db->mem, &db->head);
+	if (msg != NULL) {
+		fprintf (stderr, "Error validating database file \"%s\": %s\n",
+				 db->name, msg);
+		return -1;
+	}
+
+	char *data = db_data (head);
+	uint8_t *seen = calloc (head->first_free / BLOCK_ALIGN / 8 + 1, 1);
+	memset (&t, 0, sizeof (t));
+	if (seen == NULL || table_grow (&t) != 0)
+		rc = -1;
+
+	for (nscd_ssize_t cnt = 0; rc == 0 && cnt < head->module; ++cnt)
+		for (ref_t run = head->array[cnt]; rc == 0 && run != ENDREF; ) {
+			struct hashentry *he = (struct hashentry *) (data + run);
+			struct datahead *dh = (struct datahead *) (data + he->packet);
+
+			/* Alias entries point to strings of their packet. */
+			if (   he->first && he->type != GETHOSTBYADDR
+				&& he->type != GETHOSTBYADDRv6)
+				rc = intern (&t, data + he->key, he->len, ROLE_KEY);
+			if (rc == 0 && !test_and_set (seen, he->packet / BLOCK_ALIGN))
+				rc = intern_record (&t, he, dh);
+			run = he->next;
+		}
+
+	if (rc != 0)
+		fprintf (stderr, "Memory allocation failure\n");
+	else
+		print_report (&t, head);
+
+	free (seen);
+	free (t.slots);
+	free (t.arena);
+	return rc;
+}
@@ -0,0 +1,215 @@
+/* Change notification for database files.
+
+   watch_files () calls back for a set of files when they may have
+   changed, and otherwise sleeps.  The directories holding the files
+   are watched with inotify, one watch per directory however many files
+   it holds, so that writes, files closed after writing, and files
+   created or renamed over the watched ones wake the loop for the files
+   they concern.  nscd however writes its databases through shared
+   mappings, which raise no inotify events, so a timerfd also wakes the
+   loop every interval for all files.  Both descriptors are waited on
+   with a single epoll instance.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+
+#include "nscd_dump.h"
+
+#define WATCH_DIR_EVENTS	(IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE \
+							 | IN_MOVED_TO | IN_DELETE)
+#define WATCH_SELF_EVENTS	(IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct watched {
+	int wd;						/* Of the directory. */
+	const char *name;			/* Within it. */
+	enum watch_reason pending;	/* WATCH_NONE if nothing happened. */
+};
+
+struct watch {
+	int inotify_fd, timer_fd, epoll_fd;
+	struct watched *files;
+	unsigned n;
+	int gone;					/* A watched directory went away. */
+};
+
+/* Watch the directory of PATH, recording the file in W. */
+static int
+add_file (struct watch *w, const char *path, struct watched *f) {
+	char dir[PATH_MAX];
+	const char *slash = strrchr (path, '/');
+
+	if (slash == NULL)
+		strcpy (dir, ".");
+	else if (slash == path)
+		strcpy (dir, "/");
+	else
+		snprintf (dir, sizeof (dir), "%.*s", (int) (slash - path), path);
+
+	f->name = slash ? slash + 1 : path;
+	f->pending = WATCH_NONE;
+	f->wd = inotify_add_watch (w->inotify_fd, dir,
+							   WATCH_DIR_EVENTS | WATCH_SELF_EVENTS);
+	if (f->wd == -1) {
+		fprintf (stderr, "Cannot watch \"%s\": %s\n", dir, strerror (errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Mark the files the queued inotify events concern. */
+static void
+read_events (struct watch *w) {
+	char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+	ssize_t len;
+
+	while ((len = read (w->inotify_fd, buf, sizeof (buf))) > 0)
+		for (char *p = buf; p < buf + len; ) {
+			const struct inotify_event *ev = (const struct inotify_event *) p;
+
+			for (unsigned i = 0; i < w->n; i++) {
+				struct watched *f = &w->files[i];
+
+				if (f->wd != ev->wd)
+					continue;
+				if (ev->mask & WATCH_SELF_EVENTS)
+					w->gone = 1;
+				else if (ev->len != 0 && strcmp (ev->name, f->name) == 0)
+					f->pending = WATCH_EVENT;
+			}
+			p += sizeof (*ev) + ev->len;
+		}
+}
+
+static void
+watch_close (struct watch *w) {
+	if (w->epoll_fd != -1)
+		close (w->epoll_fd);
+	if (w->timer_fd != -1)
+		close (w->timer_fd);
+	if (w->inotify_fd != -1)
+		close (w->inotify_fd);
+	free (w->files);
+}
+
+static int
+watch_open (struct watch *w, const char *const *paths, unsigned n,
+			unsigned interval_ms) {
+	struct itimerspec its = {
+		{ interval_ms / 1000, (interval_ms % 1000) * 1000000L },
+		{ interval_ms / 1000, (interval_ms % 1000) * 1000000L }
+	};
+	struct epoll_event ev;
+
+	w->n = n;
+	w->gone = 0;
+	w->files = calloc (n, sizeof (*w->files));
+	w->inotify_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	w->timer_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	w->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (   w->files == NULL || w->inotify_fd == -1 || w->timer_fd == -1
+		|| w->epoll_fd == -1 || timerfd_settime (w->timer_fd, 0, &its,
+												 NULL) != 0) {
+		fprintf (stderr, "Cannot set up watching: %s\n", strerror (errno));
+		return -1;
+	}
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = w->inotify_fd;
+	if (epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, w->inotify_fd, &ev) != 0)
+		return -1;
+	ev.data.fd = w->timer_fd;
+	if (epoll_ctl (w->epoll_fd, EPOLL_CTL_ADD, w->timer_fd, &ev) != 0)
+		return -1;
+
+	for (unsigned i = 0; i < n; i++)
+		if (add_file (w, paths[i], &w->files[i]) != 0)
+			return -1;
+	return 0;
+}
+
+/* Call FN for each of the N files PATHS once at first, then whenever
+   inotify reports a change to it and for all of them every INTERVAL_MS
+   milliseconds.  Stops after ROUNDS rounds of calls (0 for no limit),
+   when FN returns nonzero, or when a watched directory is removed.
+ */
+int
+watch_files (const char *const *paths, unsigned n, unsigned interval_ms,
+			 unsigned rounds, watch_fn fn, void *arg) {
+	struct watch w = { -1, -1, -1, NULL, 0, 0 };
+	int rc = 0;
+
+	if (watch_open (&w, paths, n, interval_ms) != 0) {
+		watch_close (&w);
+		return -1;
+	}
+	for (unsigned i = 0; i < n; i++)
+		w.files[i].pending = WATCH_START;
+
+	for (unsigned round = 0; rounds == 0 || round < rounds; round++) {
+		/* Wait unless the first round or events are pending. */
+		for (int ready = 0; ready == 0 && round > 0; ) {
+			struct epoll_event events[2];
+			int nev = epoll_wait (w.epoll_fd, events, 2, -1);
+
+			if (nev < 0 && errno != EINTR) {
+				fprintf (stderr, "epoll_wait () failed: %s\n",
+						 strerror (errno));
+				watch_close (&w);
+				return -1;
+			}
+			for (int e = 0; e < nev; e++)
+				if (events[e].data.fd == w.inotify_fd)
+					read_events (&w);
+				else {
+					uint64_t expirations;
+
+					if (read (w.timer_fd, &expirations,
+							  sizeof (expirations)) > 0)
+						for (unsigned i = 0; i < n; i++)
+							if (w.files[i].pending == WATCH_NONE)
+								w.files[i].pending = WATCH_TIMER;
+				}
+			for (unsigned i = 0; i < n; i++)
+				ready |= w.files[i].pending != WATCH_NONE;
+			ready |= w.gone;
+		}
+		if (w.gone) {
+			fprintf (stderr, "Watched directory removed\n");
+			rc = -1;
+			break;
+		}
+
+		int stop = 0;
+		for (unsigned i = 0; i < n && !stop; i++)
+			if (w.files[i].pending != WATCH_NONE) {
+				enum watch_reason reason = w.files[i].pending;
+
+				w.files[i].pending = WATCH_NONE;
+				stop = fn (i, reason, arg);
+			}
+		if (stop)
+			break;
+	}
+
+	watch_close (&w);
+	return rc;
+}
@@ -0,0 +1,74 @@
+/* Minimal fork/join helper for the data-parallel stages.
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published
+   by the Free Software Foundation; version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+*/
+
+#include <alloca.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nscd_dump.h"
+
+struct worker {
+	pthread_t thread;
+	size_t begin, end;
+	unsigned index;
+	parallel_fn fn;
+	void *arg;
+};
+
+static void *
+worker_main (void *p) {
+	struct worker *w = p;
+
+	w->fn (w->begin, w->end, w->index, w->arg);
+	return NULL;
+}
+
+/* Split [0, N) into NTHREADS contiguous ranges and run FN over each of
+   them, the first one in the calling thread.  Falls back to fewer
+   threads if they cannot be created.
+ */
+void
+parallel_for (unsigned nthreads, size_t n, parallel_fn fn, void *arg) {
+	if (nthreads > n)
+		nthreads = n;
+	if (nthreads <= 1) {
+		fn (0, n, 0, arg);
+		return;
+	}
+
+	struct worker *w = alloca (nthreads * sizeof (*w));
+	size_t step = n / nthreads, rest = n % nthreads, begin = 0;
+
+	for (unsigned i = 0; i < nthreads; i++) {
+		w[i].begin = begin;
+		w[i].end = begin + step + (i < rest);
+		w[i].index = i;
+		w[i].fn = fn;
+		w[i].arg = arg;
+		begin = w[i].end;
+	}
+
+	unsigned started = 1;
+	for (unsigned i = 1; i < nthreads; i++, started++)
+		if (pthread_create (&w[i].thread, NULL, worker_main, &w[i]) != 0)
+			break;
+
+	/* Ranges no thread could be started for are run here. */
+	fn (w[0].begin, w[0].end, 0, arg);
+	for (unsigned i = started; i < nthreads; i++)
+		fn (w[i].begin, w[i].end, i, arg);
+
+	for (unsigned i = 1; i < started; i++)
+		pthread_join (w[i].thread, NULL);
+}